@@ -0,0 +1,156 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "corpus.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+int
+corpus_append(struct matrix_buf *buf, const char *fmt, ...) {
+	char tmp[1024];
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+
+	if (len < 0 || (size_t) len >= sizeof(tmp)) {
+		return -1;
+	}
+
+	return matrix_buf_append(buf, tmp, (size_t) len);
+}
+
+static int
+append_member(struct matrix_buf *buf, size_t room, size_t member, bool comma) {
+	return corpus_append(
+		buf,
+		"%s{\"type\":\"m.room.member\",\"state_key\":\"@user%zu:localhost\","
+		"\"sender\":\"@user%zu:localhost\",\"event_id\":\"$member%zu_%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"membership\":"
+		"\"join\",\"displayname\":\"User %zu\",\"avatar_url\":"
+		"\"mxc://localhost/avatar%zu\"},\"unsigned\":{\"age\":1234}}",
+		comma ? "," : "", member, member, room, member, member, member);
+}
+
+int
+corpus_message(struct matrix_buf *buf, size_t room, size_t seq,
+			   size_t body_len, bool comma) {
+	static const char padding[] = " lorem ipsum dolor sit amet";
+
+	int ret = corpus_append(
+		buf,
+		"%s{\"type\":\"m.room.message\",\"sender\":\"@user%zu:localhost\","
+		"\"event_id\":\"$msg%zu_%zu\",\"origin_server_ts\":%zu,\"unsigned\":{"
+		"\"age\":42},\"content\":{\"msgtype\":\"m.text\",\"format\":"
+		"\"org.matrix.custom.html\",\"formatted_body\":\"<b>Message "
+		"%zu</b>\",\"body\":\"Message %zu in room %zu",
+		comma ? "," : "", seq % CORPUS_SENDERS, room, seq, 1620000000000 + seq,
+		seq, seq, room);
+
+	for (size_t len = 0; ret == 0 && len < body_len;
+		 len += sizeof(padding) - 1) {
+		ret = matrix_buf_append(buf, padding, sizeof(padding) - 1);
+	}
+
+	return ret == 0 ? corpus_append(buf, "\"}}") : -1;
+}
+
+int
+corpus_state(struct matrix_buf *buf, size_t room, size_t members) {
+	int ret = corpus_append(
+		buf,
+		"{\"type\":\"m.room.create\",\"state_key\":\"\",\"sender\":"
+		"\"@user0:localhost\",\"event_id\":\"$create%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"creator\":"
+		"\"@user0:localhost\",\"room_version\":\"6\"}},"
+		"{\"type\":\"m.room.name\",\"state_key\":\"\",\"sender\":"
+		"\"@user0:localhost\",\"event_id\":\"$name%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"name\":"
+		"\"Room %zu\"}},"
+		"{\"type\":\"m.room.topic\",\"state_key\":\"\",\"sender\":"
+		"\"@user0:localhost\",\"event_id\":\"$topic%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"topic\":"
+		"\"A topic for room %zu\"}},"
+		"{\"type\":\"m.room.join_rules\",\"state_key\":\"\",\"sender\":"
+		"\"@user0:localhost\",\"event_id\":\"$rules%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"join_rule\":"
+		"\"invite\"}},"
+		"{\"type\":\"m.room.power_levels\",\"state_key\":\"\",\"sender\":"
+		"\"@user0:localhost\",\"event_id\":\"$power%zu\","
+		"\"origin_server_ts\":1620000000000,\"content\":{\"ban\":50,"
+		"\"kick\":50,\"redact\":50,\"invite\":0,\"events_default\":0,"
+		"\"state_default\":50,\"users_default\":0,\"users\":{"
+		"\"@user0:localhost\":100},\"events\":{\"m.room.name\":50}}}",
+		room, room, room, room, room, room, room);
+
+	for (size_t i = 0; ret == 0 && i < members; i++) {
+		ret = append_member(buf, room, i, true);
+	}
+
+	return ret;
+}
+
+static int
+append_room(struct matrix_buf *buf, size_t room,
+			const struct corpus_shape *shape, bool comma) {
+	int ret = corpus_append(
+		buf,
+		"%s\"!room%zu:localhost\":{\"summary\":{\"m.joined_member_count\":%zu,"
+		"\"m.invited_member_count\":0,\"m.heroes\":[\"@user1:localhost\"]},"
+		"\"state\":{\"events\":[",
+		comma ? "," : "", room, shape->members);
+
+	if (ret == 0) {
+		ret = corpus_state(buf, room, shape->members);
+	}
+
+	if (ret == 0) {
+		ret = corpus_append(buf,
+							"]},\"timeline\":{\"limited\":true,\"prev_batch\":"
+							"\"p%zu\",\"events\":[",
+							room);
+	}
+
+	for (size_t i = 0; ret == 0 && i < shape->messages; i++) {
+		ret = corpus_message(buf, room, i, shape->body_len, i > 0);
+	}
+
+	return ret == 0 ? corpus_append(
+						  buf, "]},\"ephemeral\":{\"events\":[{\"type\":"
+							   "\"m.typing\",\"content\":{\"user_ids\":["
+							   "\"@user1:localhost\"]}}]}}")
+					: -1;
+}
+
+int
+corpus_sync(struct matrix_buf *buf, const char *next_batch,
+			const struct corpus_shape *shape) {
+	int ret = corpus_append(buf, "{\"next_batch\":\"%s\",\"rooms\":{\"join\":{",
+							next_batch);
+
+	for (size_t i = 0; ret == 0 && i < shape->rooms; i++) {
+		ret = append_room(buf, i, shape, i > 0);
+	}
+
+	if (ret == 0) {
+		ret = corpus_append(buf, "},\"invite\":{");
+	}
+
+	for (size_t i = 0; ret == 0 && i < shape->invites; i++) {
+		ret = corpus_append(buf,
+							"%s\"!invite%zu:localhost\":{\"invite_state\":{"
+							"\"events\":[",
+							i > 0 ? "," : "", i);
+
+		if (ret == 0) {
+			ret = append_member(buf, shape->rooms + i, i, false);
+		}
+
+		if (ret == 0) {
+			ret = corpus_append(buf, "]}}");
+		}
+	}
+
+	return ret == 0 ? corpus_append(buf, "},\"leave\":{}}}") : -1;
+}
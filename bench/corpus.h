@@ -0,0 +1,37 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Deterministic generators for /sync bodies, shared by the benchmark and the
+ * mock homeserver. Rooms are named !room<N>:localhost and users
+ * @user<N>:localhost. All functions return -1 on failure and 0 on success. */
+
+#include "matrix-priv.h"
+
+enum {
+	/* Messages are sent by @user0 to @user<CORPUS_SENDERS - 1>. */
+	CORPUS_SENDERS = 8,
+};
+
+struct corpus_shape {
+	size_t rooms;
+	size_t members;	 /* m.room.member events per room. */
+	size_t messages; /* Timeline events per room. */
+	size_t invites;	 /* Rooms in rooms.invite. */
+	size_t body_len; /* Minimum length of message bodies. */
+};
+
+__attribute__((format(printf, 2, 3))) int
+corpus_append(struct matrix_buf *buf, const char *fmt, ...);
+/* Events are prefixed with a comma if comma is true, the caller writes the
+ * brackets. seq makes the event ID unique within the room. */
+int
+corpus_message(struct matrix_buf *buf, size_t room, size_t seq,
+			   size_t body_len, bool comma);
+/* The state of a room with its creation events and members. */
+int
+corpus_state(struct matrix_buf *buf, size_t room, size_t members);
+/* A complete /sync response. */
+int
+corpus_sync(struct matrix_buf *buf, const char *next_batch,
+			const struct corpus_shape *shape);
@@ -0,0 +1,901 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* A stand-in homeserver that speaks just enough of the client-server API to
+ * drive libmatrix, for load-testing without Synapse. It is single threaded and
+ * serves any number of keep-alive connections with poll().
+ *
+ * /login accepts any credentials. Filters can be uploaded, their timeline limit
+ * and lazy_load_members apply to initial syncs. The first /sync (Without
+ * since) returns an initial sync of every room, subsequent ones long-poll
+ * until new messages are generated at the configured rate, spread over the
+ * rooms round-robin. The since token is the number of generated messages, so
+ * clients can resume from any token. /messages pages backwards through a fixed
+ * history per room, which is the same before any token other than those it
+ * returned itself.
+ *
+ * Usage: mock_homeserver [options]
+ *   -p port      Listen on 127.0.0.1:port (Default 8008).
+ *   -r rooms     Joined rooms (Default 100).
+ *   -m members   Members per room in the initial sync (Default 10).
+ *   -e rate      Messages generated per second (Default 100, 0 for none).
+ *   -s bytes     Minimum length of message bodies (Default 64).
+ *   -l ms        Latency added to every response (Default 0).
+ *   -f percent   Respond to requests with a 500 error (Default 0).
+ *   -d percent   Drop the connection instead of responding (Default 0).
+ *   -H messages  History per room for /messages (Default 100).
+ *
+ * Counters are printed to stderr on SIGINT / SIGTERM. */
+
+#include "corpus.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	CONNS_MAX = 256,
+	REQUEST_MAX = 1 << 16,
+	/* The most messages returned by a single incremental sync. */
+	BATCH_MAX = 1000,
+	FILTERS_MAX = 64,
+	/* History messages are numbered from here so that their IDs don't collide
+	 * with those of generated ones. */
+	HISTORY_SEQ = 1000000000,
+};
+
+enum conn_state {
+	CONN_FREE = 0,
+	CONN_READING,
+	CONN_WAITING, /* For the latency to pass or for new messages. */
+	CONN_WRITING,
+};
+
+struct conn {
+	enum conn_state state;
+	int fd;
+	bool close_after;
+	bool long_poll;		 /* Waiting for messages after since. */
+	size_t since;		 /* Only valid if long_poll. */
+	long long ready_ms;	 /* Don't respond before this. */
+	long long expiry_ms; /* Respond even without new messages after this. */
+	size_t request_len;	 /* Bytes of in that belong to the current request. */
+	struct matrix_buf in;
+	struct matrix_buf body;
+	struct matrix_buf out;
+	size_t out_off;
+};
+
+struct options {
+	unsigned short port;
+	struct corpus_shape shape;
+	unsigned rate;
+	unsigned latency_ms;
+	unsigned fail_percent;
+	unsigned drop_percent;
+	size_t history;
+};
+
+struct counters {
+	size_t requests;
+	size_t syncs;
+	size_t paginations;
+	size_t messages;
+	size_t bytes;
+	size_t failures;
+	size_t drops;
+};
+
+struct filter {
+	unsigned timeline_limit; /* 0 if not set. */
+	bool lazy_load_members;
+};
+
+struct server {
+	struct options options;
+	struct counters counters;
+	struct filter filters[FILTERS_MAX];
+	size_t nfilters;
+	long long start_ms;
+	uint64_t rng;
+	struct conn conns[CONNS_MAX];
+};
+
+struct route {
+	const char *method;
+	const char *path; /* '*' matches a single segment. */
+	/* Return the HTTP status code with the body written to conn->body, or 0 if
+	 * the response should be delayed until new messages arrive. */
+	int (*handle)(struct server *, struct conn *, const char *query);
+};
+
+static volatile sig_atomic_t done = 0;
+
+static void
+on_signal(int sig) {
+	(void) sig;
+	done = 1;
+}
+
+static long long
+now_ms(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* xorshift64, so that injected errors are reproducible. */
+static unsigned
+roll_percent(struct server *server) {
+	server->rng ^= server->rng << 13;
+	server->rng ^= server->rng >> 7;
+	server->rng ^= server->rng << 17;
+
+	return (unsigned) (server->rng % 100);
+}
+
+/* The number of messages generated since startup. */
+static size_t
+messages_now(const struct server *server, long long now) {
+	return (size_t) ((now - server->start_ms) * server->options.rate / 1000);
+}
+
+static long long
+message_due_ms(const struct server *server, size_t message) {
+	return server->start_ms +
+		   (long long) (((message + 1) * 1000) / server->options.rate);
+}
+
+static const char *
+query_param(const char *query, const char *name, size_t *len) {
+	size_t name_len = strlen(name);
+
+	for (const char *param = query; param && *param;) {
+		param += (*param == '?' || *param == '&');
+
+		if ((strncmp(param, name, name_len)) == 0 && param[name_len] == '=') {
+			const char *value = &param[name_len + 1];
+
+			*len = strcspn(value, "& ");
+			return value;
+		}
+
+		param = strchr(param, '&');
+	}
+
+	return NULL;
+}
+
+static int
+handle_login(struct server *server, struct conn *conn, const char *query) {
+	(void) server;
+	(void) query;
+
+	return (corpus_append(
+			   &conn->body,
+			   "{\"user_id\":\"@bench:localhost\",\"access_token\":"
+			   "\"mock_token\",\"device_id\":\"MOCK\",\"home_server\":"
+			   "\"localhost\"}")) == 0
+			   ? 200
+			   : 500;
+}
+
+static const char *
+request_body(const struct conn *conn, size_t *len) {
+	const char *body = strstr(conn->in.data, "\r\n\r\n") + 4;
+
+	*len = conn->request_len - (size_t) (body - conn->in.data);
+
+	return body;
+}
+
+static int
+handle_filter(struct server *server, struct conn *conn, const char *query) {
+	(void) query;
+
+	size_t len = 0;
+	const char *body = request_body(conn, &len);
+	cJSON *json = cJSON_ParseWithLength(body, len);
+	cJSON *room = cJSON_GetObjectItemCaseSensitive(json, "room");
+
+	if (!json || server->nfilters == FILTERS_MAX) {
+		cJSON_Delete(json);
+		return (corpus_append(&conn->body,
+							  "{\"errcode\":\"M_BAD_JSON\","
+							  "\"error\":\"Invalid filter\"}")) == 0
+				   ? 400
+				   : 500;
+	}
+
+	double limit = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(
+		cJSON_GetObjectItemCaseSensitive(room, "timeline"), "limit"));
+
+	server->filters[server->nfilters] = (struct filter){
+		.timeline_limit = limit >= 1 ? (unsigned) limit : 0,
+		.lazy_load_members = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(
+			cJSON_GetObjectItemCaseSensitive(room, "state"),
+			"lazy_load_members")),
+	};
+
+	cJSON_Delete(json);
+
+	return (corpus_append(&conn->body, "{\"filter_id\":\"%zu\"}",
+						  server->nfilters++)) == 0
+			   ? 200
+			   : 500;
+}
+
+/* The messages in [start, end) grouped by room. */
+static int
+incremental_sync(struct server *server, struct conn *conn, size_t start,
+				 size_t end) {
+	size_t rooms = server->options.shape.rooms;
+
+	int ret = corpus_append(&conn->body,
+							"{\"next_batch\":\"s%zu\",\"rooms\":{\"join\":{",
+							end);
+
+	for (size_t i = 0; ret == 0 && i < rooms && (start + i) < end; i++) {
+		size_t room = (start + i) % rooms;
+
+		ret = corpus_append(&conn->body,
+							"%s\"!room%zu:localhost\":{\"timeline\":{"
+							"\"limited\":false,\"prev_batch\":\"s%zu\","
+							"\"events\":[",
+							i > 0 ? "," : "", room, start);
+
+		for (size_t seq = start + i; ret == 0 && seq < end; seq += rooms) {
+			ret = corpus_message(&conn->body, room, seq,
+								 server->options.shape.body_len,
+								 seq != (start + i));
+		}
+
+		if (ret == 0) {
+			ret = corpus_append(&conn->body, "]}}");
+		}
+	}
+
+	server->counters.messages += end - start;
+
+	return ret == 0 && (corpus_append(&conn->body, "}}}")) == 0 ? 200 : 500;
+}
+
+static int
+handle_sync(struct server *server, struct conn *conn, const char *query) {
+	size_t len = 0;
+	const char *value = NULL;
+	long long now = now_ms();
+
+	if (!conn->long_poll) {
+		if (!(value = query_param(query, "since", &len))) {
+			char next_batch[32];
+			struct corpus_shape shape = server->options.shape;
+
+			if ((value = query_param(query, "filter", &len))) {
+				size_t i = strtoul(value, NULL, 10);
+				const struct filter *filter =
+					i < server->nfilters ? &server->filters[i] : NULL;
+
+				if (filter && filter->timeline_limit &&
+					shape.messages > filter->timeline_limit) {
+					shape.messages = filter->timeline_limit;
+				}
+
+				/* Only the senders are kept with lazy loading. */
+				if (filter && filter->lazy_load_members &&
+					shape.members > CORPUS_SENDERS) {
+					shape.members = CORPUS_SENDERS;
+				}
+			}
+
+			server->counters.syncs++;
+
+			snprintf(next_batch, sizeof(next_batch), "s%zu",
+					 messages_now(server, now));
+
+			return (corpus_sync(&conn->body, next_batch, &shape)) == 0 ? 200
+																		: 500;
+		}
+
+		if (len < 2 || value[0] != 's') {
+			return (corpus_append(&conn->body,
+								  "{\"errcode\":\"M_INVALID_PARAM\","
+								  "\"error\":\"Invalid since token\"}")) == 0
+					   ? 400
+					   : 500;
+		}
+
+		long long timeout = 0;
+
+		conn->since = strtoul(&value[1], NULL, 10);
+
+		if ((value = query_param(query, "timeout", &len))) {
+			timeout = strtol(value, NULL, 10);
+		}
+
+		conn->long_poll = true;
+		conn->expiry_ms = now + timeout;
+	}
+
+	size_t end = messages_now(server, now);
+
+	if (end <= conn->since && now < conn->expiry_ms) {
+		return 0;
+	}
+
+	conn->long_poll = false;
+
+	if (end > (conn->since + BATCH_MAX)) {
+		end = conn->since + BATCH_MAX;
+	}
+
+	if (end < conn->since) {
+		end = conn->since; /* A token from the future, e.g. after a restart. */
+	}
+
+	server->counters.syncs++;
+
+	return incremental_sync(server, conn, conn->since, end);
+}
+
+/* The room is taken from the request line, as handlers only see the query. */
+static int
+handle_messages(struct server *server, struct conn *conn, const char *query) {
+	size_t len = 0;
+	const char *from = query_param(query, "from", &len);
+	size_t from_len = len;
+	const char *value = query_param(query, "limit", &len);
+	size_t limit = value ? strtoul(value, NULL, 10) : 10;
+	const char *name = strstr(conn->in.data, "/rooms/");
+	size_t room = name && (name = strstr(&name[7], "room"))
+					  ? strtoul(&name[4], NULL, 10)
+					  : 0;
+	size_t pos = server->options.history;
+
+	if (!from || room >= server->options.shape.rooms) {
+		return (corpus_append(&conn->body,
+							  "{\"errcode\":\"M_INVALID_PARAM\","
+							  "\"error\":\"Invalid room or token\"}")) == 0
+				   ? 400
+				   : 500;
+	}
+
+	/* pos is the number of older messages left. */
+	if (from[0] == 'h' && strtoul(&from[1], NULL, 10) < pos) {
+		pos = strtoul(&from[1], NULL, 10);
+	}
+
+	if (limit > BATCH_MAX) {
+		limit = BATCH_MAX;
+	}
+
+	if (limit > pos) {
+		limit = pos;
+	}
+
+	int ret = corpus_append(&conn->body, "{\"start\":\"%.*s\",\"chunk\":[",
+							(int) from_len, from);
+
+	for (size_t i = 1; ret == 0 && i <= limit; i++) {
+		ret = corpus_message(&conn->body, room, HISTORY_SEQ + pos - i,
+							 server->options.shape.body_len, i > 1);
+	}
+
+	server->counters.paginations++;
+	server->counters.messages += limit;
+
+	if (ret == 0 && (pos - limit) > 0) {
+		ret = corpus_append(&conn->body, "],\"end\":\"h%zu\"}", pos - limit);
+	} else if (ret == 0) {
+		ret = corpus_append(&conn->body, "]}");
+	}
+
+	return ret == 0 ? 200 : 500;
+}
+
+static const struct route routes[] = {
+	{"POST", "/_matrix/client/r0/login", handle_login},
+	{"POST", "/_matrix/client/r0/user/*/filter", handle_filter},
+	{"GET", "/_matrix/client/r0/sync", handle_sync},
+	{"GET", "/_matrix/client/r0/rooms/*/messages", handle_messages},
+};
+
+static bool
+path_matches(const char *pattern, const char *path, size_t len) {
+	const char *end = &path[len];
+
+	while (*pattern && path < end) {
+		if (*pattern == '*') {
+			pattern++;
+
+			while (path < end && *path != '/') {
+				path++;
+			}
+		} else if (*pattern++ != *path++) {
+			return false;
+		}
+	}
+
+	return !*pattern && path == end;
+}
+
+static const char *
+status_text(int status) {
+	switch (status) {
+	case 200:
+		return "OK";
+	case 400:
+		return "Bad Request";
+	case 404:
+		return "Not Found";
+	default:
+		return "Internal Server Error";
+	}
+}
+
+static void
+conn_close(struct conn *conn) {
+	close(conn->fd);
+	matrix_buf_finish(&conn->in);
+	matrix_buf_finish(&conn->body);
+	matrix_buf_finish(&conn->out);
+
+	*conn = (struct conn){.state = CONN_FREE, .fd = -1};
+}
+
+static int
+conn_respond(struct server *server, struct conn *conn, int status) {
+	conn->out.len = conn->out_off = 0;
+
+	if ((corpus_append(&conn->out,
+					   "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+					   "Content-Length: %zu\r\n%s\r\n",
+					   status, status_text(status), conn->body.len,
+					   conn->close_after ? "Connection: close\r\n" : "")) ==
+			-1 ||
+		(matrix_buf_append(&conn->out, conn->body.data, conn->body.len)) ==
+			-1) {
+		return -1;
+	}
+
+	server->counters.bytes += conn->out.len;
+	conn->state = CONN_WRITING;
+
+	return 0;
+}
+
+/* Route the request in conn->in, or resume a long-polling sync. */
+static int
+conn_dispatch(struct server *server, struct conn *conn) {
+	char method[8] = {0};
+	char target[2048] = {0};
+
+	if ((sscanf(conn->in.data, "%7s %2047s", method, target)) != 2) {
+		return -1;
+	}
+
+	char *query = strchr(target, '?');
+
+	size_t path_len = query ? (size_t) (query - target) : strlen(target);
+
+	if (!conn->long_poll) {
+		conn->body.len = 0;
+
+		/* Pretend to drop the connection after receiving the request. */
+		if (server->options.drop_percent &&
+			roll_percent(server) < server->options.drop_percent) {
+			server->counters.drops++;
+			return -1;
+		}
+
+		if (server->options.fail_percent &&
+			roll_percent(server) < server->options.fail_percent) {
+			server->counters.failures++;
+
+			return (corpus_append(&conn->body,
+								  "{\"errcode\":\"M_UNKNOWN\","
+								  "\"error\":\"Injected failure\"}")) == 0
+					   ? conn_respond(server, conn, 500)
+					   : -1;
+		}
+	}
+
+	for (size_t i = 0; i < (sizeof(routes) / sizeof(*routes)); i++) {
+		if ((strcmp(method, routes[i].method)) == 0 &&
+			path_matches(routes[i].path, target, path_len)) {
+			int status = routes[i].handle(server, conn, query);
+
+			return status == 0 ? 0 : conn_respond(server, conn, status);
+		}
+	}
+
+	return (corpus_append(&conn->body,
+						  "{\"errcode\":\"M_UNRECOGNIZED\","
+						  "\"error\":\"Unrecognized request\"}")) == 0
+			   ? conn_respond(server, conn, 404)
+			   : -1;
+}
+
+/* Returns the length of the request at the start of conn->in if it has been
+ * fully received, 0 if more data is needed and -1 if it is malformed. */
+static long
+request_length(const struct conn *conn) {
+	if (!conn->in.data) {
+		return 0;
+	}
+
+	char *end = strstr(conn->in.data, "\r\n\r\n");
+
+	if (!end) {
+		return conn->in.len >= REQUEST_MAX ? -1 : 0;
+	}
+
+	size_t header_len = (size_t) (end - conn->in.data) + 4;
+	size_t body_len = 0;
+
+	char *length = strcasestr(conn->in.data, "\r\nContent-Length:");
+
+	if (length && length < end) {
+		body_len = strtoul(&length[17], NULL, 10);
+	}
+
+	if (body_len > REQUEST_MAX) {
+		return -1;
+	}
+
+	return conn->in.len >= (header_len + body_len)
+			   ? (long) (header_len + body_len)
+			   : 0;
+}
+
+/* Start handling the next pipelined request, if any. */
+static int
+conn_next_request(struct server *server, struct conn *conn) {
+	long len = request_length(conn);
+
+	if (len <= 0) {
+		conn->state = CONN_READING;
+		return (int) len;
+	}
+
+	char *end = strstr(conn->in.data, "\r\n\r\n");
+	char *connection = strcasestr(conn->in.data, "\r\nConnection: close");
+
+	server->counters.requests++;
+
+	conn->request_len = (size_t) len;
+	conn->close_after = connection && connection < end;
+	conn->state = CONN_WAITING;
+	conn->ready_ms = now_ms() + server->options.latency_ms;
+
+	return 0;
+}
+
+static int
+conn_read(struct server *server, struct conn *conn) {
+	char tmp[BUFSIZ];
+	ssize_t read_len = read(conn->fd, tmp, sizeof(tmp));
+
+	if (read_len <= 0) {
+		return (read_len == -1 && errno == EAGAIN) ? 0 : -1;
+	}
+
+	if ((matrix_buf_append(&conn->in, tmp, (size_t) read_len)) == -1) {
+		return -1;
+	}
+
+	return conn->state == CONN_READING ? conn_next_request(server, conn) : 0;
+}
+
+static int
+conn_write(struct server *server, struct conn *conn) {
+	while (conn->out_off < conn->out.len) {
+		ssize_t written = write(conn->fd, &conn->out.data[conn->out_off],
+								conn->out.len - conn->out_off);
+
+		if (written == -1) {
+			return errno == EAGAIN ? 0 : -1;
+		}
+
+		conn->out_off += (size_t) written;
+	}
+
+	if (conn->close_after) {
+		return -1;
+	}
+
+	/* Discard the request that was just answered. */
+	memmove(conn->in.data, &conn->in.data[conn->request_len],
+			conn->in.len - conn->request_len + 1);
+	conn->in.len -= conn->request_len;
+	conn->request_len = 0;
+
+	return conn_next_request(server, conn);
+}
+
+/* Respond to requests whose latency has passed, returns the poll() timeout
+ * until the next one needs attention. */
+static int
+serve_waiting(struct server *server) {
+	long long now = now_ms();
+	long long next = -1;
+
+	for (size_t i = 0; i < CONNS_MAX; i++) {
+		struct conn *conn = &server->conns[i];
+
+		if (conn->state == CONN_WAITING && conn->ready_ms <= now &&
+			(conn_dispatch(server, conn)) == -1) {
+			conn_close(conn);
+			continue;
+		}
+
+		if (conn->state != CONN_WAITING) {
+			continue;
+		}
+
+		long long wake = conn->ready_ms;
+
+		if (conn->long_poll) {
+			wake = conn->expiry_ms;
+
+			if (server->options.rate &&
+				message_due_ms(server, conn->since) < wake) {
+				wake = message_due_ms(server, conn->since);
+			}
+
+			if (wake < conn->ready_ms) {
+				wake = conn->ready_ms;
+			}
+		}
+
+		if (next == -1 || wake < next) {
+			next = wake;
+		}
+	}
+
+	if (next == -1) {
+		return -1;
+	}
+
+	return next <= now ? 0 : (int) (next - now);
+}
+
+static int
+listen_on(unsigned short port) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if (fd != -1 &&
+		(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) == 0 &&
+		(bind(fd, (struct sockaddr *) &addr, sizeof(addr))) == 0 &&
+		(listen(fd, SOMAXCONN)) == 0) {
+		return fd;
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+
+	return -1;
+}
+
+static void
+accept_all(struct server *server, int listen_fd) {
+	int fd = -1;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+						 SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		struct conn *conn = NULL;
+
+		for (size_t i = 0; i < CONNS_MAX && !conn; i++) {
+			if (server->conns[i].state == CONN_FREE) {
+				conn = &server->conns[i];
+			}
+		}
+
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		*conn = (struct conn){.state = CONN_READING, .fd = fd};
+	}
+}
+
+static int
+serve(struct server *server, int listen_fd) {
+	struct pollfd fds[CONNS_MAX + 1];
+	struct conn *polled[CONNS_MAX + 1];
+
+	while (!done) {
+		int timeout = serve_waiting(server);
+		nfds_t nfds = 0;
+
+		fds[nfds] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+		polled[nfds++] = NULL;
+
+		for (size_t i = 0; i < CONNS_MAX; i++) {
+			struct conn *conn = &server->conns[i];
+
+			if (conn->state != CONN_FREE) {
+				/* Keep reading while waiting to notice disconnects. */
+				fds[nfds] = (struct pollfd){
+					.fd = conn->fd,
+					.events = conn->state == CONN_WRITING ? POLLOUT : POLLIN,
+				};
+				polled[nfds++] = conn;
+			}
+		}
+
+		if ((poll(fds, nfds, timeout)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			accept_all(server, listen_fd);
+		}
+
+		for (nfds_t i = 1; i < nfds; i++) {
+			struct conn *conn = polled[i];
+			int ret = 0;
+
+			if (fds[i].revents & POLLOUT) {
+				ret = conn_write(server, conn);
+			} else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				ret = conn_read(server, conn);
+			}
+
+			if (ret == -1) {
+				conn_close(conn);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int
+parse_options(int argc, char **argv, struct options *options) {
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "p:r:m:e:s:l:f:d:H:")) != -1) {
+		if (opt == '?') {
+			return -1;
+		}
+
+		errno = 0;
+
+		char *end = NULL;
+		unsigned long value = strtoul(optarg, &end, 10);
+
+		if (errno || *end) {
+			return -1;
+		}
+
+		switch (opt) {
+		case 'p':
+			if (value < 1 || value > 65535) {
+				return -1;
+			}
+			options->port = (unsigned short) value;
+			break;
+		case 'r':
+			if (value < 1) {
+				return -1;
+			}
+			options->shape.rooms = value;
+			break;
+		case 'm':
+			options->shape.members = value;
+			break;
+		case 'e':
+			options->rate = (unsigned) value;
+			break;
+		case 's':
+			options->shape.body_len = value;
+			break;
+		case 'l':
+			options->latency_ms = (unsigned) value;
+			break;
+		case 'f':
+			options->fail_percent = (unsigned) value;
+			break;
+		case 'd':
+			options->drop_percent = (unsigned) value;
+			break;
+		case 'H':
+			options->history = value;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return optind == argc ? 0 : -1;
+}
+
+int
+main(int argc, char **argv) {
+	static struct server server = {
+		.options =
+			{
+				.port = 8008,
+				.shape = {.rooms = 100,
+						  .members = 10,
+						  .messages = 10,
+						  .body_len = 64},
+				.rate = 100,
+				.history = 100,
+			},
+		.rng = 0x9e3779b97f4a7c15ULL,
+	};
+
+	if ((parse_options(argc, argv, &server.options)) == -1) {
+		fprintf(stderr,
+				"Usage: %s [-p port] [-r rooms] [-m members] [-e rate] "
+				"[-s bytes] [-l ms] [-f percent] [-d percent] [-H messages]\n",
+				argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < CONNS_MAX; i++) {
+		server.conns[i].fd = -1;
+	}
+
+	struct sigaction action = {.sa_handler = on_signal};
+
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listen_fd = listen_on(server.options.port);
+
+	if (listen_fd == -1) {
+		fprintf(stderr, "Failed to listen on port %u: %s\n",
+				server.options.port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	server.start_ms = now_ms();
+
+	int ret = serve(&server, listen_fd);
+
+	for (size_t i = 0; i < CONNS_MAX; i++) {
+		if (server.conns[i].state != CONN_FREE) {
+			conn_close(&server.conns[i]);
+		}
+	}
+
+	close(listen_fd);
+
+	fprintf(stderr,
+			"requests %zu syncs %zu paginations %zu messages %zu bytes %zu "
+			"failures %zu drops %zu\n",
+			server.counters.requests, server.counters.syncs,
+			server.counters.paginations, server.counters.messages,
+			server.counters.bytes, server.counters.failures,
+			server.counters.drops);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
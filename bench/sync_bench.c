@@ -0,0 +1,415 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Replays /sync bodies through cJSON_Parse(), matrix_dispatch_sync() and a full
+ * iteration of every room and event, without a homeserver. Without arguments,
+ * a built-in corpus is generated deterministically, otherwise the given files
+ * (Recorded /sync responses) are replayed.
+ *
+ * Usage: sync_bench [-j workers] [-m] [-n iterations] [-s] [-w directory]
+ *                   [file...]
+ *   -j  Parse the rooms into struct matrix_parsed_room on this many threads,
+ *       as in threaded mode, instead of iterating them in sync_cb. The rooms
+ *       are freed as part of the dispatch.
+ *   -m  Parse with malloc() and free with cJSON_Delete() instead of the arena.
+ *   -n  Replay every body this many times (Default 10).
+ *   -s  Keep room state in the store and look up the sender of every message.
+ *   -w  Write the built-in corpus to this directory and exit.
+ *
+ * The last column is the peak RSS of the whole process after the body was
+ * replayed, so it only grows for bodies that need more than the ones before. */
+
+#include "corpus.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+struct corpus {
+	const char *name;
+	struct matrix_buf body;
+};
+
+struct counts {
+	size_t rooms;
+	size_t events;
+	size_t senders;	 /* Messages whose sender was looked up. */
+	size_t resolved; /* Senders that had a display name. */
+	unsigned workers; /* 0 to iterate the rooms in sync_cb. */
+	bool store;
+	bool no_arena;
+};
+
+enum {
+	DEFAULT_ITERATIONS = 10,
+};
+
+static long long
+now_ns(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static long
+peak_rss_kib(void) {
+	struct rusage usage = {0};
+
+	return (getrusage(RUSAGE_SELF, &usage)) == 0 ? usage.ru_maxrss : -1;
+}
+
+/* Consume the response the same way a client would, so that the iterators'
+ * parsing is part of the measurement. */
+static void
+sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
+	struct counts *counts = matrix_userdata(matrix);
+	struct matrix_room room;
+
+	while ((matrix_sync_next(response, &room)) == MATRIX_SUCCESS) {
+		struct matrix_state_event sevent;
+		struct matrix_timeline_event tevent;
+		struct matrix_ephemeral_event eevent;
+
+		counts->rooms++;
+
+		while ((matrix_sync_next(&room, &sevent)) == MATRIX_SUCCESS) {
+			counts->events++;
+		}
+
+		while ((matrix_sync_next(&room, &tevent)) == MATRIX_SUCCESS) {
+			counts->events++;
+
+			if (counts->store && tevent.type == MATRIX_ROOM_MESSAGE) {
+				counts->senders++;
+
+				if ((matrix_store_get_displayname(
+						matrix, room.id, tevent.message.base.sender))) {
+					counts->resolved++;
+				}
+			}
+		}
+
+		while ((matrix_sync_next(&room, &eevent)) == MATRIX_SUCCESS) {
+			counts->events++;
+		}
+	}
+}
+
+/* Consume a room from matrix_parse_sync(), which owns its events. */
+static void
+parsed_cb(struct matrix *matrix, struct matrix_parsed_room *room) {
+	struct counts *counts = matrix_userdata(matrix);
+
+	if (room) {
+		counts->rooms++;
+		counts->events +=
+			room->state_len + room->timeline_len + room->ephemeral_len;
+	}
+
+	matrix_parsed_room_free(room);
+}
+
+static void
+parse_rooms(struct matrix *matrix, const cJSON *sync) {
+	const char *const names[MATRIX_ROOM_MAX] = {
+		[MATRIX_ROOM_LEAVE] = "leave",
+		[MATRIX_ROOM_JOIN] = "join",
+		[MATRIX_ROOM_INVITE] = "invite",
+	};
+
+	cJSON *rooms = cJSON_GetObjectItem(sync, "rooms");
+	struct matrix_sync_response response = {0};
+
+	for (size_t i = 0; i < MATRIX_ROOM_MAX; i++) {
+		cJSON *array = cJSON_GetObjectItem(rooms, names[i]);
+
+		response.rooms[i] = array ? array->child : NULL;
+	}
+
+	matrix_parse_sync(matrix, &response, parsed_cb);
+}
+
+static int
+corpus_generate(struct corpus corpus[], size_t len) {
+	const struct {
+		const char *name;
+		struct corpus_shape shape;
+	} shapes[] = {
+		/* An incremental sync with a few new messages. */
+		{"small-incremental", {.rooms = 3, .messages = 2}},
+		/* An initial sync of a large account. */
+		{"initial-10k-rooms",
+		 {.rooms = 10000, .members = 2, .messages = 10, .invites = 50}},
+		/* A few rooms with huge member lists (Without lazy loading). */
+		{"huge-member-lists", {.rooms = 4, .members = 25000, .messages = 20}},
+	};
+
+	size_t n = sizeof(shapes) / sizeof(*shapes);
+
+	if (n > len) {
+		n = len;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		corpus[i].name = shapes[i].name;
+
+		if ((corpus_sync(&corpus[i].body, "s1", &shapes[i].shape)) == -1) {
+			return -1;
+		}
+	}
+
+	return (int) n;
+}
+
+static int
+corpus_read(struct corpus *corpus, const char *path) {
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp) {
+		return -1;
+	}
+
+	int ret = 0;
+	char tmp[BUFSIZ];
+	size_t read = 0;
+
+	corpus->name = path;
+
+	while (ret == 0 && (read = fread(tmp, 1, sizeof(tmp), fp)) > 0) {
+		ret = matrix_buf_append(&corpus->body, tmp, read);
+	}
+
+	if (ferror(fp)) {
+		ret = -1;
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+static int
+corpus_write(const struct corpus *corpus, const char *dir) {
+	char path[4096];
+
+	if ((snprintf(path, sizeof(path), "%s/%s.json", dir, corpus->name)) >=
+		(int) sizeof(path)) {
+		return -1;
+	}
+
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp) {
+		return -1;
+	}
+
+	bool success = (fwrite(corpus->body.data, 1, corpus->body.len, fp)) ==
+				   corpus->body.len;
+
+	return (fclose(fp)) == 0 && success ? 0 : -1;
+}
+
+static int
+replay(struct matrix *matrix, const struct corpus *corpus, size_t iterations) {
+	struct counts *counts = matrix_userdata(matrix);
+
+	long long parse_ns = 0;
+	long long dispatch_ns = 0;
+	long long free_ns = 0;
+
+	*counts = (struct counts){.workers = counts->workers,
+							  .store = counts->store,
+							  .no_arena = counts->no_arena};
+
+	for (size_t i = 0; i < iterations; i++) {
+		long long start = now_ns();
+
+		if (!counts->no_arena) {
+			matrix_arena_begin(&matrix->arena);
+		}
+
+		cJSON *sync =
+			cJSON_ParseWithLength(corpus->body.data, corpus->body.len);
+
+		matrix_arena_end();
+
+		long long parsed = now_ns();
+
+		if (!sync) {
+			fprintf(stderr, "%s: invalid JSON\n", corpus->name);
+			return -1;
+		}
+
+		if (counts->workers > 0) {
+			parse_rooms(matrix, sync);
+		} else {
+			matrix_dispatch_sync(matrix, sync);
+		}
+
+		long long dispatched = now_ns();
+
+		if (counts->no_arena) {
+			cJSON_Delete(sync);
+		} else {
+			matrix_arena_reset(&matrix->arena);
+		}
+
+		parse_ns += parsed - start;
+		dispatch_ns += dispatched - parsed;
+		free_ns += now_ns() - dispatched;
+	}
+
+	size_t events = counts->events / iterations;
+	long long total_ns = parse_ns + dispatch_ns + free_ns;
+
+	printf("%-20s %10zu %7zu %9zu %9.2f %9.2f %9.2f %12.0f %9.1f %9ld\n",
+		   corpus->name, corpus->body.len, counts->rooms / iterations, events,
+		   (double) parse_ns / 1e6 / (double) iterations,
+		   (double) dispatch_ns / 1e6 / (double) iterations,
+		   (double) free_ns / 1e6 / (double) iterations,
+		   events && total_ns
+			   ? (double) counts->events / ((double) total_ns / 1e9)
+			   : 0.0,
+		   counts->events ? (double) total_ns / (double) counts->events : 0.0,
+		   peak_rss_kib());
+
+	if (counts->store) {
+		printf("%-20s resolved %zu of %zu senders through the store\n", "",
+			   counts->resolved / iterations, counts->senders / iterations);
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv) {
+	size_t iterations = DEFAULT_ITERATIONS;
+	const char *write_dir = NULL;
+
+	int opt = 0;
+
+	bool store = false;
+
+	bool no_arena = false;
+
+	unsigned long workers = 0;
+
+	while ((opt = getopt(argc, argv, "j:mn:sw:")) != -1) {
+		switch (opt) {
+		case 'j':
+			errno = 0;
+			workers = strtoul(optarg, NULL, 10);
+
+			if (errno || workers < 1 || workers > UINT_MAX) {
+				fprintf(stderr, "Invalid worker count '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			no_arena = true;
+			break;
+		case 'n':
+			errno = 0;
+			iterations = strtoul(optarg, NULL, 10);
+
+			if (errno || iterations < 1) {
+				fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			store = true;
+			break;
+		case 'w':
+			write_dir = optarg;
+			break;
+		default:
+			fprintf(stderr,
+					"Usage: %s [-j workers] [-m] [-n iterations] [-s] "
+					"[-w directory] [file...]\n",
+					argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	enum { CORPUS_MAX = 64 };
+
+	struct corpus corpus[CORPUS_MAX] = {0};
+	int len = 0;
+
+	if (optind < argc) {
+		for (; optind < argc && len < CORPUS_MAX; optind++, len++) {
+			if ((corpus_read(&corpus[len], argv[optind])) == -1) {
+				fprintf(stderr, "Failed to read '%s'\n", argv[optind]);
+				return EXIT_FAILURE;
+			}
+		}
+	} else if ((len = corpus_generate(corpus, CORPUS_MAX)) == -1) {
+		fprintf(stderr, "Failed to generate the corpus\n");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+
+	if (write_dir) {
+		for (int i = 0; i < len; i++) {
+			if ((corpus_write(&corpus[i], write_dir)) == -1) {
+				fprintf(stderr, "Failed to write '%s' to '%s'\n",
+						corpus[i].name, write_dir);
+				ret = EXIT_FAILURE;
+			}
+		}
+	} else {
+		struct counts counts = {
+			.workers = (unsigned) workers,
+			.store = store,
+			.no_arena = no_arena,
+		};
+		struct matrix *matrix = NULL;
+
+		if ((matrix_global_init()) == -1 ||
+			!(matrix = matrix_alloc(sync_cb, "@bench:localhost",
+									"http://localhost", &counts))) {
+			fprintf(stderr, "Failed to initialize libmatrix\n");
+			return EXIT_FAILURE;
+		}
+
+		matrix_set_store(matrix, store);
+
+		if ((matrix_set_parse_workers(matrix, (unsigned) workers)) == -1) {
+			fprintf(stderr, "Failed to start %lu workers\n", workers);
+			matrix_destroy(matrix);
+			return EXIT_FAILURE;
+		}
+
+		printf("%-20s %10s %7s %9s %9s %9s %9s %12s %9s %9s\n", "corpus",
+			   "bytes", "rooms", "events", "parse ms", "disp ms", "free ms",
+			   "events/s", "ns/event", "peak KiB");
+
+		for (int i = 0; i < len; i++) {
+			if ((replay(matrix, &corpus[i], iterations)) == -1) {
+				ret = EXIT_FAILURE;
+			}
+		}
+
+		if (!no_arena) {
+			struct matrix_transfer_stats stats;
+
+			matrix_get_transfer_stats(matrix, &stats);
+			printf("parse arena peak %zu KiB\n", stats.parse_peak / 1024);
+		}
+
+		matrix_destroy(matrix);
+		matrix_global_cleanup();
+	}
+
+	for (int i = 0; i < len; i++) {
+		matrix_buf_finish(&corpus[i].body);
+	}
+
+	return ret;
+}
@@ -0,0 +1,467 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Drives libmatrix against a homeserver (Usually mock_homeserver) to measure
+ * end-to-end sync throughput and how the client recovers from failures. Logs
+ * in, then syncs with the non-blocking API for the given duration, restarting
+ * the sync from the last next_batch whenever it fails.
+ *
+ * Usage: sync_load [-d seconds] [-t timeout] [-c path] [-f limit] [-b limit]
+ *                  [-T capacity [-j workers] [-s]] [-S] homeserver
+ *   -d  Run for this many seconds (Default 10).
+ *   -t  The /sync timeout in milliseconds (Default 30000).
+ *   -c  Use a sync cache at path, to measure warm startup.
+ *   -f  Sync with a filter of known types, lazy loaded members and this
+ *       timeline limit.
+ *   -b  Keep timelines in the store and paginate this many events back from
+ *       the oldest one of every limited timeline, like a client filling its
+ *       scrollback.
+ *   -T  Sync and parse on a thread of its own, queueing up to this many rooms
+ *       for the main thread. A failed sync is restarted from the cache if -c
+ *       is given, and from scratch otherwise. Not combined with -b.
+ *   -j  Parse the rooms of large responses on this many threads with -T.
+ *   -s  Keep the store with -T and look up the sender of every popped message
+ *       in its latest snapshot, like a renderer reading the store while the
+ *       sync thread updates it.
+ *   -S  Enable streaming mode. */
+
+#include "matrix.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	MAX_POLLFDS = 16,
+	/* Wait this long before restarting a failed sync. */
+	RESTART_DELAY_MS = 100,
+};
+
+struct load {
+	char *next_batch;
+	size_t callbacks;
+	size_t rooms;
+	size_t events;
+	size_t restarts;
+	size_t paginations;
+	size_t paginated;
+	size_t pagination_failures;
+	unsigned paginate_limit; /* 0 to not paginate. */
+	size_t queue_capacity;	 /* 0 to sync on the main thread. */
+	/* Of the current sync thread, or the last one after it was stopped. */
+	struct matrix_queue_stats queue;
+	struct matrix_reader *reader; /* nullable, set to read snapshots. */
+	size_t version;				  /* Of the last pinned snapshot. */
+	size_t lookups;
+	size_t resolved;
+};
+
+static long long
+now_ms(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void
+paginate_cb(struct matrix *matrix, struct matrix_room *room, void *userp) {
+	struct load *load = userp;
+	struct matrix_timeline_event tevent;
+
+	(void) matrix;
+
+	load->paginations++;
+
+	if (!room) {
+		load->pagination_failures++;
+		return;
+	}
+
+	while ((matrix_sync_next(room, &tevent)) == MATRIX_SUCCESS) {
+		load->paginated++;
+	}
+}
+
+static void
+sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
+	struct load *load = matrix_userdata(matrix);
+	struct matrix_room room;
+
+	load->callbacks++;
+
+	while ((matrix_sync_next(response, &room)) == MATRIX_SUCCESS) {
+		struct matrix_state_event sevent;
+		struct matrix_timeline_event tevent;
+		struct matrix_ephemeral_event eevent;
+
+		load->rooms++;
+
+		while ((matrix_sync_next(&room, &sevent)) == MATRIX_SUCCESS) {
+			load->events++;
+		}
+
+		while ((matrix_sync_next(&room, &tevent)) == MATRIX_SUCCESS) {
+			load->events++;
+		}
+
+		while ((matrix_sync_next(&room, &eevent)) == MATRIX_SUCCESS) {
+			load->events++;
+		}
+
+		if (load->paginate_limit && room.timeline.limited) {
+			matrix_paginate(matrix, room.id, NULL, load->paginate_limit,
+							paginate_cb, load);
+		}
+	}
+
+	/* Remember where to resume from if the next request fails. */
+	if (response->next_batch &&
+		(!load->next_batch ||
+		 (strcmp(load->next_batch, response->next_batch)) != 0)) {
+		char *next_batch = strdup(response->next_batch);
+
+		if (next_batch) {
+			free(load->next_batch);
+			load->next_batch = next_batch;
+		}
+	}
+}
+
+/* nullable: stats */
+static void
+report(const struct load *load, const struct matrix_transfer_stats *stats,
+	   double seconds) {
+	printf("%8.1fs callbacks %8zu rooms %8zu events %9zu (%9.0f/s) restarts "
+		   "%4zu",
+		   seconds, load->callbacks, load->rooms, load->events,
+		   seconds > 0 ? (double) load->events / seconds : 0.0,
+		   load->restarts);
+
+	/* Transfer stats can't be read while a sync thread runs. */
+	if (stats) {
+		printf(" bytes %11zu handles %zu/%zu", stats->bytes_received,
+			   stats->handle_hits, stats->handle_misses);
+	}
+
+	printf("\n");
+
+	if (load->paginate_limit) {
+		printf("%8.1fs paginations %6zu events %9zu failed %zu\n", seconds,
+			   load->paginations, load->paginated, load->pagination_failures);
+	}
+
+	if (load->queue_capacity) {
+		printf("%8.1fs queue depth %4zu peak %4zu/%zu pushed %8zu dropped "
+			   "%zu\n",
+			   seconds, load->queue.depth, load->queue.peak_depth,
+			   load->queue.capacity, load->queue.pushed, load->queue.dropped);
+	}
+
+	if (load->reader) {
+		printf("%8.1fs snapshot %6zu lookups %9zu resolved %9zu\n", seconds,
+			   load->version, load->lookups, load->resolved);
+	}
+}
+
+static void
+lookup_senders(struct load *load, const struct matrix_parsed_room *room) {
+	const struct matrix_snapshot *snapshot = matrix_snapshot_pin(load->reader);
+
+	load->version = matrix_snapshot_version(snapshot);
+
+	for (size_t i = 0; i < room->timeline_len; i++) {
+		if (room->timeline[i].type != MATRIX_ROOM_MESSAGE) {
+			continue;
+		}
+
+		load->lookups++;
+
+		if ((matrix_snapshot_get_displayname(
+				snapshot, room->room.id,
+				room->timeline[i].message.base.sender))) {
+			load->resolved++;
+		}
+	}
+
+	matrix_snapshot_unpin(load->reader);
+}
+
+static enum matrix_code
+run(struct matrix *matrix, struct load *load, long long duration_ms,
+	unsigned timeout) {
+	struct pollfd fds[MAX_POLLFDS];
+
+	long long start = now_ms();
+	long long next_report = start + 1000;
+	long long restart_at = -1;
+
+	enum matrix_code code = matrix_sync_start(matrix, NULL, timeout);
+
+	if (load->rooms > 0) {
+		printf("replayed %zu rooms %zu events from the cache in %lld ms\n",
+			   load->rooms, load->events, now_ms() - start);
+	}
+
+	while (code == MATRIX_SUCCESS) {
+		long long now = now_ms();
+
+		if (now >= (start + duration_ms)) {
+			break;
+		}
+
+		if (now >= next_report) {
+			struct matrix_transfer_stats stats;
+
+			matrix_get_transfer_stats(matrix, &stats);
+			report(load, &stats, (double) (now - start) / 1000);
+			next_report += 1000;
+		}
+
+		if (restart_at != -1 && now >= restart_at) {
+			restart_at = -1;
+			load->restarts++;
+
+			if ((code = matrix_sync_start(matrix, load->next_batch,
+										  timeout)) != MATRIX_SUCCESS) {
+				break;
+			}
+		}
+
+		size_t nfds = matrix_get_pollfds(matrix, fds, MAX_POLLFDS);
+
+		if (nfds > MAX_POLLFDS) {
+			nfds = MAX_POLLFDS;
+		}
+
+		int poll_timeout = restart_at != -1 ? (int) (restart_at - now)
+											: matrix_get_timeout(matrix);
+
+		if (poll_timeout < 0 || poll_timeout > (next_report - now)) {
+			poll_timeout = (int) (next_report - now);
+		}
+
+		if ((poll(fds, nfds, poll_timeout)) == -1 && errno != EINTR) {
+			return MATRIX_CURL_FAILURE;
+		}
+
+		if (restart_at == -1 &&
+			(matrix_perform_step(matrix, fds, nfds)) != MATRIX_SUCCESS) {
+			/* The sync was stopped, retry it after a delay. */
+			restart_at = now_ms() + RESTART_DELAY_MS;
+		}
+	}
+
+	matrix_sync_stop(matrix);
+
+	return code;
+}
+
+/* Like run(), with the main thread only draining the queue. */
+static enum matrix_code
+run_threaded(struct matrix *matrix, struct load *load, long long duration_ms,
+			 unsigned timeout) {
+	long long start = now_ms();
+	long long next_report = start + 1000;
+	long long restart_at = -1;
+
+	enum matrix_code code = matrix_sync_thread_start(matrix, NULL, timeout,
+													 load->queue_capacity);
+
+	while (code == MATRIX_SUCCESS) {
+		long long now = now_ms();
+
+		if (now >= (start + duration_ms)) {
+			break;
+		}
+
+		if (now >= next_report) {
+			report(load, NULL, (double) (now - start) / 1000);
+			next_report += 1000;
+		}
+
+		if (restart_at != -1 && now >= restart_at) {
+			restart_at = -1;
+			load->restarts++;
+
+			if ((code = matrix_sync_thread_start(
+					 matrix, NULL, timeout, load->queue_capacity)) !=
+				MATRIX_SUCCESS) {
+				break;
+			}
+		}
+
+		/* Ignored by poll() while the thread is stopped. */
+		struct pollfd fd = {.fd = matrix_queue_get_fd(matrix),
+							.events = POLLIN};
+		long long wait = restart_at != -1 && restart_at < next_report
+							 ? restart_at - now
+							 : next_report - now;
+
+		if ((poll(&fd, 1, (int) wait)) == -1 && errno != EINTR) {
+			code = MATRIX_CURL_FAILURE;
+			break;
+		}
+
+		for (struct matrix_parsed_room *room = NULL;
+			 (room = matrix_queue_pop(matrix));) {
+			load->rooms++;
+			load->events +=
+				room->state_len + room->timeline_len + room->ephemeral_len;
+
+			if (load->reader) {
+				lookup_senders(load, room);
+			}
+
+			matrix_parsed_room_free(room);
+		}
+
+		if (restart_at == -1) {
+			matrix_get_queue_stats(matrix, &load->queue);
+
+			if (!matrix_sync_thread_running(matrix)) {
+				/* The sync failed, retry it after a delay. */
+				matrix_sync_thread_stop(matrix);
+				restart_at = now_ms() + RESTART_DELAY_MS;
+			}
+		}
+	}
+
+	if (restart_at == -1) {
+		matrix_get_queue_stats(matrix, &load->queue);
+	}
+
+	matrix_sync_thread_stop(matrix);
+
+	return code;
+}
+
+int
+main(int argc, char **argv) {
+	unsigned long duration = 10;
+	unsigned long timeout = 30000;
+	const char *cache = NULL;
+	struct matrix_sync_filter filter = {0};
+	bool use_filter = false;
+	bool streaming = false;
+	bool snapshots = false;
+	unsigned workers = 0;
+	struct load load = {0};
+
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "d:t:c:f:b:T:j:sS")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			cache = optarg;
+			break;
+		case 'f':
+			filter = (struct matrix_sync_filter){
+				.timeline_limit = (unsigned) strtoul(optarg, NULL, 10),
+				.lazy_load_members = true,
+				.known_types_only = true,
+			};
+			use_filter = true;
+			break;
+		case 'b':
+			load.paginate_limit = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			load.queue_capacity = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			workers = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			snapshots = true;
+			break;
+		case 'S':
+			streaming = true;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if ((optind + 1) != argc || duration < 1 ||
+		(load.queue_capacity > 0 && load.paginate_limit > 0) ||
+		((workers > 0 || snapshots) && load.queue_capacity == 0)) {
+		fprintf(stderr,
+				"Usage: %s [-d seconds] [-t timeout] [-c path] [-f limit] "
+				"[-b limit] [-T capacity [-j workers] [-s]] [-S] "
+				"homeserver\n",
+				argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct matrix *matrix = NULL;
+
+	if ((matrix_global_init()) == -1 ||
+		!(matrix = matrix_alloc(sync_cb, "@bench:localhost", argv[optind],
+								&load)) ||
+		(matrix_set_cache(matrix, cache)) == -1 ||
+		(matrix_set_parse_workers(matrix, workers)) == -1) {
+		fprintf(stderr, "Failed to initialize libmatrix\n");
+		return EXIT_FAILURE;
+	}
+
+	matrix_set_sync_streaming(matrix, streaming);
+	matrix_set_store(matrix, load.paginate_limit > 0 || snapshots);
+
+	if (snapshots && ((matrix_set_store_snapshots(matrix, true)) == -1 ||
+					  !(load.reader = matrix_reader_acquire(matrix)))) {
+		fprintf(stderr, "Failed to enable snapshots\n");
+		matrix_destroy(matrix);
+		matrix_global_cleanup();
+		return EXIT_FAILURE;
+	}
+
+	long long start = now_ms();
+	enum matrix_code code = matrix_login(matrix, "password", NULL);
+
+	if (code == MATRIX_SUCCESS) {
+		printf("login %lld ms\n", now_ms() - start);
+	}
+
+	if (code == MATRIX_SUCCESS && use_filter) {
+		start = now_ms();
+		code = matrix_set_sync_filter(matrix, &filter);
+		printf("filter %lld ms\n", now_ms() - start);
+	}
+
+	if (code == MATRIX_SUCCESS) {
+		start = now_ms();
+		code = load.queue_capacity > 0
+				   ? run_threaded(matrix, &load, (long long) duration * 1000,
+								  (unsigned) timeout)
+				   : run(matrix, &load, (long long) duration * 1000,
+						 (unsigned) timeout);
+
+		struct matrix_transfer_stats stats;
+
+		matrix_get_transfer_stats(matrix, &stats);
+		report(&load, &stats, (double) (now_ms() - start) / 1000);
+	}
+
+	if (code != MATRIX_SUCCESS) {
+		fprintf(stderr, "Failed with code %d\n", code);
+	}
+
+	free(load.next_batch);
+	matrix_reader_release(load.reader);
+	matrix_destroy(matrix);
+	matrix_global_cleanup();
+
+	return code == MATRIX_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
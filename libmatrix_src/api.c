@@ -1,11 +1,15 @@
 #include "matrix-priv.h"
+#include <errno.h>
 
 enum method { GET = 0, POST, PUT };
 
 struct response {
 	long http_code;
-	size_t len;
-	char *data;
+	struct matrix_buf *buf; /* Not owned, reused across requests. */
+	struct matrix *stream;	/* Feed the body to this matrix's sync stream
+							   instead of buf if non-NULL. */
+	struct matrix_handle *handle;	/* Acquired from the pool. */
+	struct matrix_headers *headers; /* A reference to the session's headers. */
 	CURL *easy;
 	char error[CURL_ERROR_SIZE];
 };
@@ -15,16 +19,34 @@ write_cb(void *contents, size_t size, size_t nmemb, void *userp) {
 	size_t realsize = size * nmemb;
 
 	struct response *response = userp;
+	struct matrix_buf *buf = response->buf;
 
-	char *ptr = realloc(response->data, response->len + realsize + 1);
+	if (response->stream) {
+		buf->total += realsize;
 
-	if (!ptr) {
-		return 0;
+		return (matrix_sync_stream_feed(response->stream, contents,
+										realsize)) == 0
+				   ? realsize
+				   : 0;
 	}
 
-	response->data = ptr;
-	memcpy(&(response->data[response->len]), contents, realsize);
-	response->data[response->len += realsize] = '\0';
+	/* Headers have been received by the time the first chunk arrives, so we
+	 * can size the buffer for the whole body upfront if the server told us
+	 * how big it is. */
+	if (buf->len == 0) {
+		curl_off_t content_length = -1;
+
+		if ((curl_easy_getinfo(response->easy,
+							   CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+							   &content_length)) == CURLE_OK &&
+			content_length > 0 && (uintmax_t) content_length < SIZE_MAX) {
+			(void) matrix_buf_reserve(buf, (size_t) content_length + 1);
+		}
+	}
+
+	if ((matrix_buf_append(buf, contents, realsize)) == -1) {
+		return 0;
+	}
 
 	return realsize;
 }
@@ -35,67 +57,119 @@ http_code_is_success(long code) {
 	return code == success;
 }
 
-/* TODO get rid of this and just allocate the headers once. */
-static struct curl_slist *
-get_headers(struct matrix *matrix) {
-	char *auth = NULL;
+static struct matrix_headers *
+headers_create(const char *access_token) {
+	struct matrix_headers *headers = calloc(1, sizeof(*headers));
 
-	if (matrix->access_token &&
-		(asprintf(&auth, "%s%s", "Authorization: Bearer ",
-				  matrix->access_token)) == -1) {
+	if (!headers) {
 		return NULL;
 	}
 
-	struct curl_slist *headers = auth ? curl_slist_append(NULL, auth) : NULL;
-	struct curl_slist *tmp =
-		curl_slist_append(headers, "Content-Type: application/json");
+	char *auth = NULL;
 
-	if (tmp) {
-		free(auth);
-		return tmp;
+	if (access_token && (asprintf(&auth, "%s%s", "Authorization: Bearer ",
+								  access_token)) == -1) {
+		free(headers);
+		return NULL;
 	}
 
-	curl_slist_free_all(headers);
+	struct curl_slist *list = auth ? curl_slist_append(NULL, auth) : NULL;
+
 	free(auth);
 
+	if ((!auth || list) &&
+		(headers->list =
+			 curl_slist_append(list, "Content-Type: application/json"))) {
+		headers->refs = 1; /* The reference held by struct matrix. */
+		return headers;
+	}
+
+	curl_slist_free_all(list);
+	free(headers);
+
 	return NULL;
 }
 
-static char *
-endpoint_create(const char *homeserver, const char *endpoint,
-				const char *params) {
-	assert(homeserver);
-	assert(endpoint);
-	assert(endpoint[0] == '/'); /* base[] doesn't have a trailing slash. */
+/* Take a reference to the current session's headers, which stay valid until
+ * released even if the token changes in the meantime. */
+static struct matrix_headers *
+headers_acquire(struct matrix *matrix) {
+	pthread_mutex_lock(&matrix->session_mutex);
 
-	const char base[] = "/_matrix/client/r0";
+	if (!matrix->headers) {
+		matrix->headers = headers_create(NULL);
+	}
 
-	char *final = NULL;
+	struct matrix_headers *headers = matrix->headers;
 
-	if ((asprintf(&final, "%s%s%s%s", homeserver, base, endpoint,
-				  (params ? params : ""))) == -1) {
-		return NULL;
+	if (headers) {
+		headers->refs++;
+	}
+
+	pthread_mutex_unlock(&matrix->session_mutex);
+
+	return headers;
+}
+
+void
+matrix_headers_release(struct matrix *matrix,
+					   struct matrix_headers *headers) {
+	if (!headers) {
+		return;
 	}
 
-	return final;
+	pthread_mutex_lock(&matrix->session_mutex);
+	bool last = --headers->refs == 0;
+	pthread_mutex_unlock(&matrix->session_mutex);
+
+	if (last) {
+		curl_slist_free_all(headers->list);
+		free(headers);
+	}
 }
 
+/* Write the URL for endpoint into buf, reusing its allocation. */
+static int
+url_create(const struct matrix *matrix, struct matrix_buf *buf,
+		   const char *endpoint, const char *params) {
+	assert(endpoint);
+	assert(endpoint[0] == '/'); /* base_url doesn't have a trailing slash. */
+
+	buf->len = 0;
+
+	return ((matrix_buf_append(buf, matrix->base_url, matrix->base_url_len)) ==
+				0 &&
+			(matrix_buf_append(buf, endpoint, strlen(endpoint))) == 0 &&
+			(!params || (matrix_buf_append(buf, params, strlen(params))) == 0))
+			   ? 0
+			   : -1;
+}
+
+/* nullable: params, buf. The handle's own buffer is used if buf is NULL. */
 static enum matrix_code
-response_init(enum method method, const char *data, const char *url,
-			  const struct curl_slist *headers, struct response *response) {
-	assert(headers);
+response_init(struct matrix *matrix, enum method method, const char *data,
+			  const char *endpoint, const char *params, struct matrix_buf *buf,
+			  struct response *response) {
 	assert(response);
-	assert(url);
 
-	CURL *easy = curl_easy_init();
+	struct matrix_handle *handle = matrix_pool_acquire(&matrix->pool);
+	struct matrix_headers *headers = headers_acquire(matrix);
+	CURL *easy = handle ? handle->easy : NULL;
 
-	if (easy && (curl_easy_setopt(easy, CURLOPT_URL, url)) == CURLE_OK &&
-		(curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers)) == CURLE_OK &&
+	/* curl copies the URL so the buffer can be reused right away. */
+	if (easy && headers &&
+		(url_create(matrix, &handle->url, endpoint, params)) == 0 &&
+		(curl_easy_setopt(easy, CURLOPT_URL, handle->url.data)) == CURLE_OK &&
+		(curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers->list)) ==
+			CURLE_OK &&
 		(curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, response->error)) ==
 			CURLE_OK &&
 		(curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_cb)) == CURLE_OK &&
 		(curl_easy_setopt(easy, CURLOPT_WRITEDATA, response)) == CURLE_OK) {
 		*response = (struct response){
+			.buf = buf ? buf : &handle->buf,
+			.handle = handle,
+			.headers = headers,
 			.easy = easy,
 		};
 
@@ -118,50 +192,66 @@ response_init(enum method method, const char *data, const char *url,
 		}
 	}
 
-	curl_easy_cleanup(easy);
+	*response = (struct response){0};
+	matrix_headers_release(matrix, headers);
+	matrix_pool_release(&matrix->pool, handle);
 
 	return MATRIX_CURL_FAILURE;
 }
 
+static void
+response_reset(struct response *response) {
+	/* Reuse the previous allocation for the new body. */
+	response->buf->len = 0;
+
+	if (response->buf->data) {
+		response->buf->data[0] = '\0';
+	}
+}
+
+static enum matrix_code
+response_status(struct response *response) {
+	curl_easy_getinfo(response->easy, CURLINFO_RESPONSE_CODE,
+					  &response->http_code);
+
+	return http_code_is_success(response->http_code) ? MATRIX_SUCCESS
+													 : MATRIX_CURL_FAILURE;
+}
+
 static enum matrix_code
 response_perform(struct response *response) {
-	if ((curl_easy_perform(response->easy)) == CURLE_OK) {
-		curl_easy_getinfo(response->easy, CURLINFO_RESPONSE_CODE,
-						  &response->http_code);
+	response_reset(response);
 
-		if ((http_code_is_success(response->http_code))) {
-			return MATRIX_SUCCESS;
-		}
+	if ((curl_easy_perform(response->easy)) == CURLE_OK) {
+		return response_status(response);
 	}
 
 	return MATRIX_CURL_FAILURE;
 }
 
 static void
-response_finish(struct response *response) {
-	curl_easy_cleanup(response->easy);
-	free(response->data);
+response_finish(struct matrix *matrix, struct response *response) {
+	matrix_headers_release(matrix, response->headers);
+	matrix_pool_release(&matrix->pool, response->handle);
+
+	*response = (struct response){0};
 }
 
 /* The caller must response_finish() the response. */
 static enum matrix_code
 perform(struct matrix *matrix, const cJSON *json, enum method method,
 		const char endpoint[], const char params[], struct response *response) {
-	char *url = endpoint_create(matrix->homeserver, endpoint, params);
 	char *data = json ? cJSON_Print(json) : NULL;
 
-	struct curl_slist *headers = get_headers(matrix);
+	enum matrix_code code = MATRIX_NOMEM;
 
-	enum matrix_code code = MATRIX_CURL_FAILURE;
-
-	if (url && headers) {
-		code = response_perform(
-			((response_init(method, data, url, headers, response)), response));
+	if ((!json || data) &&
+		(code = response_init(matrix, method, data, endpoint, params, NULL,
+							  response)) == MATRIX_SUCCESS) {
+		code = response_perform(response);
 	}
 
-	curl_slist_free_all(headers);
 	free(data);
-	free(url);
 
 	return code;
 }
@@ -192,89 +282,408 @@ set_batch(char *url, char **new_url, size_t *new_len, const char *next_batch) {
 	return MATRIX_SUCCESS;
 }
 
+/* The /sync long-poll, driven by the multi handle. */
+struct matrix_sync_transfer {
+	struct response response;
+	struct matrix_buf url; /* Without the since parameter. */
+	char *new_url; /* We fill in this buf with the new batch token on every
+					  successful response. */
+	size_t new_len;
+};
+
+/* (Re)start the /sync request with the latest batch token and the headers of
+ * the current session, which may have changed since the last request. */
+static enum matrix_code
+sync_transfer_add(struct matrix *matrix) {
+	struct matrix_sync_transfer *sync = matrix->sync;
+
+	if (sync->new_url && (curl_easy_setopt(sync->response.easy, CURLOPT_URL,
+										   sync->new_url)) != CURLE_OK) {
+		return MATRIX_CURL_FAILURE;
+	}
+
+	matrix_headers_release(matrix, sync->response.headers);
+
+	if (!(sync->response.headers = headers_acquire(matrix))) {
+		return MATRIX_NOMEM;
+	}
+
+	if ((curl_easy_setopt(sync->response.easy, CURLOPT_HTTPHEADER,
+						  sync->response.headers->list)) != CURLE_OK) {
+		return MATRIX_CURL_FAILURE;
+	}
+
+	if ((sync->response.stream = matrix->streaming ? matrix : NULL)) {
+		matrix_sync_stream_reset(&matrix->stream);
+	}
+
+	response_reset(&sync->response);
+
+	return (curl_multi_add_handle(matrix->multi, sync->response.easy)) ==
+				   CURLM_OK
+			   ? MATRIX_SUCCESS
+			   : MATRIX_CURL_FAILURE;
+}
+
+static enum matrix_code
+sync_handle_response(struct matrix *matrix,
+					 struct matrix_sync_transfer *sync) {
+	if (sync->response.stream) {
+		/* Rooms were already dispatched while receiving. */
+		matrix_snapshot_publish(matrix);
+
+		const char *next_batch = matrix->stream.next_batch.len > 0
+									 ? matrix->stream.next_batch.data
+									 : NULL;
+
+		enum matrix_code code = set_batch(sync->url.data, &sync->new_url,
+										  &sync->new_len, next_batch);
+
+		if (code == MATRIX_SUCCESS) {
+			matrix_cache_set_batch(&matrix->cache, next_batch);
+		}
+
+		return code;
+	}
+
+	matrix_arena_begin(&matrix->arena);
+	cJSON *parsed = cJSON_Parse(sync->response.buf->data);
+	matrix_arena_end();
+
+	const char *next_batch = GETSTR(parsed, "next_batch");
+
+	enum matrix_code code =
+		set_batch(sync->url.data, &sync->new_url, &sync->new_len, next_batch);
+
+	if (code == MATRIX_SUCCESS) {
+		matrix_dispatch_sync(matrix, parsed);
+		matrix_cache_set_batch(&matrix->cache, next_batch);
+	}
+
+	matrix_arena_reset(&matrix->arena);
+
+	return code;
+}
+
 enum matrix_code
-matrix_sync_forever(struct matrix *matrix, const char *next_batch,
-					unsigned timeout) {
+matrix_sync_start(struct matrix *matrix, const char *next_batch,
+				  unsigned timeout) {
 	if (!matrix->access_token) {
 		return MATRIX_NOT_LOGGED_IN;
 	}
 
+	matrix_sync_stop(matrix);
+
+	if (!next_batch) {
+		next_batch = matrix_cache_replay(matrix);
+	}
+
+	/* The ID comes from the server. */
+	char *filter_id =
+		matrix->filter_id ? curl_easy_escape(NULL, matrix->filter_id, 0) : NULL;
 	char *params = NULL;
 
-	if ((asprintf(&params, "?timeout=%u", timeout)) == -1) {
+	if ((matrix->filter_id && !filter_id) ||
+		(filter_id ? asprintf(&params, "?timeout=%u&filter=%s", timeout,
+							  filter_id)
+				   : asprintf(&params, "?timeout=%u", timeout)) == -1) {
+		curl_free(filter_id);
 		return MATRIX_NOMEM;
 	}
 
-	enum matrix_code code = MATRIX_CURL_FAILURE;
-
-	char *url = endpoint_create(matrix->homeserver, "/sync", params);
+	curl_free(filter_id);
 
-	free(params);
+	struct matrix_sync_transfer *sync = calloc(1, sizeof(*sync));
 
-	if (!url) {
+	if (!sync) {
+		free(params);
 		return MATRIX_NOMEM;
 	}
 
-	struct curl_slist *headers = get_headers(matrix);
-	struct response response = {0};
+	matrix->sync = sync;
 
-	size_t new_len = 0;
-	char *new_buf = NULL; /* We fill in this buf with the new batch token on
-							 every successful response. */
+	enum matrix_code code = MATRIX_NOMEM;
 
-	if ((next_batch ? ((code = set_batch(url, &new_buf, &new_len,
-										 next_batch)) == MATRIX_SUCCESS)
+	if ((url_create(matrix, &sync->url, "/sync", params)) == 0 &&
+		(next_batch ? ((code = set_batch(sync->url.data, &sync->new_url,
+										 &sync->new_len, next_batch)) ==
+					   MATRIX_SUCCESS)
 					: true) &&
-		(response_init(GET, NULL, url, headers, &response)) == MATRIX_SUCCESS) {
-		for (;;) {
-			if (new_buf && (curl_easy_setopt(response.easy, CURLOPT_URL,
-											 new_buf)) != CURLE_OK) {
-				code = MATRIX_CURL_FAILURE;
-				break;
-			}
+		(code = response_init(matrix, GET, NULL, "/sync", params,
+							  &matrix->sync_buf, &sync->response)) ==
+			MATRIX_SUCCESS) {
+		code = sync_transfer_add(matrix);
+	}
 
-			/* TODO add error callback to allow implementing backoff */
-			if ((code = response_perform(&response)) != MATRIX_SUCCESS) {
-				break;
-			}
+	free(params);
+
+	if (code != MATRIX_SUCCESS) {
+		matrix_sync_stop(matrix);
+	}
+
+	return code;
+}
+
+void
+matrix_sync_stop(struct matrix *matrix) {
+	struct matrix_sync_transfer *sync = matrix->sync;
+
+	if (!sync) {
+		return;
+	}
+
+	if (sync->response.easy) {
+		curl_multi_remove_handle(matrix->multi, sync->response.easy);
+		response_finish(matrix, &sync->response);
+	}
+
+	matrix_buf_finish(&sync->url);
+	free(sync->new_url);
+	free(sync);
+
+	matrix->sync = NULL;
+
+	/* Rooms streamed by a transfer that didn't complete would be stored with
+	 * the old next_batch, and received again. */
+	matrix_cache_discard(&matrix->cache);
+	matrix_cache_flush(&matrix->cache);
+}
+
+/* Drop the events that the store already has, so that a gap can be filled
+ * without duplicating its edges. */
+static void
+drop_retained(struct matrix *matrix, const char *room_id, cJSON *chunk) {
+	for (cJSON *event = chunk->child; event;) {
+		cJSON *next = event->next;
+		const char *event_id = GETSTR(event, "event_id");
+
+		if (event_id && matrix_store_timeline_has(matrix, room_id, event_id)) {
+			cJSON_Delete(cJSON_DetachItemViaPointer(chunk, event));
+		}
+
+		event = next;
+	}
+}
+
+/* A /messages request, driven by the multi handle like /sync. */
+struct matrix_page_transfer {
+	struct response response;
+	struct matrix_page_transfer *next;
+	matrix_paginate_cb paginate_cb;
+	void *userp;
+	char *room_id;
+};
+
+/* nullable: page */
+static void
+page_free(struct matrix *matrix, struct matrix_page_transfer *page) {
+	if (!page) {
+		return;
+	}
+
+	if (page->response.easy) {
+		response_finish(matrix, &page->response);
+	}
+
+	free(page->room_id);
+	free(page);
+}
+
+static enum matrix_code
+page_handle_response(struct matrix *matrix, struct matrix_page_transfer *page) {
+	enum matrix_code code = MATRIX_MALFORMED_JSON;
+
+	/* Not parsed with the arena, which may still hold the sync response when
+	 * this completes in the middle of it. */
+	cJSON *parsed = cJSON_Parse(page->response.buf->data);
+	cJSON *chunk = cJSON_GetObjectItem(parsed, "chunk");
+
+	cJSON *state = cJSON_GetObjectItem(parsed, "state");
+	char *end = GETSTR(parsed, "end");
+
+	struct matrix_room room = {
+		.id = page->room_id,
+		.events =
+			{
+				[MATRIX_EVENT_STATE] = state ? state->child : NULL,
+			},
+		/* There's no token to continue from at the start of the room. */
+		.timeline =
+			{
+				.prev_batch = end,
+				.limited = !!end,
+			},
+		.type = MATRIX_ROOM_JOIN,
+	};
+
+	if (cJSON_IsArray(chunk)) {
+		drop_retained(matrix, page->room_id, chunk);
+		room.events[MATRIX_EVENT_TIMELINE] = chunk->child;
+
+		page->paginate_cb(matrix, &room, page->userp);
+		code = MATRIX_SUCCESS;
+	}
+
+	cJSON_Delete(parsed);
+
+	return code;
+}
+
+/* Pass the response to the page's callback, NULL if the request failed. */
+static void
+page_done(struct matrix *matrix, CURL *easy, CURLcode result) {
+	struct matrix_page_transfer **prev = &matrix->pages;
+
+	while (*prev && (*prev)->response.easy != easy) {
+		prev = &(*prev)->next;
+	}
+
+	struct matrix_page_transfer *page = *prev;
+
+	if (!page) {
+		return;
+	}
+
+	*prev = page->next;
+
+	curl_multi_remove_handle(matrix->multi, easy);
+
+	if (result != CURLE_OK ||
+		(response_status(&page->response)) != MATRIX_SUCCESS ||
+		(page_handle_response(matrix, page)) != MATRIX_SUCCESS) {
+		page->paginate_cb(matrix, NULL, page->userp);
+	}
+
+	page_free(matrix, page);
+}
+
+void
+matrix_paginate_cancel(struct matrix *matrix) {
+	while (matrix->pages) {
+		struct matrix_page_transfer *page = matrix->pages;
+
+		matrix->pages = page->next;
+
+		curl_multi_remove_handle(matrix->multi, page->response.easy);
+		page_free(matrix, page);
+	}
+}
 
-			cJSON *parsed = cJSON_Parse(response.data);
+enum matrix_code
+matrix_transfer_done(struct matrix *matrix, CURL *easy, CURLcode result) {
+	struct matrix_sync_transfer *sync = matrix->sync;
+
+	/* A failed page only concerns its callback, the sync goes on. */
+	if (!sync || easy != sync->response.easy) {
+		page_done(matrix, easy, result);
+		return MATRIX_SUCCESS;
+	}
+
+	curl_multi_remove_handle(matrix->multi, easy);
+
+	enum matrix_code code = MATRIX_CURL_FAILURE;
 
-			if ((code = set_batch(url, &new_buf, &new_len,
-								  GETSTR(parsed, "next_batch"))) !=
-				MATRIX_SUCCESS) {
-				cJSON_Delete(parsed);
+	/* TODO add error callback to allow implementing backoff */
+	if (result == CURLE_OK &&
+		(code = response_status(&sync->response)) == MATRIX_SUCCESS &&
+		(code = sync_handle_response(matrix, sync)) == MATRIX_SUCCESS) {
+		code = sync_transfer_add(matrix);
+	}
+
+	if (code != MATRIX_SUCCESS) {
+		matrix_sync_stop(matrix);
+	}
+
+	return code;
+}
+
+enum matrix_code
+matrix_sync_run(struct matrix *matrix, const char *next_batch, unsigned timeout,
+				int stop_fd) {
+	enum matrix_code code = matrix_sync_start(matrix, next_batch, timeout);
+
+	/* stop_fd comes before curl's descriptors. */
+	const size_t first = stop_fd != -1 ? 1 : 0;
+	struct pollfd *fds = NULL;
+	size_t fds_cap = 0;
+
+	while (code == MATRIX_SUCCESS) {
+		size_t nfds =
+			fds_cap > first
+				? matrix_get_pollfds(matrix, &fds[first], fds_cap - first)
+				: matrix_get_pollfds(matrix, NULL, 0);
+
+		if ((nfds + first) > fds_cap) {
+			struct pollfd *tmp = realloc(fds, (nfds + first) * sizeof(*fds));
+
+			if (!tmp) {
+				code = MATRIX_NOMEM;
 				break;
 			}
 
-			response.len = 0; /* Ensures that we don't realloc extra bytes but
-			write the new contents after the old NUL terminator, making us read
-			the old data. See "&(response->data[response->len])" in write_cb. */
+			fds = tmp;
+			fds_cap = nfds + first;
+			continue;
+		}
 
-			matrix_dispatch_sync(matrix, parsed);
-			cJSON_Delete(parsed);
+		if (first) {
+			fds[0] = (struct pollfd){.fd = stop_fd, .events = POLLIN};
 		}
+
+		if ((poll(fds, nfds + first, matrix_get_timeout(matrix))) == -1 &&
+			errno != EINTR) {
+			code = MATRIX_CURL_FAILURE;
+			break;
+		}
+
+		if (first && fds[0].revents) {
+			break;
+		}
+
+		code = matrix_perform_step(matrix, &fds[first], nfds);
 	}
 
-	curl_slist_free_all(headers);
-	response_finish(&response);
-	free(url);
-	free(new_buf);
+	free(fds);
+	matrix_sync_stop(matrix);
 
 	return code;
 }
 
+enum matrix_code
+matrix_sync_forever(struct matrix *matrix, const char *next_batch,
+					unsigned timeout) {
+	return matrix_sync_run(matrix, next_batch, timeout, -1);
+}
+
 enum matrix_code
 matrix_login_with_token(struct matrix *matrix, const char *access_token) {
 	if (!access_token) {
 		return MATRIX_INVALID_ARGUMENT;
 	}
 
-	if ((matrix->access_token = matrix_strdup(access_token))) {
-		return MATRIX_SUCCESS;
+	char *token = matrix_strdup(access_token);
+	struct matrix_headers *headers = token ? headers_create(token) : NULL;
+
+	if (!headers) {
+		free(token);
+		return MATRIX_NOMEM;
 	}
 
-	return MATRIX_NOMEM;
+	/* Requests in flight keep their reference to the old headers. */
+	pthread_mutex_lock(&matrix->session_mutex);
+
+	struct matrix_headers *old_headers = matrix->headers;
+	char *old_token = matrix->access_token;
+
+	matrix->headers = headers;
+	matrix->access_token = token;
+
+	pthread_mutex_unlock(&matrix->session_mutex);
+
+	matrix_headers_release(matrix, old_headers);
+	free(old_token);
+
+	return MATRIX_SUCCESS;
 }
 
 enum matrix_code
@@ -301,7 +710,7 @@ matrix_login(struct matrix *matrix, const char *password,
 		(cJSON_AddStringToObject(identifier, "user", matrix->mxid)) &&
 		(code = perform(matrix, json, POST, "/login", NULL, &response)) ==
 			MATRIX_SUCCESS) {
-		cJSON *parsed = cJSON_Parse(response.data);
+		cJSON *parsed = cJSON_Parse(response.buf->data);
 
 		if ((code = matrix_login_with_token(matrix,
 											GETSTR(parsed, "access_token"))) ==
@@ -314,7 +723,200 @@ matrix_login(struct matrix *matrix, const char *password,
 
 	cJSON_Delete(json);
 
-	response_finish(&response);
+	response_finish(matrix, &response);
+
+	return code;
+}
+
+/* Exclude everything that the iterators don't expose. */
+static cJSON *
+filter_create(const struct matrix_sync_filter *filter) {
+	cJSON *json = cJSON_CreateObject();
+	cJSON *room = NULL;
+	cJSON *state = NULL;
+	cJSON *timeline = NULL;
+	cJSON *ephemeral = NULL;
+
+	if (!json ||
+		!(cJSON_AddArrayToObject(
+			cJSON_AddObjectToObject(json, "presence"), "types")) ||
+		!(cJSON_AddArrayToObject(
+			cJSON_AddObjectToObject(json, "account_data"), "types")) ||
+		!(room = cJSON_AddObjectToObject(json, "room")) ||
+		!(cJSON_AddArrayToObject(
+			cJSON_AddObjectToObject(room, "account_data"), "types")) ||
+		!(state = cJSON_AddObjectToObject(room, "state")) ||
+		!(timeline = cJSON_AddObjectToObject(room, "timeline")) ||
+		!(ephemeral = cJSON_AddObjectToObject(room, "ephemeral")) ||
+		(filter->timeline_limit &&
+		 !(cJSON_AddNumberToObject(timeline, "limit",
+								   filter->timeline_limit))) ||
+		(filter->lazy_load_members &&
+		 (!(cJSON_AddTrueToObject(state, "lazy_load_members")) ||
+		  !(cJSON_AddTrueToObject(timeline, "lazy_load_members"))))) {
+		cJSON_Delete(json);
+		return NULL;
+	}
+
+	if (filter->known_types_only) {
+		const struct {
+			cJSON *object;
+			enum matrix_event_type type;
+		} allowlists[] = {
+			{state, MATRIX_EVENT_STATE},
+			{timeline, MATRIX_EVENT_TIMELINE},
+			{ephemeral, MATRIX_EVENT_EPHEMERAL},
+		};
+
+		for (size_t i = 0; i < (sizeof(allowlists) / sizeof(*allowlists));
+			 i++) {
+			cJSON *types =
+				cJSON_AddArrayToObject(allowlists[i].object, "types");
+
+			if (!types ||
+				(matrix_sync_add_types(types, allowlists[i].type)) == -1) {
+				cJSON_Delete(json);
+				return NULL;
+			}
+		}
+	}
+
+	return json;
+}
+
+static enum matrix_code
+filter_upload(struct matrix *matrix, const cJSON *json, char **filter_id) {
+	enum matrix_code code = MATRIX_NOMEM;
+
+	char *mxid = curl_easy_escape(NULL, matrix->mxid, 0);
+	char *endpoint = NULL;
+
+	struct response response = {0};
+
+	if (mxid && (asprintf(&endpoint, "/user/%s/filter", mxid)) == -1) {
+		endpoint = NULL; /* Undefined on failure. */
+	}
+
+	if (endpoint && (code = perform(matrix, json, POST, endpoint, NULL,
+									&response)) == MATRIX_SUCCESS) {
+		cJSON *parsed = cJSON_Parse(response.buf->data);
+		const char *id = GETSTR(parsed, "filter_id");
+
+		if (!id) {
+			code = MATRIX_MALFORMED_JSON;
+		} else if (!(*filter_id = matrix_strdup(id))) {
+			code = MATRIX_NOMEM;
+		}
+
+		cJSON_Delete(parsed);
+	}
+
+	response_finish(matrix, &response);
+	free(endpoint);
+	curl_free(mxid);
+
+	return code;
+}
+
+enum matrix_code
+matrix_set_sync_filter(struct matrix *matrix,
+					   const struct matrix_sync_filter *filter) {
+	if (!filter) {
+		free(matrix->filter_id);
+		matrix->filter_id = NULL;
+
+		return MATRIX_SUCCESS;
+	}
+
+	if (!matrix->access_token) {
+		return MATRIX_NOT_LOGGED_IN;
+	}
+
+	enum matrix_code code = MATRIX_NOMEM;
+
+	cJSON *json = filter_create(filter);
+	char *definition = json ? cJSON_PrintUnformatted(json) : NULL;
+	char *filter_id = NULL;
+
+	if (definition) {
+		const char *cached = matrix_cache_filter_id(&matrix->cache, definition);
+
+		if (cached) {
+			code = (filter_id = matrix_strdup(cached)) ? MATRIX_SUCCESS
+													   : MATRIX_NOMEM;
+		} else if ((code = filter_upload(matrix, json, &filter_id)) ==
+				   MATRIX_SUCCESS) {
+			matrix_cache_set_filter(&matrix->cache, definition, filter_id);
+		}
+	}
+
+	if (code == MATRIX_SUCCESS) {
+		free(matrix->filter_id);
+		matrix->filter_id = filter_id;
+	}
+
+	cJSON_free(definition);
+	cJSON_Delete(json);
+
+	return code;
+}
+
+enum matrix_code
+matrix_paginate(struct matrix *matrix, const char *room_id, const char *from,
+				unsigned limit, matrix_paginate_cb paginate_cb, void *userp) {
+	if (!matrix || !room_id || !paginate_cb || limit == 0 || matrix->thread) {
+		return MATRIX_INVALID_ARGUMENT;
+	}
+
+	if (!matrix->access_token) {
+		return MATRIX_NOT_LOGGED_IN;
+	}
+
+	if (!from && !(from = matrix_store_timeline_token(matrix, room_id))) {
+		return MATRIX_INVALID_ARGUMENT;
+	}
+
+	enum matrix_code code = MATRIX_NOMEM;
+
+	struct matrix_page_transfer *page = calloc(1, sizeof(*page));
+	char *id = curl_easy_escape(NULL, room_id, 0);
+	char *token = curl_easy_escape(NULL, from, 0);
+	char *endpoint = NULL;
+	char *params = NULL;
+
+	if (page && id && token &&
+		(asprintf(&endpoint, "/rooms/%s/messages", id)) == -1) {
+		endpoint = NULL; /* Undefined on failure. */
+	}
+
+	if (endpoint && (asprintf(&params, "?dir=b&limit=%u&from=%s", limit,
+							  token)) == -1) {
+		params = NULL;
+	}
+
+	if (params && (page->room_id = matrix_strdup(room_id)) &&
+		(code = response_init(matrix, GET, NULL, endpoint, params, NULL,
+							  &page->response)) == MATRIX_SUCCESS) {
+		page->paginate_cb = paginate_cb;
+		page->userp = userp;
+
+		response_reset(&page->response);
+
+		if ((curl_multi_add_handle(matrix->multi, page->response.easy)) ==
+			CURLM_OK) {
+			page->next = matrix->pages;
+			matrix->pages = page;
+			page = NULL;
+		} else {
+			code = MATRIX_CURL_FAILURE;
+		}
+	}
+
+	page_free(matrix, page);
+	free(params);
+	free(endpoint);
+	curl_free(token);
+	curl_free(id);
 
 	return code;
 }
@@ -0,0 +1,164 @@
+#include "matrix-priv.h"
+
+enum {
+	ARENA_CHUNK_MIN = 64 * 1024,
+	/* Give the memory back if the last response used less than this fraction
+	 * of the chunk. */
+	ARENA_SHRINK_RATIO = 4,
+};
+
+/* Everything allocated from the arena is a cJSON node or string. */
+#define ARENA_ALIGN (_Alignof(cJSON))
+
+struct matrix_arena_chunk {
+	struct matrix_arena_chunk *next;
+	size_t len;
+	size_t cap;
+	_Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+/* The cJSON hooks are global, so the arena that they allocate from is chosen
+ * per thread. */
+static _Thread_local struct matrix_arena *active;
+
+static void *
+arena_alloc(struct matrix_arena *arena, size_t size) {
+	if (size > (SIZE_MAX - ARENA_ALIGN)) {
+		return NULL;
+	}
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	struct matrix_arena_chunk *chunk = arena->chunks;
+
+	if (!chunk || (chunk->cap - chunk->len) < size) {
+		size_t cap = arena->next_cap;
+
+		cap = cap > ARENA_CHUNK_MIN ? cap : ARENA_CHUNK_MIN;
+
+		/* Grow geometrically within a response too. */
+		if (chunk && cap < (chunk->cap * 2)) {
+			cap = chunk->cap * 2;
+		}
+
+		if (cap < size) {
+			cap = size;
+		}
+
+		if (!(chunk = malloc(sizeof(*chunk) + cap))) {
+			return NULL;
+		}
+
+		*chunk = (struct matrix_arena_chunk){
+			.next = arena->chunks,
+			.cap = cap,
+		};
+
+		arena->chunks = chunk;
+		arena->capacity += cap;
+	}
+
+	void *ptr = &chunk->data[chunk->len];
+
+	chunk->len += size;
+	arena->used += size;
+
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+	}
+
+	return ptr;
+}
+
+static bool
+arena_owns(const struct matrix_arena *arena, const void *ptr) {
+	for (const struct matrix_arena_chunk *chunk = arena->chunks; chunk;
+		 chunk = chunk->next) {
+		if ((uintptr_t) ptr >= (uintptr_t) chunk->data &&
+			(uintptr_t) ptr < ((uintptr_t) chunk->data + chunk->cap)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void *
+hook_malloc(size_t size) {
+	return active ? arena_alloc(active, size) : malloc(size);
+}
+
+/* cJSON frees partially parsed trees on errors, arena memory is only released
+ * by resetting the arena. */
+static void
+hook_free(void *ptr) {
+	if (!active || !arena_owns(active, ptr)) {
+		free(ptr);
+	}
+}
+
+static void
+free_chunks(struct matrix_arena *arena) {
+	for (struct matrix_arena_chunk *chunk = arena->chunks; chunk;) {
+		struct matrix_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	arena->chunks = NULL;
+	arena->capacity = 0;
+}
+
+void
+matrix_arena_init(void) {
+	cJSON_InitHooks(&(cJSON_Hooks){
+		.malloc_fn = hook_malloc,
+		.free_fn = hook_free,
+	});
+}
+
+void
+matrix_arena_begin(struct matrix_arena *arena) {
+	assert(!active);
+
+	active = arena;
+}
+
+void
+matrix_arena_end(void) {
+	active = NULL;
+}
+
+void
+matrix_arena_reset(struct matrix_arena *arena) {
+	assert(active != arena);
+
+	struct matrix_arena_chunk *chunk = arena->chunks;
+	size_t used = arena->used;
+
+	arena->used = 0;
+
+	if (!chunk) {
+		return;
+	}
+
+	/* Replace chunks that overflowed, or that are mostly unused, with a single
+	 * one that fits the last response with some headroom. */
+	if (chunk->next || (chunk->cap > ARENA_CHUNK_MIN &&
+						(used * ARENA_SHRINK_RATIO) < chunk->cap)) {
+		free_chunks(arena);
+		arena->next_cap = used + (used / 4);
+	} else {
+		chunk->len = 0;
+	}
+}
+
+void
+matrix_arena_finish(struct matrix_arena *arena) {
+	assert(active != arena);
+
+	free_chunks(arena);
+
+	*arena = (struct matrix_arena){0};
+}
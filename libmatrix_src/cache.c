@@ -0,0 +1,1026 @@
+#include "matrix-priv.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The cache is a JSON file of the form:
+ *
+ * {"version": 1, "user_id": "@a:b", "next_batch": "s1",
+ *  "filter": {"definition": "{...}", "filter_id": "1"},
+ *  "rooms": {"join": {...}, "invite": {...}}}
+ *
+ * rooms has the same shape as in a /sync response so that it can be passed to
+ * sync_cb unchanged. Joined rooms hold their accumulated state, their summary
+ * and their latest timeline events. It is replaced atomically on every write,
+ * so a crash leaves either the old or the new file, whose rooms always match
+ * its next_batch.
+ *
+ * Writes happen on a thread of their own. The sync only serializes the rooms
+ * that changed since the last write, every other room reuses the fragment of
+ * the file that it was last written as. */
+
+enum {
+	CACHE_VERSION = 1,
+	/* The most timeline events that are kept per room. */
+	CACHE_TIMELINE_MAX = 50,
+	/* Writes after the first one are throttled to this interval. */
+	CACHE_WRITE_INTERVAL_MS = 10000,
+};
+
+static const char *const kind_join = "join";
+static const char *const kind_invite = "invite";
+
+static long long
+now_ms(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static cJSON *
+get_rooms(const struct matrix_cache *cache, const char *kind) {
+	return cJSON_GetObjectItemCaseSensitive(
+		cJSON_GetObjectItemCaseSensitive(cache->root, "rooms"), kind);
+}
+
+static int
+index_rooms(struct matrix_cache *cache) {
+	const char *const kinds[] = {kind_join, kind_invite};
+
+	matrix_index_finish(&cache->rooms);
+
+	for (size_t i = 0; i < (sizeof(kinds) / sizeof(*kinds)); i++) {
+		cJSON *room = NULL;
+
+		cJSON_ArrayForEach(room, get_rooms(cache, kinds[i])) {
+			if ((matrix_index_put(&cache->rooms, kinds[i], room->string,
+								  room)) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void
+fragment_release(struct matrix_cache_fragment *fragment) {
+	if (fragment && atomic_fetch_sub(&fragment->refs, 1) == 1) {
+		free(fragment);
+	}
+}
+
+/* Returns a fragment of the concatenated strings, the last one must be NULL. */
+static struct matrix_cache_fragment *
+fragment_create(const char *first, ...) {
+	va_list ap;
+	size_t len = 0;
+
+	va_start(ap, first);
+
+	for (const char *s = first; s; s = va_arg(ap, const char *)) {
+		len += strlen(s);
+	}
+
+	va_end(ap);
+
+	struct matrix_cache_fragment *fragment =
+		malloc(sizeof(*fragment) + len + 1);
+
+	if (!fragment) {
+		return NULL;
+	}
+
+	fragment->refs = 1;
+	fragment->len = 0;
+
+	va_start(ap, first);
+
+	for (const char *s = first; s; s = va_arg(ap, const char *)) {
+		size_t s_len = strlen(s);
+
+		memcpy(&fragment->data[fragment->len], s, s_len);
+		fragment->len += s_len;
+	}
+
+	va_end(ap);
+
+	fragment->data[len] = '\0';
+
+	return fragment;
+}
+
+/* Forget the fragments of the room, which changed. */
+static void
+fragments_invalidate(struct matrix_cache *cache, const char *id) {
+	fragment_release(matrix_index_remove(&cache->fragments, kind_join, id));
+	fragment_release(matrix_index_remove(&cache->fragments, kind_invite, id));
+}
+
+static void
+fragments_finish(struct matrix_cache *cache) {
+	for (size_t i = 0; i < cache->fragments.cap; i++) {
+		fragment_release(cache->fragments.entries[i].item);
+	}
+
+	matrix_index_finish(&cache->fragments);
+}
+
+/* nullable: write */
+static void
+write_free(struct matrix_cache_write *write) {
+	if (!write) {
+		return;
+	}
+
+	for (size_t i = 0; i < write->len; i++) {
+		fragment_release(write->parts[i].fragment);
+	}
+
+	free(write->parts);
+	free(write);
+}
+
+/* Append a part, taking the reference to the fragment, which may be NULL
+ * after a failed allocation. */
+static int
+write_add(struct matrix_cache_write *write,
+		  struct matrix_cache_fragment *fragment, size_t offset) {
+	if (!fragment) {
+		return -1;
+	}
+
+	if (write->len == write->cap) {
+		size_t cap = write->cap ? write->cap * 2 : 64;
+		struct matrix_cache_part *parts =
+			realloc(write->parts, cap * sizeof(*parts));
+
+		if (!parts) {
+			fragment_release(fragment);
+			return -1;
+		}
+
+		write->parts = parts;
+		write->cap = cap;
+	}
+
+	write->parts[write->len++] = (struct matrix_cache_part){
+		.fragment = fragment,
+		.offset = offset,
+	};
+
+	return 0;
+}
+
+/* Serialize the room as a member of its object, with a leading separator. */
+static struct matrix_cache_fragment *
+room_fragment(const cJSON *room) {
+	cJSON *id = cJSON_CreateString(room->string);
+	char *key = id ? cJSON_PrintUnformatted(id) : NULL;
+	char *value = key ? cJSON_PrintUnformatted(room) : NULL;
+	struct matrix_cache_fragment *fragment =
+		value ? fragment_create(",", key, ":", value, NULL) : NULL;
+
+	cJSON_free(value);
+	cJSON_free(key);
+	cJSON_Delete(id);
+
+	return fragment;
+}
+
+/* Add the rooms of the kind, serializing those that changed since the last
+ * write. */
+static int
+write_add_rooms(struct matrix_cache *cache, struct matrix_cache_write *write,
+				const char *kind) {
+	const cJSON *room = NULL;
+	size_t offset = 1;
+
+	cJSON_ArrayForEach(room, get_rooms(cache, kind)) {
+		struct matrix_cache_fragment *fragment =
+			matrix_index_get(&cache->fragments, kind, room->string);
+
+		if (fragment) {
+			atomic_fetch_add(&fragment->refs, 1);
+		} else if (!(fragment = room_fragment(room)) ||
+				   (matrix_index_put(&cache->fragments, kind, room->string,
+									 fragment)) == -1) {
+			fragment_release(fragment);
+			return -1;
+		} else {
+			/* One reference for the index, one for the write. */
+			atomic_fetch_add(&fragment->refs, 1);
+		}
+
+		if ((write_add(write, fragment, offset)) == -1) {
+			return -1;
+		}
+
+		offset = 0;
+	}
+
+	return 0;
+}
+
+/* The members of the root besides rooms, and the start of rooms. */
+static struct matrix_cache_fragment *
+head_fragment(const cJSON *root) {
+	struct matrix_buf buf = {0};
+	const cJSON *item = NULL;
+	int ret = matrix_buf_append(&buf, "{", 1);
+
+	cJSON_ArrayForEach(item, root) {
+		if (ret == -1 || (strcmp(item->string, "rooms")) == 0) {
+			continue;
+		}
+
+		/* The keys are our own and never need escaping. */
+		char *value = cJSON_PrintUnformatted(item);
+
+		ret = value && (matrix_buf_append(&buf, "\"", 1)) == 0 &&
+					  (matrix_buf_append(&buf, item->string,
+										 strlen(item->string))) == 0 &&
+					  (matrix_buf_append(&buf, "\":", 2)) == 0 &&
+					  (matrix_buf_append(&buf, value, strlen(value))) == 0 &&
+					  (matrix_buf_append(&buf, ",", 1)) == 0
+				  ? 0
+				  : -1;
+
+		cJSON_free(value);
+	}
+
+	struct matrix_cache_fragment *fragment =
+		ret == 0 ? fragment_create(buf.data, "\"rooms\":{\"join\":{", NULL)
+				 : NULL;
+
+	matrix_buf_finish(&buf);
+
+	return fragment;
+}
+
+/* Describe the file as it should be written now. Only the rooms that changed
+ * since the last write are serialized, the others reuse their fragments. */
+static struct matrix_cache_write *
+write_create(struct matrix_cache *cache) {
+	struct matrix_cache_write *write = calloc(1, sizeof(*write));
+
+	if (write && (write_add(write, head_fragment(cache->root), 0)) == 0 &&
+		(write_add_rooms(cache, write, kind_join)) == 0 &&
+		(write_add(write, fragment_create("},\"invite\":{", NULL), 0)) ==
+			0 &&
+		(write_add_rooms(cache, write, kind_invite)) == 0 &&
+		(write_add(write, fragment_create("}}}", NULL), 0)) == 0) {
+		return write;
+	}
+
+	write_free(write);
+
+	return NULL;
+}
+
+/* Give up on caching after a failure, the file on disk stays consistent. */
+static void
+cache_fail(struct matrix_cache *cache) {
+	cJSON_Delete(cache->root);
+	matrix_index_finish(&cache->rooms);
+	fragments_finish(cache);
+
+	cache->root = NULL;
+	cache->dirty = false;
+}
+
+/* Make the rename durable. */
+static void
+sync_parent(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, (size_t) (slash - path) + 1) : NULL;
+	int fd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(dir);
+}
+
+/* The temporary file is never followed if it's a link, and one that was left
+ * behind by a crash is replaced. */
+static int
+open_tmp(const char *tmp_path) {
+	const int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+	int fd = open(tmp_path, flags, 0600);
+
+	if (fd == -1 && errno == EEXIST && (unlink(tmp_path)) == 0) {
+		fd = open(tmp_path, flags, 0600);
+	}
+
+	return fd;
+}
+
+/* Replace the file at path with the write, atomically. */
+static int
+write_file(const char *path, const struct matrix_cache_write *write) {
+	char *tmp_path = NULL;
+	int fd = -1;
+	FILE *fp = NULL;
+
+	if ((asprintf(&tmp_path, "%s.tmp", path)) == -1) {
+		return -1;
+	}
+
+	bool success = (fd = open_tmp(tmp_path)) != -1 && (fp = fdopen(fd, "w"));
+
+	for (size_t i = 0; success && i < write->len; i++) {
+		const struct matrix_cache_part *part = &write->parts[i];
+		size_t len = part->fragment->len - part->offset;
+
+		success = (fwrite(&part->fragment->data[part->offset], 1, len, fp)) ==
+				  len;
+	}
+
+	success = success && (fflush(fp)) == 0 && (fsync(fd)) == 0;
+
+	if (fp) {
+		success = (fclose(fp)) == 0 && success;
+	} else if (fd != -1) {
+		close(fd);
+	}
+
+	if (success && (rename(tmp_path, path)) == 0) {
+		sync_parent(path);
+	} else {
+		if (fd != -1) {
+			unlink(tmp_path);
+		}
+
+		success = false;
+	}
+
+	free(tmp_path);
+
+	return success ? 0 : -1;
+}
+
+static void *
+writer_run(void *arg) {
+	struct matrix_cache_writer *writer = arg;
+
+	pthread_mutex_lock(&writer->mutex);
+
+	for (;;) {
+		while (!writer->pending && !writer->stop) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		}
+
+		/* The last write is finished before stopping. */
+		struct matrix_cache_write *write = writer->pending;
+
+		if (!write) {
+			break;
+		}
+
+		writer->pending = NULL;
+
+		pthread_mutex_unlock(&writer->mutex);
+
+		/* A failed write leaves the old file, the next one may succeed. */
+		(void) write_file(writer->path, write);
+		write_free(write);
+
+		pthread_mutex_lock(&writer->mutex);
+	}
+
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static struct matrix_cache_writer *
+writer_start(const char *path) {
+	struct matrix_cache_writer *writer = calloc(1, sizeof(*writer));
+
+	if (!writer) {
+		return NULL;
+	}
+
+	if (!(writer->path = strdup(path))) {
+		free(writer);
+		return NULL;
+	}
+
+	if ((pthread_mutex_init(&writer->mutex, NULL)) == 0) {
+		if ((pthread_cond_init(&writer->cond, NULL)) == 0) {
+			if ((pthread_create(&writer->thread, NULL, writer_run, writer)) ==
+				0) {
+				return writer;
+			}
+
+			pthread_cond_destroy(&writer->cond);
+		}
+
+		pthread_mutex_destroy(&writer->mutex);
+	}
+
+	free(writer->path);
+	free(writer);
+
+	return NULL;
+}
+
+/* Wait for the pending write and stop the thread. */
+/* nullable: writer */
+static void
+writer_stop(struct matrix_cache_writer *writer) {
+	if (!writer) {
+		return;
+	}
+
+	pthread_mutex_lock(&writer->mutex);
+	writer->stop = true;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+
+	pthread_join(writer->thread, NULL);
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+	free(writer->path);
+	free(writer);
+}
+
+/* Hand the current state to the writer, replacing a write that it didn't
+ * start yet. */
+static int
+cache_write(struct matrix_cache *cache) {
+	if (!cache->writer && !(cache->writer = writer_start(cache->path))) {
+		return -1;
+	}
+
+	struct matrix_cache_write *write = write_create(cache);
+
+	if (!write) {
+		return -1;
+	}
+
+	struct matrix_cache_writer *writer = cache->writer;
+
+	pthread_mutex_lock(&writer->mutex);
+
+	struct matrix_cache_write *replaced = writer->pending;
+
+	writer->pending = write;
+	pthread_cond_signal(&writer->cond);
+
+	pthread_mutex_unlock(&writer->mutex);
+
+	write_free(replaced);
+
+	cache->dirty = false;
+	cache->last_write_ms = now_ms();
+
+	return 0;
+}
+
+static cJSON *
+cache_read(const char *path, const char *mxid) {
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp) {
+		return NULL;
+	}
+
+	struct matrix_buf buf = {0};
+	char tmp[BUFSIZ];
+	size_t read = 0;
+	int ret = 0;
+
+	while (ret == 0 && (read = fread(tmp, 1, sizeof(tmp), fp)) > 0) {
+		ret = matrix_buf_append(&buf, tmp, read);
+	}
+
+	cJSON *root = ret == 0 && !ferror(fp) && buf.data
+					  ? cJSON_ParseWithLength(buf.data, buf.len)
+					  : NULL;
+
+	fclose(fp);
+	matrix_buf_finish(&buf);
+
+	cJSON *rooms = cJSON_GetObjectItemCaseSensitive(root, "rooms");
+	const char *user_id = GETSTR(root, "user_id");
+
+	/* Discard caches of other versions or accounts. */
+	if (cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(
+			root, "version")) != CACHE_VERSION ||
+		!user_id || (strcmp(user_id, mxid)) != 0 ||
+		!cJSON_IsString(cJSON_GetObjectItemCaseSensitive(root, "next_batch")) ||
+		!cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(rooms, kind_join)) ||
+		!cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(rooms, kind_invite))) {
+		cJSON_Delete(root);
+		return NULL;
+	}
+
+	return root;
+}
+
+static cJSON *
+cache_create(const char *mxid) {
+	cJSON *root = cJSON_CreateObject();
+	cJSON *rooms = NULL;
+
+	if (root && (cJSON_AddNumberToObject(root, "version", CACHE_VERSION)) &&
+		(cJSON_AddStringToObject(root, "user_id", mxid)) &&
+		(rooms = cJSON_AddObjectToObject(root, "rooms")) &&
+		(cJSON_AddObjectToObject(rooms, kind_join)) &&
+		(cJSON_AddObjectToObject(rooms, kind_invite))) {
+		return root;
+	}
+
+	cJSON_Delete(root);
+	return NULL;
+}
+
+int
+matrix_cache_open(struct matrix_cache *cache, const char *path,
+				  const char *mxid) {
+	matrix_cache_finish(cache);
+
+	if (!path) {
+		return 0;
+	}
+
+	if (!(cache->path = strdup(path))) {
+		return -1;
+	}
+
+	if (!(cache->root = cache_read(path, mxid)) &&
+		!(cache->root = cache_create(mxid))) {
+		matrix_cache_finish(cache);
+		return -1;
+	}
+
+	if ((index_rooms(cache)) == -1) {
+		matrix_cache_finish(cache);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+matrix_cache_finish(struct matrix_cache *cache) {
+	matrix_cache_discard(cache);
+	matrix_cache_flush(cache);
+	writer_stop(cache->writer);
+
+	cJSON_Delete(cache->root);
+	matrix_index_finish(&cache->rooms);
+	fragments_finish(cache);
+	free(cache->staged);
+	free(cache->path);
+
+	*cache = (struct matrix_cache){0};
+}
+
+void
+matrix_cache_flush(struct matrix_cache *cache) {
+	if (cache->root && cache->dirty) {
+		cache_write(cache);
+	}
+}
+
+/* Add or replace the key, item is freed on failure. */
+static int
+object_set(cJSON *object, const char *key, cJSON *item) {
+	if (!item) {
+		return -1;
+	}
+
+	if (cJSON_GetObjectItemCaseSensitive(object, key)) {
+		return cJSON_ReplaceItemInObjectCaseSensitive(object, key, item) ? 0
+																		 : -1;
+	}
+
+	if (!(cJSON_AddItemToObject(object, key, item))) {
+		cJSON_Delete(item);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* A copy of the event without the "unsigned" object, which only holds data
+ * that is stale by the time the cache is read. */
+static cJSON *
+copy_event(const cJSON *event) {
+	cJSON *copy = cJSON_Duplicate(event, true);
+
+	cJSON_DeleteItemFromObjectCaseSensitive(copy, "unsigned");
+
+	return copy;
+}
+
+static bool
+is_state_event(const cJSON *event) {
+	return cJSON_IsString(cJSON_GetObjectItemCaseSensitive(event, "type")) &&
+		   cJSON_IsString(cJSON_GetObjectItemCaseSensitive(event, "state_key"));
+}
+
+/* Replace the cached state events with newer ones with the same type and
+ * state_key, and add the rest. */
+static int
+merge_state(cJSON *cached, const cJSON *const incoming[], size_t len) {
+	struct matrix_index index = {0};
+	cJSON *event = NULL;
+	int ret = 0;
+
+	cJSON_ArrayForEach(event, cached) {
+		if (is_state_event(event) &&
+			(matrix_index_put(&index, GETSTR(event, "type"),
+					   GETSTR(event, "state_key"), event)) == -1) {
+			matrix_index_finish(&index);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; ret == 0 && i < len; i++) {
+		cJSON_ArrayForEach(event, incoming[i]) {
+			if (!is_state_event(event)) {
+				continue;
+			}
+
+			cJSON *copy = copy_event(event);
+
+			if (!copy) {
+				ret = -1;
+				break;
+			}
+
+			const char *type = GETSTR(copy, "type");
+			const char *state_key = GETSTR(copy, "state_key");
+
+			struct matrix_index_entry *entry =
+				index.cap ? matrix_index_find(&index, type, state_key) : NULL;
+
+			if (entry && entry->item) {
+				cJSON_ReplaceItemViaPointer(cached, entry->item, copy);
+				*entry = (struct matrix_index_entry){
+					.kind = type, .key = state_key, .item = copy};
+			} else if (!(cJSON_AddItemToArray(cached, copy)) ||
+					   (matrix_index_put(&index, type, state_key, copy)) ==
+						   -1) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	matrix_index_finish(&index);
+
+	return ret;
+}
+
+/* Keep up to CACHE_TIMELINE_MAX of the latest timeline events. Batches that
+ * follow the cached ones without a gap are appended, limited ones replace them.
+ * prev_batch is that of the oldest kept batch, or of the latest one once events
+ * were dropped, so that paginating from it may repeat events but never skips
+ * them. */
+static int
+merge_timeline(cJSON *cached_room, const cJSON *timeline) {
+	cJSON *events = cJSON_GetObjectItemCaseSensitive(timeline, "events");
+
+	if (cJSON_GetArraySize(events) < 1) {
+		return 0;
+	}
+
+	cJSON *cached = cJSON_GetObjectItemCaseSensitive(cached_room, "timeline");
+	cJSON *cached_events = cJSON_GetObjectItemCaseSensitive(cached, "events");
+
+	if (!cached_events ||
+		cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(timeline, "limited"))) {
+		/* Older batches are never complete, so it is always limited. */
+		if (!(cached = cJSON_CreateObject()) ||
+			!(cJSON_AddTrueToObject(cached, "limited")) ||
+			!(cached_events = cJSON_AddArrayToObject(cached, "events"))) {
+			cJSON_Delete(cached);
+			return -1;
+		}
+
+		if ((object_set(cached_room, "timeline", cached)) == -1) {
+			return -1;
+		}
+	}
+
+	cJSON *event = NULL;
+
+	cJSON_ArrayForEach(event, events) {
+		cJSON *copy = copy_event(event);
+
+		if (!copy || !(cJSON_AddItemToArray(cached_events, copy))) {
+			cJSON_Delete(copy);
+			return -1;
+		}
+	}
+
+	bool trimmed = false;
+
+	for (int len = cJSON_GetArraySize(cached_events); len > CACHE_TIMELINE_MAX;
+		 len--) {
+		cJSON_DeleteItemFromArray(cached_events, 0);
+		trimmed = true;
+	}
+
+	const char *prev_batch = GETSTR(timeline, "prev_batch");
+
+	if (prev_batch &&
+		(trimmed || !cJSON_GetObjectItemCaseSensitive(cached, "prev_batch"))) {
+		return object_set(cached, "prev_batch", cJSON_CreateString(prev_batch));
+	}
+
+	return 0;
+}
+
+/* The summary only contains the keys that changed. */
+static int
+merge_summary(cJSON *cached_room, const cJSON *summary) {
+	cJSON *cached = cJSON_GetObjectItemCaseSensitive(cached_room, "summary");
+	cJSON *item = NULL;
+
+	cJSON_ArrayForEach(item, summary) {
+		if ((object_set(cached, item->string, cJSON_Duplicate(item, true))) ==
+			-1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static cJSON *
+joined_room_create(struct matrix_cache *cache, const char *id) {
+	cJSON *room = cJSON_CreateObject();
+	cJSON *state = NULL;
+
+	if (!room || !(state = cJSON_AddObjectToObject(room, "state")) ||
+		!(cJSON_AddArrayToObject(state, "events")) ||
+		!(cJSON_AddObjectToObject(room, "summary")) ||
+		!(cJSON_AddItemToObject(get_rooms(cache, kind_join), id, room))) {
+		cJSON_Delete(room);
+		return NULL;
+	}
+
+	if ((matrix_index_put(&cache->rooms, kind_join, room->string, room)) ==
+		-1) {
+		return NULL;
+	}
+
+	return room;
+}
+
+/* Remove the room from the given kinds of rooms. */
+static void
+forget_room(struct matrix_cache *cache, const char *id, bool join,
+			bool invite) {
+	cJSON *joined =
+		join ? matrix_index_remove(&cache->rooms, kind_join, id) : NULL;
+	cJSON *invited =
+		invite ? matrix_index_remove(&cache->rooms, kind_invite, id) : NULL;
+
+	if (joined) {
+		cJSON_Delete(
+			cJSON_DetachItemViaPointer(get_rooms(cache, kind_join), joined));
+	}
+
+	if (invited) {
+		cJSON_Delete(
+			cJSON_DetachItemViaPointer(get_rooms(cache, kind_invite), invited));
+	}
+}
+
+static int
+merge_joined(struct matrix_cache *cache, const cJSON *room) {
+	cJSON *cached = matrix_index_get(&cache->rooms, kind_join, room->string);
+
+	forget_room(cache, room->string, false, true);
+
+	if (!cached && !(cached = joined_room_create(cache, room->string))) {
+		return -1;
+	}
+
+	const cJSON *timeline = cJSON_GetObjectItemCaseSensitive(room, "timeline");
+
+	/* State events in the timeline happened after those in state. */
+	const cJSON *const state[] = {
+		cJSON_GetObjectItemCaseSensitive(
+			cJSON_GetObjectItemCaseSensitive(room, "state"), "events"),
+		cJSON_GetObjectItemCaseSensitive(timeline, "events"),
+	};
+
+	return (merge_state(cJSON_GetObjectItemCaseSensitive(
+							cJSON_GetObjectItemCaseSensitive(cached, "state"),
+							"events"),
+						state, sizeof(state) / sizeof(*state))) == 0 &&
+				   (merge_summary(cached, cJSON_GetObjectItemCaseSensitive(
+											  room, "summary"))) == 0 &&
+				   (merge_timeline(cached, timeline)) == 0
+			   ? 0
+			   : -1;
+}
+
+/* invite_state is always complete, so it replaces the cached room. */
+static int
+merge_invited(struct matrix_cache *cache, const cJSON *room) {
+	cJSON *invited = get_rooms(cache, kind_invite);
+	cJSON *cached = matrix_index_get(&cache->rooms, kind_invite, room->string);
+	cJSON *copy = cJSON_Duplicate(room, true);
+
+	if (!copy) {
+		return -1;
+	}
+
+	if (cached) {
+		cJSON_ReplaceItemViaPointer(invited, cached, copy);
+	} else if (!(cJSON_AddItemToObject(invited, room->string, copy))) {
+		cJSON_Delete(copy);
+		return -1;
+	}
+
+	return matrix_index_put(&cache->rooms, kind_invite, copy->string, copy);
+}
+
+void
+matrix_cache_room(struct matrix_cache *cache, enum matrix_room_type type,
+				  const cJSON *room) {
+	if (!cache->root || !room || !room->string) {
+		return;
+	}
+
+	int ret = 0;
+
+	fragments_invalidate(cache, room->string);
+
+	switch (type) {
+	case MATRIX_ROOM_LEAVE:
+		forget_room(cache, room->string, true, true);
+		break;
+	case MATRIX_ROOM_JOIN:
+		ret = merge_joined(cache, room);
+		break;
+	case MATRIX_ROOM_INVITE:
+		ret = merge_invited(cache, room);
+		break;
+	default:
+		assert(0);
+	}
+
+	if (ret == -1) {
+		cache_fail(cache);
+	} else {
+		cache->dirty = true;
+	}
+}
+
+void
+matrix_cache_stage(struct matrix_cache *cache, enum matrix_room_type type,
+				   const cJSON *room) {
+	if (!cache->root || !room || !room->string) {
+		return;
+	}
+
+	if (cache->staged_len == cache->staged_cap) {
+		size_t cap = cache->staged_cap ? cache->staged_cap * 2 : 16;
+		struct matrix_cache_staged *staged =
+			realloc(cache->staged, cap * sizeof(*staged));
+
+		if (!staged) {
+			cache_fail(cache);
+			return;
+		}
+
+		cache->staged = staged;
+		cache->staged_cap = cap;
+	}
+
+	cJSON *copy = cJSON_Duplicate(room, true);
+
+	if (!copy) {
+		cache_fail(cache);
+		return;
+	}
+
+	cache->staged[cache->staged_len++] = (struct matrix_cache_staged){
+		.room = copy,
+		.type = type,
+	};
+}
+
+void
+matrix_cache_discard(struct matrix_cache *cache) {
+	for (size_t i = 0; i < cache->staged_len; i++) {
+		cJSON_Delete(cache->staged[i].room);
+	}
+
+	cache->staged_len = 0;
+}
+
+void
+matrix_cache_set_batch(struct matrix_cache *cache, const char *next_batch) {
+	if (next_batch) {
+		for (size_t i = 0; i < cache->staged_len; i++) {
+			matrix_cache_room(cache, cache->staged[i].type,
+							  cache->staged[i].room);
+		}
+	}
+
+	matrix_cache_discard(cache);
+
+	if (!cache->root || !next_batch) {
+		return;
+	}
+
+	if ((object_set(cache->root, "next_batch",
+					cJSON_CreateString(next_batch))) == -1) {
+		cache_fail(cache);
+		return;
+	}
+
+	cache->dirty = true;
+
+	/* Persist the initial sync right away, it's the most expensive part. */
+	if (cache->last_write_ms == 0 ||
+		(now_ms() - cache->last_write_ms) >= CACHE_WRITE_INTERVAL_MS) {
+		cache_write(cache);
+	}
+}
+
+const char *
+matrix_cache_replay(struct matrix *matrix) {
+	struct matrix_cache *cache = &matrix->cache;
+	char *next_batch = GETSTR(cache->root, "next_batch");
+
+	if (!next_batch || cache->replayed ||
+		(!matrix->sync_cb && !matrix->thread)) {
+		return next_batch;
+	}
+
+	cache->replayed = true;
+
+	struct matrix_sync_response response = {
+		.next_batch = next_batch,
+	};
+
+	response.rooms[MATRIX_ROOM_JOIN] = get_rooms(cache, kind_join)->child;
+	response.rooms[MATRIX_ROOM_INVITE] = get_rooms(cache, kind_invite)->child;
+
+	for (int type = 0; type < MATRIX_ROOM_MAX; type++) {
+		for (const cJSON *room = response.rooms[type]; room;
+			 room = room->next) {
+			matrix_store_room(matrix, (enum matrix_room_type) type, room);
+		}
+	}
+
+	matrix_snapshot_publish(matrix);
+	matrix_deliver_sync(matrix, &response);
+
+	return next_batch;
+}
+
+const char *
+matrix_cache_filter_id(struct matrix_cache *cache, const char *definition) {
+	cJSON *filter = cJSON_GetObjectItemCaseSensitive(cache->root, "filter");
+	const char *cached = GETSTR(filter, "definition");
+
+	return (cached && (strcmp(cached, definition)) == 0)
+			   ? GETSTR(filter, "filter_id")
+			   : NULL;
+}
+
+void
+matrix_cache_set_filter(struct matrix_cache *cache, const char *definition,
+						const char *filter_id) {
+	if (!cache->root) {
+		return;
+	}
+
+	cJSON *filter = cJSON_CreateObject();
+
+	if (!filter ||
+		!(cJSON_AddStringToObject(filter, "definition", definition)) ||
+		!(cJSON_AddStringToObject(filter, "filter_id", filter_id))) {
+		cJSON_Delete(filter);
+		cache_fail(cache);
+		return;
+	}
+
+	if ((object_set(cache->root, "filter", filter)) == -1) {
+		cache_fail(cache);
+		return;
+	}
+
+	cache->dirty = true;
+}
@@ -0,0 +1,158 @@
+#include "matrix-priv.h"
+
+enum {
+	INDEX_INITIAL = 64,
+};
+
+/* FNV-1a over both strings. */
+static size_t
+hash_pair(const char *kind, const char *key) {
+	uint32_t hash = 2166136261U;
+
+	for (; *kind; kind++) {
+		hash = (hash ^ (unsigned char) *kind) * 16777619U;
+	}
+
+	hash *= 16777619U; /* Separate "ab" + "c" from "a" + "bc". */
+
+	for (; *key; key++) {
+		hash = (hash ^ (unsigned char) *key) * 16777619U;
+	}
+
+	return hash;
+}
+
+struct matrix_index_entry *
+matrix_index_find(const struct matrix_index *index, const char *kind,
+				  const char *key) {
+	assert(index->cap > 0);
+
+	for (size_t i = hash_pair(kind, key) & (index->cap - 1);;
+		 i = (i + 1) & (index->cap - 1)) {
+		struct matrix_index_entry *entry = &index->entries[i];
+
+		if (!entry->item || ((strcmp(entry->kind, kind)) == 0 &&
+							 (strcmp(entry->key, key)) == 0)) {
+			return entry;
+		}
+	}
+}
+
+void *
+matrix_index_get(const struct matrix_index *index, const char *kind,
+				 const char *key) {
+	return index->cap > 0 ? matrix_index_find(index, kind, key)->item : NULL;
+}
+
+int
+matrix_index_put(struct matrix_index *index, const char *kind, const char *key,
+				 void *item) {
+	assert(item);
+
+	/* Keep the load factor under 1/2. */
+	if (((index->len + 1) * 2) > index->cap) {
+		struct matrix_index grown = {
+			.cap = index->cap ? index->cap * 2 : INDEX_INITIAL,
+		};
+
+		if (!(grown.entries = calloc(grown.cap, sizeof(*grown.entries)))) {
+			return -1;
+		}
+
+		for (size_t i = 0; i < index->cap; i++) {
+			if (index->entries[i].item) {
+				*matrix_index_find(&grown, index->entries[i].kind,
+								   index->entries[i].key) = index->entries[i];
+			}
+		}
+
+		grown.len = index->len;
+
+		free(index->entries);
+		*index = grown;
+	}
+
+	struct matrix_index_entry *entry = matrix_index_find(index, kind, key);
+
+	if (!entry->item) {
+		index->len++;
+	}
+
+	*entry = (struct matrix_index_entry){
+		.kind = kind,
+		.key = key,
+		.item = item,
+	};
+
+	return 0;
+}
+
+void *
+matrix_index_remove(struct matrix_index *index, const char *kind,
+					const char *key) {
+	if (index->cap == 0) {
+		return NULL;
+	}
+
+	const size_t mask = index->cap - 1;
+	struct matrix_index_entry *entry = matrix_index_find(index, kind, key);
+	void *item = entry->item;
+
+	if (!item) {
+		return NULL;
+	}
+
+	index->len--;
+
+	/* Shift the following entries of the probe sequence back instead of
+	 * leaving a tombstone, so that lookups never get slower. */
+	size_t hole = (size_t) (entry - index->entries);
+
+	for (size_t i = (hole + 1) & mask; index->entries[i].item;
+		 i = (i + 1) & mask) {
+		size_t home =
+			hash_pair(index->entries[i].kind, index->entries[i].key) & mask;
+
+		/* The entry can only fill the hole if the hole lies cyclically between
+		 * its home slot and its current slot. */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			index->entries[hole] = index->entries[i];
+			hole = i;
+		}
+	}
+
+	index->entries[hole] = (struct matrix_index_entry){0};
+
+	return item;
+}
+
+int
+matrix_index_copy(struct matrix_index *dst, const struct matrix_index *src) {
+	*dst = (struct matrix_index){0};
+
+	if (src->cap == 0) {
+		return 0;
+	}
+
+	if (!(dst->entries = malloc(src->cap * sizeof(*dst->entries)))) {
+		return -1;
+	}
+
+	memcpy(dst->entries, src->entries, src->cap * sizeof(*dst->entries));
+	dst->cap = src->cap;
+	dst->len = src->len;
+
+	return 0;
+}
+
+size_t
+matrix_index_hash(const char *kind, const char *key) {
+	return hash_pair(kind, key);
+}
+
+void
+matrix_index_finish(struct matrix_index *index) {
+	free(index->entries);
+
+	*index = (struct matrix_index){0};
+}
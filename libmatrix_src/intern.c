@@ -0,0 +1,195 @@
+#include "matrix-priv.h"
+
+enum {
+	INTERN_BLOCK_SIZE = 64 * 1024,
+	INTERN_INITIAL = 256,
+};
+
+/* Strings are packed into blocks that are never moved or freed before the
+ * table itself, so their addresses are stable. */
+struct matrix_intern_block {
+	struct matrix_intern_block *next;
+	size_t len;
+	size_t cap;
+	char data[];
+};
+
+/* FNV-1a. */
+static uint32_t
+hash_string(const char *s, size_t *len) {
+	uint32_t hash = 2166136261U;
+	const char *start = s;
+
+	for (; *s; s++) {
+		hash = (hash ^ (unsigned char) *s) * 16777619U;
+	}
+
+	*len = (size_t) (s - start);
+
+	return hash;
+}
+
+/* Returns the slot of the string in the table, which is 0 if it's empty. */
+static uint32_t *
+find_slot(const struct matrix_intern *intern, const char *s, uint32_t hash) {
+	assert(intern->table_cap > 0);
+
+	for (size_t i = hash & (intern->table_cap - 1);;
+		 i = (i + 1) & (intern->table_cap - 1)) {
+		uint32_t handle = intern->table[i];
+
+		if (handle == 0 || (intern->hashes[handle] == hash &&
+							(strcmp(intern->strings[handle], s)) == 0)) {
+			return &intern->table[i];
+		}
+	}
+}
+
+static int
+grow(struct matrix_intern *intern) {
+	size_t cap = intern->strings_cap ? intern->strings_cap * 2 : INTERN_INITIAL;
+
+	if (cap > UINT32_MAX) {
+		return -1;
+	}
+
+	char **strings = realloc(intern->strings, cap * sizeof(*strings));
+
+	if (!strings) {
+		return -1;
+	}
+
+	intern->strings = strings;
+
+	uint32_t *hashes = realloc(intern->hashes, cap * sizeof(*hashes));
+
+	if (!hashes) {
+		return -1;
+	}
+
+	intern->hashes = hashes;
+
+	/* The table holds twice as many slots as strings to keep probes short. */
+	uint32_t *table = calloc(cap * 2, sizeof(*table));
+
+	if (!table) {
+		return -1;
+	}
+
+	free(intern->table);
+
+	intern->table = table;
+	intern->table_cap = cap * 2;
+	intern->strings_cap = cap;
+
+	for (uint32_t handle = 1; handle < intern->len; handle++) {
+		*find_slot(intern, intern->strings[handle], intern->hashes[handle]) =
+			handle;
+	}
+
+	return 0;
+}
+
+static char *
+copy_string(struct matrix_intern *intern, const char *s, size_t len) {
+	struct matrix_intern_block *block = intern->blocks;
+
+	if (!block || (block->cap - block->len) <= len) {
+		/* Oversized strings get a block of their own. */
+		size_t cap = len < INTERN_BLOCK_SIZE ? INTERN_BLOCK_SIZE : len + 1;
+
+		if (!(block = malloc(sizeof(*block) + cap))) {
+			return NULL;
+		}
+
+		*block = (struct matrix_intern_block){
+			.next = intern->blocks,
+			.cap = cap,
+		};
+
+		intern->blocks = block;
+	}
+
+	char *copy = &block->data[block->len];
+
+	memcpy(copy, s, len + 1);
+	block->len += len + 1;
+	intern->bytes += len + 1;
+
+	return copy;
+}
+
+uint32_t
+matrix_intern(struct matrix_intern *intern, const char *s) {
+	if (!s) {
+		return 0;
+	}
+
+	size_t len = 0;
+	uint32_t hash = hash_string(s, &len);
+
+	if (intern->table_cap > 0) {
+		uint32_t handle = *find_slot(intern, s, hash);
+
+		if (handle != 0) {
+			return handle;
+		}
+	}
+
+	/* Handle 0 is reserved for NULL, so it's allocated but never used. */
+	if (intern->len == 0) {
+		intern->len = 1;
+	}
+
+	if (intern->len >= intern->strings_cap && (grow(intern)) == -1) {
+		return 0;
+	}
+
+	char *copy = copy_string(intern, s, len);
+
+	if (!copy) {
+		return 0;
+	}
+
+	uint32_t handle = intern->len++;
+
+	intern->strings[handle] = copy;
+	intern->hashes[handle] = hash;
+	*find_slot(intern, s, hash) = handle;
+
+	return handle;
+}
+
+uint32_t
+matrix_intern_find(const struct matrix_intern *intern, const char *s) {
+	if (!s || intern->table_cap == 0) {
+		return 0;
+	}
+
+	size_t len = 0;
+
+	return *find_slot(intern, s, hash_string(s, &len));
+}
+
+char *
+matrix_intern_str(const struct matrix_intern *intern, uint32_t handle) {
+	assert(handle < intern->len || handle == 0);
+
+	return handle != 0 ? intern->strings[handle] : NULL;
+}
+
+void
+matrix_intern_finish(struct matrix_intern *intern) {
+	for (struct matrix_intern_block *block = intern->blocks; block;) {
+		struct matrix_intern_block *next = block->next;
+
+		free(block);
+		block = next;
+	}
+
+	free(intern->strings);
+	free(intern->hashes);
+	free(intern->table);
+
+	*intern = (struct matrix_intern){0};
+}
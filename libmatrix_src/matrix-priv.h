@@ -5,24 +5,648 @@
 #include <assert.h>
 #include <curl/curl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* Get the value of a key from an object. */
 #define GETSTR(obj, key) (cJSON_GetStringValue(cJSON_GetObjectItem(obj, key)))
 
+/* A byte buffer that grows geometrically and is reused between transfers so
+ * that steady-state requests don't allocate. data is always NUL-terminated once
+ * allocated. */
+struct matrix_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	size_t total;	 /* Bytes appended over the buffer's lifetime. */
+	size_t reallocs; /* Number of times data was (re)allocated. */
+};
+
+enum {
+	/* The depth of rooms.{join,leave,invite}, the rooms themselves are one
+	 * level deeper. */
+	MATRIX_SYNC_STREAM_TRACKED_DEPTH = 3,
+};
+
+/* State of the incremental /sync scanner in stream.c, which must survive
+ * across curl chunks. */
+struct matrix_sync_stream {
+	struct matrix_buf key;		  /* The last key at a tracked depth, raw. */
+	struct matrix_buf room;		  /* The room being received. */
+	struct matrix_buf next_batch; /* Raw, as tokens never contain escapes. */
+	unsigned depth;
+	unsigned char sections[MATRIX_SYNC_STREAM_TRACKED_DEPTH + 1];
+	bool objects[MATRIX_SYNC_STREAM_TRACKED_DEPTH + 1];
+	enum matrix_room_type room_type;
+	bool in_string;
+	bool escaped;
+	bool expect_key;
+	bool in_key;
+	bool in_next_batch;
+	bool capturing;
+	bool failed;
+};
+
+enum {
+	MATRIX_POOL_MAX = 8, /* Idle handles kept around for reuse. */
+};
+
+/* A reusable easy handle with its own receive and URL buffers. */
+struct matrix_handle {
+	CURL *easy;
+	struct matrix_buf buf;
+	struct matrix_buf url;
+};
+
+/* The headers sent with every request of a session, built once on login.
+ * Requests hold a reference so that the list can be replaced while they're in
+ * flight. refs is protected by struct matrix's session_mutex. */
+struct matrix_headers {
+	struct curl_slist *list;
+	unsigned refs;
+};
+
+struct matrix_pool {
+	pthread_mutex_t mutex; /* Protects everything but share. */
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	size_t nlocks;	/* share_locks that were initialized. */
+	bool has_mutex; /* Whether mutex was initialized. */
+	CURLSH *share;
+	struct matrix_handle *idle[MATRIX_POOL_MAX];
+	size_t nidle;
+	size_t hits;
+	size_t misses;
+	/* Buffer counters of handles that didn't fit in the pool. */
+	size_t retired_bytes;
+	size_t retired_reallocs;
+	size_t retired_peak;
+};
+
+struct matrix_index_entry {
+	const char *kind;
+	const char *key;
+	void *item; /* NULL if the entry is empty. */
+};
+
+/* Open addressing hash table from a pair of strings to an item, the strings
+ * must live as long as the item. */
+struct matrix_index {
+	struct matrix_index_entry *entries;
+	size_t cap; /* Power of 2. */
+	size_t len;
+};
+
+/* A serialized piece of the cache file, shared by every write that includes
+ * it. */
+struct matrix_cache_fragment {
+	_Atomic size_t refs;
+	size_t len;
+	char data[];
+};
+
+struct matrix_cache_part {
+	struct matrix_cache_fragment *fragment;
+	size_t offset; /* Skips the separator before the first room of an object. */
+};
+
+/* The file's contents, concatenated from the parts in order. */
+struct matrix_cache_write {
+	struct matrix_cache_part *parts;
+	size_t len;
+	size_t cap;
+};
+
+/* Writes the cache on a thread of its own, so that the sync never waits for
+ * the disk. Only the latest write that didn't start yet is kept. */
+struct matrix_cache_writer {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct matrix_cache_write *pending; /* nullable. */
+	char *path;
+	bool stop;
+};
+
+/* A room of a streamed response that isn't merged until next_batch arrives. */
+struct matrix_cache_staged {
+	cJSON *room;
+	enum matrix_room_type type;
+};
+
+/* The on-disk cache of next_batch and the accumulated state of every room. */
+struct matrix_cache {
+	char *path;	 /* nullable, NULL if caching is disabled. */
+	cJSON *root; /* nullable, NULL if disabled or after a failure. */
+	struct matrix_index rooms; /* Joined and invited rooms by ID. */
+	/* Fragments of the rooms that didn't change since they were serialized,
+	 * by kind and ID. The keys are those of the cached rooms, which is why
+	 * a room's fragments are dropped before the room changes. */
+	struct matrix_index fragments;
+	struct matrix_cache_writer *writer; /* nullable, started by a write. */
+	struct matrix_cache_staged *staged;
+	size_t staged_len;
+	size_t staged_cap;
+	long long last_write_ms; /* 0 if it wasn't written yet. */
+	bool dirty;
+	bool replayed;
+};
+
+struct matrix_arena_chunk;
+
+/* A bump allocator for parsing responses. The trees are freed all at once by
+ * resetting it instead of with cJSON_Delete(). */
+struct matrix_arena {
+	struct matrix_arena_chunk *chunks; /* Newest first. */
+	size_t used;					   /* Bytes used since the last reset. */
+	size_t capacity;				   /* Bytes held by the chunks. */
+	size_t next_cap; /* Size of the next chunk, from the last response. */
+	size_t peak;	 /* The most bytes used between two resets. */
+};
+
+struct matrix_intern_block;
+
+/* Identifiers (Room and user IDs, event types) are repeated in every event, so
+ * they're interned for the lifetime of the struct matrix. Handles compare equal
+ * if and only if the strings do and 0 stands for NULL. */
+struct matrix_intern {
+	struct matrix_intern_block *blocks; /* Newest first. */
+	char **strings;						/* By handle. */
+	uint32_t *hashes;					/* By handle. */
+	uint32_t *table; /* Open addressing over handles, 0 if empty. */
+	size_t table_cap; /* Power of 2. */
+	size_t strings_cap;
+	size_t bytes; /* Size of the interned strings. */
+	uint32_t len; /* Handles in use, including 0. */
+};
+
+/* A state event, without the members that are implied by its position. */
+struct matrix_store_state {
+	uint32_t type; /* 0 if the slot is empty. */
+	uint32_t state_key;
+	uint32_t sender;
+	int origin_server_ts;
+	char *event_id;
+	cJSON *content;
+};
+
+/* A timeline event, with its identifiers interned like those of state. */
+struct matrix_store_event {
+	uint32_t type;
+	uint32_t sender;
+	int origin_server_ts;
+	char *event_id;
+	/* nullable, paginating backwards from it returns the events before this
+	 * one. Set on the first event of every batch. */
+	char *token;
+	cJSON *content; /* Includes redacts for redactions. */
+	bool gap; /* Events may be missing between this one and the previous. */
+};
+
+/* The latest timeline events of a room in a ring buffer. */
+struct matrix_store_timeline {
+	struct matrix_store_event *events;
+	size_t cap;
+	size_t head; /* The oldest event. */
+	size_t len;
+	/* The next event follows a gap, from a limited batch that had nothing to
+	 * keep. */
+	bool gap;
+};
+
+/* The current state of a joined or invited room. */
+struct matrix_store_room {
+	uint32_t id;
+	enum matrix_room_type type;
+	/* Open addressing by type and state_key. */
+	struct matrix_store_state *state;
+	size_t state_cap; /* Power of 2. */
+	size_t state_len;
+	struct matrix_store_timeline timeline;
+};
+
+enum {
+	MATRIX_STORE_TIMELINE_DEFAULT = 32,
+};
+
+struct matrix_store {
+	struct matrix_index rooms; /* struct matrix_store_room by ID. */
+	/* The interned IDs of the rooms that were updated or removed since the
+	 * last snapshot, only kept while snapshots are enabled. */
+	struct matrix_index dirty;
+	unsigned timeline_max; /* Timeline events kept per room. */
+	bool enabled;
+	bool rebuild; /* The next snapshot must copy every room. */
+};
+
+enum {
+	MATRIX_CACHE_LINE = 64,
+};
+
+/* A bounded lock-free queue of rooms from a single producer to a single
+ * consumer. Each side only writes its own index, on a cache line of its own. */
+struct matrix_ring {
+	struct matrix_parsed_room **slots;
+	size_t cap; /* Power of 2. */
+	int fd;		/* eventfd, readable when the consumer may have to wake up. */
+	_Alignas(MATRIX_CACHE_LINE) _Atomic size_t tail; /* Producer. */
+	_Atomic size_t pushed;
+	_Atomic size_t dropped;
+	_Atomic size_t peak;
+	_Alignas(MATRIX_CACHE_LINE) _Atomic size_t head; /* Consumer. */
+};
+
+/* The state of matrix_sync_thread_start(), allocated with the alignment of the
+ * ring. */
+struct matrix_thread {
+	struct matrix_ring ring;
+	pthread_t thread;
+	char *next_batch; /* nullable. */
+	unsigned timeout;
+	int stop_fd; /* eventfd, stops the thread when written. */
+	enum matrix_code code; /* Set before done. */
+	_Atomic bool done;
+};
+
+/* A room of a response and its parsed copy. */
+struct matrix_parse_item {
+	const cJSON *room;
+	enum matrix_room_type type;
+	struct matrix_parsed_room *parsed; /* nullable, NULL if parsing failed. */
+};
+
+enum {
+	/* Responses with fewer rooms aren't worth waking up the workers for. */
+	MATRIX_WORKERS_BATCH_MIN = 16,
+};
+
+/* Threads that parse the rooms of a response along with the thread that posts
+ * them. Each thread claims the next unparsed room when it's done with the
+ * previous one, so a huge room only keeps one thread busy. */
+struct matrix_workers {
+	pthread_t *threads;
+	size_t len; /* Started threads, the posting thread is one more. */
+	pthread_mutex_t mutex;
+	pthread_cond_t posted;	 /* A batch was posted, or stop was set. */
+	pthread_cond_t finished; /* busy dropped to 0. */
+	struct matrix_parse_item *items; /* Of the current batch. */
+	size_t nitems;
+	_Atomic size_t next; /* The next item to claim. */
+	size_t busy;		 /* Threads that didn't finish the batch. */
+	unsigned long batch; /* Incremented for every batch. */
+	bool stop;
+	/* Which of mutex, posted and finished were initialized. */
+	bool has_mutex;
+	bool has_posted;
+	bool has_finished;
+	/* Reused for the items of every response. */
+	struct matrix_parse_item *scratch;
+	size_t scratch_cap;
+};
+
+/* A state event of a published room. The identifiers are resolved since
+ * readers can't look them up in the intern table while it grows, and the rest
+ * is shared with the store, which retires it instead of freeing it. */
+struct matrix_snapshot_state {
+	char *type;
+	char *state_key;
+	char *sender;
+	int origin_server_ts;
+	char *event_id;
+	cJSON *content;
+};
+
+/* Like struct matrix_snapshot_state, for timeline events. */
+struct matrix_snapshot_event {
+	char *type;
+	char *sender;
+	int origin_server_ts;
+	char *event_id;
+	char *token; /* nullable. */
+	cJSON *content;
+	bool gap;
+};
+
+/* An immutable version of a room, shared by every snapshot until the room
+ * changes. */
+struct matrix_snapshot_room {
+	struct matrix_index state; /* Into states by type and state_key. */
+	struct matrix_snapshot_state *states;
+	struct matrix_snapshot_event *timeline; /* Oldest first. */
+	size_t timeline_len;
+};
+
+enum {
+	MATRIX_SNAPSHOT_SHARDS = 256,
+};
+
+/* The rooms are split into shards by the hash of their ID, and a shard is
+ * shared by every snapshot until one of its rooms changes. A publish only
+ * copies the shards of the rooms that changed. */
+struct matrix_snapshot {
+	/* nullable, struct matrix_snapshot_room by ID. */
+	struct matrix_index *shards[MATRIX_SNAPSHOT_SHARDS];
+	size_t version;
+};
+
+enum matrix_retired_type {
+	MATRIX_RETIRED_STRING,
+	MATRIX_RETIRED_JSON,
+	MATRIX_RETIRED_ROOM,	 /* struct matrix_snapshot_room. */
+	MATRIX_RETIRED_SNAPSHOT, /* Without its shards. */
+	MATRIX_RETIRED_SHARD,	 /* A snapshot's index, without its rooms. */
+	MATRIX_RETIRED_INTERN,	 /* An allocated struct matrix_intern. */
+};
+
+struct matrix_retired_item {
+	void *ptr;
+	enum matrix_retired_type type;
+};
+
+/* Memory that was unlinked before the epoch was incremented past epoch, which
+ * readers that pinned a later epoch can't see. */
+struct matrix_retired {
+	struct matrix_retired *next; /* nullable, the next newer batch. */
+	unsigned long long epoch;
+	struct matrix_retired_item *items;
+	size_t len;
+	size_t cap;
+};
+
+/* A reader registered with matrix_reader_acquire(), on a cache line of its own
+ * since it's written on every pin. */
+struct matrix_reader {
+	/* The epoch that the snapshot was pinned in, 0 if none is. */
+	_Alignas(MATRIX_CACHE_LINE) _Atomic unsigned long long epoch;
+	_Atomic bool used;
+	struct matrix_snapshots *snapshots;
+};
+
+/* Epoch-based reclamation of snapshots, allocated with the alignment of the
+ * readers. The writer is whichever thread dispatches syncs. */
+struct matrix_snapshots {
+	struct matrix_reader readers[MATRIX_READERS_MAX];
+	_Alignas(MATRIX_CACHE_LINE) _Atomic(struct matrix_snapshot *) current;
+	_Atomic unsigned long long epoch; /* Starts at 1. */
+	/* Only used by the writer. */
+	struct matrix_retired pending; /* Retired since the last publish. */
+	struct matrix_retired *oldest; /* nullable. */
+	struct matrix_retired *newest; /* nullable. */
+};
+
+struct matrix_sync_transfer;
+
 struct matrix {
+	struct matrix_sync_stream stream;
+	struct matrix_sync_transfer *sync; /* nullable, set while syncing. */
+	struct matrix_page_transfer *pages; /* nullable, /messages in flight. */
+	CURLM *multi;
+	struct pollfd *fds; /* The sockets curl wants us to wait on. */
+	size_t nfds;
+	size_t fds_cap;
+	long deadline_ms; /* When curl's timer expires, -1 if it isn't set. */
+	struct matrix_pool pool;
+	struct matrix_buf sync_buf; /* Receives /sync responses. */
+	struct matrix_arena arena;	/* Parses /sync responses. */
+	struct matrix_cache cache;
+	struct matrix_store store;
+	struct matrix_intern intern;
+	struct matrix_thread *thread; /* nullable, set in threaded mode. */
+	struct matrix_workers *workers; /* nullable, parse rooms in parallel. */
+	struct matrix_snapshots *snapshots; /* nullable, set if enabled. */
+	pthread_mutex_t session_mutex; /* Protects headers and access_token. */
+	struct matrix_headers *headers; /* nullable, created on first use. */
 	char *access_token;
+	char *filter_id; /* nullable, added to every /sync. */
+	char *base_url; /* homeserver + the client API prefix. */
+	size_t base_url_len;
 	char *homeserver;
 	char *mxid;
 	void *userp;
 	matrix_sync_cb sync_cb;
+	bool streaming;
 };
 
+/* Add the names of the event types that the iterators understand. */
+int
+matrix_sync_add_types(cJSON *array, enum matrix_event_type type);
+/* Fill revent from an event that was already split up, if it's of a known type.
+ * content must outlive it. */
+int
+matrix_parse_state_content(struct matrix_state_base base, cJSON *content,
+						   struct matrix_state_event *revent);
+/* Fill revent with the event if it's a timeline event that the iterator would
+ * return, the event must outlive it. */
+int
+matrix_parse_timeline_event(cJSON *event, struct matrix_timeline_event *revent);
+/* Like matrix_parse_state_content(), for timeline events. */
+int
+matrix_parse_timeline_content(struct matrix_room_base base, cJSON *content,
+							  struct matrix_timeline_event *revent);
 int
 matrix_dispatch_sync(struct matrix *matrix, const cJSON *sync);
+/* Pass the response to sync_cb, or queue its rooms in threaded mode. */
+void
+matrix_deliver_sync(struct matrix *matrix,
+					struct matrix_sync_response *response);
+/* Parse a copy of the room, NULL on failure. */
+struct matrix_parsed_room *
+matrix_parsed_room_new(enum matrix_room_type type, const cJSON *room);
+/* Parse every room of the response and pass them to cb in order, which takes
+ * ownership. Failed rooms are passed as NULL. */
+void
+matrix_parse_sync(struct matrix *matrix,
+				  const struct matrix_sync_response *response,
+				  void (*cb)(struct matrix *, struct matrix_parsed_room *));
+int
+matrix_dispatch_sync_room(struct matrix *matrix, enum matrix_room_type type,
+						  cJSON *room, char *next_batch);
+/* Install the cJSON hooks that allocate from the arenas. */
+void
+matrix_arena_init(void);
+/* Allocate the cJSON items of the calling thread from the arena until
+ * matrix_arena_end(). Only parsing may happen in between, trees that are kept
+ * must be allocated outside. */
+void
+matrix_arena_begin(struct matrix_arena *arena);
+void
+matrix_arena_end(void);
+/* Free every tree parsed with the arena, sizing it for the next response. */
+void
+matrix_arena_reset(struct matrix_arena *arena);
+void
+matrix_arena_finish(struct matrix_arena *arena);
+/* Like matrix_sync_forever(), also returning MATRIX_SUCCESS once stop_fd
+ * becomes readable, unless it's -1. */
+enum matrix_code
+matrix_sync_run(struct matrix *matrix, const char *next_batch, unsigned timeout,
+				int stop_fd);
+/* Queue a room for the consumer of the sync thread, or drop it if it's NULL
+ * or the queue is full. */
+void
+matrix_thread_push(struct matrix *matrix, struct matrix_parsed_room *room);
+int
+matrix_workers_init(struct matrix_workers *workers, size_t threads);
+void
+matrix_workers_finish(struct matrix_workers *workers);
+/* Make room for len items in scratch. */
+int
+matrix_workers_reserve(struct matrix_workers *workers, size_t len);
+/* Parse the items on every thread, returns once all are parsed. */
+void
+matrix_workers_parse(struct matrix_workers *workers,
+					 struct matrix_parse_item *items, size_t len);
+int
+matrix_ring_init(struct matrix_ring *ring, size_t capacity);
+/* Frees the rooms that are still queued. */
+void
+matrix_ring_finish(struct matrix_ring *ring);
+/* Returns -1 and counts the room as dropped if the ring is full or the room is
+ * NULL, the caller keeps ownership of it then. */
+int
+matrix_ring_push(struct matrix_ring *ring, struct matrix_parsed_room *room);
+struct matrix_parsed_room *
+matrix_ring_pop(struct matrix_ring *ring);
+void
+matrix_headers_release(struct matrix *matrix,
+					   struct matrix_headers *headers);
+int
+matrix_pool_init(struct matrix_pool *pool);
+void
+matrix_pool_finish(struct matrix_pool *pool);
+struct matrix_handle *
+matrix_pool_acquire(struct matrix_pool *pool);
+void
+matrix_pool_release(struct matrix_pool *pool, struct matrix_handle *handle);
+void
+matrix_pool_stats(struct matrix_pool *pool,
+				  struct matrix_transfer_stats *stats);
+int
+matrix_multi_init(struct matrix *matrix);
+void
+matrix_multi_finish(struct matrix *matrix);
+enum matrix_code
+matrix_transfer_done(struct matrix *matrix, CURL *easy, CURLcode result);
+/* Abort every matrix_paginate() request without calling its callback. */
+void
+matrix_paginate_cancel(struct matrix *matrix);
+void
+matrix_sync_stream_reset(struct matrix_sync_stream *stream);
+void
+matrix_sync_stream_finish(struct matrix_sync_stream *stream);
+int
+matrix_sync_stream_feed(struct matrix *matrix, const char *data, size_t len);
+int
+matrix_cache_open(struct matrix_cache *cache, const char *path,
+				  const char *mxid);
+/* Waits until the last write is on disk. */
+void
+matrix_cache_finish(struct matrix_cache *cache);
+/* Start writing the cache in the background if it changed. */
+void
+matrix_cache_flush(struct matrix_cache *cache);
+void
+matrix_cache_room(struct matrix_cache *cache, enum matrix_room_type type,
+				  const cJSON *room);
+/* Like matrix_cache_room(), deferred until the next matrix_cache_set_batch()
+ * so that the rooms of a transfer that fails midway can be discarded. */
+void
+matrix_cache_stage(struct matrix_cache *cache, enum matrix_room_type type,
+				   const cJSON *room);
+void
+matrix_cache_discard(struct matrix_cache *cache);
+/* Merge the staged rooms and set next_batch. */
+void
+matrix_cache_set_batch(struct matrix_cache *cache, const char *next_batch);
+/* Pass the cached rooms to sync_cb the first time it's called, returns the
+ * cached next_batch. */
+const char *
+matrix_cache_replay(struct matrix *matrix);
+/* Returns the cached ID of the filter with the given definition, or NULL. */
+const char *
+matrix_cache_filter_id(struct matrix_cache *cache, const char *definition);
+void
+matrix_cache_set_filter(struct matrix_cache *cache, const char *definition,
+						const char *filter_id);
+void
+matrix_store_finish(struct matrix *matrix);
+/* Copy the room into a new version for a snapshot, NULL on failure. */
+struct matrix_snapshot_room *
+matrix_store_snapshot_room(struct matrix *matrix,
+						   const struct matrix_store_room *room);
+/* Free the memory once no reader can see it anymore, or right away if
+ * snapshots are disabled. */
+/* nullable: ptr */
+void
+matrix_retire(struct matrix *matrix, enum matrix_retired_type type, void *ptr);
+/* Publish the store if it changed since the last snapshot, and free what no
+ * reader can see anymore. */
+void
+matrix_snapshot_publish(struct matrix *matrix);
+/* nullable: room */
+void
+matrix_snapshot_room_free(struct matrix_snapshot_room *room);
+/* Free every snapshot and everything retired, no reader may be pinned. */
+void
+matrix_snapshots_finish(struct matrix *matrix);
+void
+matrix_store_room(struct matrix *matrix, enum matrix_room_type type,
+				  const cJSON *room);
+/* Returns the token to paginate backwards from the oldest retained event of
+ * the room, or NULL if there is none. */
+const char *
+matrix_store_timeline_token(struct matrix *matrix, const char *room_id);
+/* Whether the event is one of the retained timeline events of the room. */
+bool
+matrix_store_timeline_has(struct matrix *matrix, const char *room_id,
+						  const char *event_id);
+/* Returns the handle of the string, interning it if needed. 0 on failure. */
+uint32_t
+matrix_intern(struct matrix_intern *intern, const char *s);
+/* Returns the handle of the string, or 0 if it wasn't interned. */
+uint32_t
+matrix_intern_find(const struct matrix_intern *intern, const char *s);
+/* The string must not be modified, it's only non-const so that it fits the
+ * event structs. */
+char *
+matrix_intern_str(const struct matrix_intern *intern, uint32_t handle);
+void
+matrix_intern_finish(struct matrix_intern *intern);
+/* Returns the entry for the pair, which is empty (item == NULL) if it isn't in
+ * the index. The index must not be empty. */
+struct matrix_index_entry *
+matrix_index_find(const struct matrix_index *index, const char *kind,
+				  const char *key);
+/* Returns the item for the pair, or NULL if it isn't in the index. */
+void *
+matrix_index_get(const struct matrix_index *index, const char *kind,
+				 const char *key);
+/* Add or replace the item for the pair. */
+int
+matrix_index_put(struct matrix_index *index, const char *kind, const char *key,
+				 void *item);
+/* Returns the removed item, or NULL if the pair isn't in the index. */
+void *
+matrix_index_remove(struct matrix_index *index, const char *kind,
+					const char *key);
+/* dst shares the items and strings of src. */
+int
+matrix_index_copy(struct matrix_index *dst, const struct matrix_index *src);
+/* The 32 bit hash that places the pair, its low bits pick the slot. */
+size_t
+matrix_index_hash(const char *kind, const char *key);
+void
+matrix_index_finish(struct matrix_index *index);
 int
 matrix_double_to_int(double x);
 char *
 matrix_strdup(const char *s);
+int
+matrix_buf_reserve(struct matrix_buf *buf, size_t size);
+int
+matrix_buf_append(struct matrix_buf *buf, const void *data, size_t len);
+void
+matrix_buf_finish(struct matrix_buf *buf);
 #endif /* !MATRIX_PRIV_H */
@@ -2,6 +2,8 @@
 
 int
 matrix_global_init(void) {
+	matrix_arena_init();
+
 	return (curl_global_init(CURL_GLOBAL_DEFAULT)) == CURLE_OK ? 0 : -1;
 }
 
@@ -23,9 +25,23 @@ matrix_alloc(matrix_sync_cb sync_cb, const char *mxid, const char *homeserver,
 		*matrix = (struct matrix){.homeserver = strdup(homeserver),
 								  .mxid = strdup(mxid),
 								  .userp = userp,
-								  .sync_cb = sync_cb};
+								  .sync_cb = sync_cb,
+								  .store.timeline_max =
+									  MATRIX_STORE_TIMELINE_DEFAULT};
+
+		int base_url_len = -1;
+
+		if (matrix->homeserver && matrix->mxid &&
+			(base_url_len = asprintf(&matrix->base_url, "%s%s", homeserver,
+									 "/_matrix/client/r0")) == -1) {
+			matrix->base_url = NULL; /* Undefined on failure. */
+		}
 
-		if (matrix->homeserver && matrix->mxid) {
+		if (base_url_len != -1 &&
+			(matrix->base_url_len = (size_t) base_url_len) &&
+			(pthread_mutex_init(&matrix->session_mutex, NULL)) == 0 &&
+			(matrix_pool_init(&matrix->pool)) == 0 &&
+			(matrix_multi_init(matrix)) == 0) {
 			return matrix;
 		}
 	}
@@ -40,12 +56,118 @@ matrix_destroy(struct matrix *matrix) {
 		return;
 	}
 
+	matrix_sync_thread_stop(matrix);
+	matrix_set_parse_workers(matrix, 0);
+	matrix_sync_stop(matrix);
+	matrix_paginate_cancel(matrix);
+	matrix_multi_finish(matrix);
+	matrix_pool_finish(&matrix->pool);
+	matrix_sync_stream_finish(&matrix->stream);
+	matrix_buf_finish(&matrix->sync_buf);
+	matrix_arena_finish(&matrix->arena);
+	matrix_cache_finish(&matrix->cache);
+	matrix_store_finish(matrix);
+	matrix_snapshots_finish(matrix);
+	matrix_intern_finish(&matrix->intern);
+	matrix_headers_release(matrix, matrix->headers);
+	pthread_mutex_destroy(&matrix->session_mutex);
 	free(matrix->access_token);
+	free(matrix->filter_id);
+	free(matrix->base_url);
 	free(matrix->homeserver);
 	free(matrix->mxid);
 	free(matrix);
 }
 
+void
+matrix_set_sync_streaming(struct matrix *matrix, bool streaming) {
+	matrix->streaming = streaming;
+}
+
+int
+matrix_set_cache(struct matrix *matrix, const char *path) {
+	return matrix_cache_open(&matrix->cache, path, matrix->mxid);
+}
+
+void
+matrix_set_store(struct matrix *matrix, bool enabled) {
+	if (!enabled) {
+		matrix_store_finish(matrix);
+
+		/* Snapshots point to the interned strings, they're kept if they can't
+		 * be retired. */
+		struct matrix_intern *intern = NULL;
+
+		if (!matrix->snapshots) {
+			matrix_intern_finish(&matrix->intern);
+		} else if ((intern = malloc(sizeof(*intern)))) {
+			*intern = matrix->intern;
+			matrix->intern = (struct matrix_intern){0};
+			matrix_retire(matrix, MATRIX_RETIRED_INTERN, intern);
+		}
+
+		matrix_snapshot_publish(matrix);
+	}
+
+	matrix->store.enabled = enabled;
+}
+
+void
+matrix_set_store_timeline(struct matrix *matrix, unsigned events_per_room) {
+	matrix->store.timeline_max = events_per_room;
+}
+
+int
+matrix_set_parse_workers(struct matrix *matrix, unsigned workers) {
+	if (matrix->workers) {
+		matrix_workers_finish(matrix->workers);
+		free(matrix->workers);
+		matrix->workers = NULL;
+	}
+
+	if (workers <= 1) {
+		return 0;
+	}
+
+	/* The thread that posts the rooms is one of the workers. */
+	if (!(matrix->workers = malloc(sizeof(*matrix->workers))) ||
+		(matrix_workers_init(matrix->workers, workers - 1)) == -1) {
+		matrix_set_parse_workers(matrix, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+matrix_get_transfer_stats(struct matrix *matrix,
+						  struct matrix_transfer_stats *stats) {
+	const struct matrix_buf *bufs[] = {
+		&matrix->sync_buf,
+		&matrix->stream.key,
+		&matrix->stream.room,
+		&matrix->stream.next_batch,
+	};
+
+	*stats = (struct matrix_transfer_stats){
+		/* The stream buffers only hold copies of bytes counted here. */
+		.bytes_received = matrix->sync_buf.total,
+	};
+
+	for (size_t i = 0; i < (sizeof(bufs) / sizeof(*bufs)); i++) {
+		stats->reallocs += bufs[i]->reallocs;
+
+		if (bufs[i]->cap > stats->peak_capacity) {
+			stats->peak_capacity = bufs[i]->cap;
+		}
+	}
+
+	stats->parse_peak = matrix->arena.peak;
+	stats->parse_capacity = matrix->arena.capacity;
+
+	matrix_pool_stats(&matrix->pool, stats);
+}
+
 void
 matrix_global_cleanup(void) {
 	curl_global_cleanup();
@@ -1,11 +1,17 @@
 #ifndef MATRIX_MATRIX_H
 #define MATRIX_MATRIX_H
+#include <poll.h>
 #include <stdbool.h>
+#include <stddef.h>
 /* Must allocate enum + 1. */
 enum matrix_limits {
 	MATRIX_MXID_MAX = 255,
 };
 
+enum {
+	MATRIX_READERS_MAX = 16, /* Threads that can read snapshots at once. */
+};
+
 enum matrix_code {
 	MATRIX_SUCCESS = 0,
 	MATRIX_NOMEM,
@@ -16,6 +22,8 @@ enum matrix_code {
 };
 
 struct matrix;
+struct matrix_reader;
+struct matrix_snapshot;
 
 typedef struct cJSON matrix_json_t;
 
@@ -175,7 +183,8 @@ struct matrix_room {
 };
 
 struct matrix_sync_response {
-	char *next_batch;
+	char *next_batch; /* nullable in streaming mode if the server sends it
+						 after the rooms. */
 	matrix_json_t *rooms[MATRIX_ROOM_MAX];
 	/* struct matrix_account_data_events account_data; */
 };
@@ -227,6 +236,29 @@ struct matrix_ephemeral_event {
 	};
 };
 
+/* Counters for the buffers that receive response bodies and for the pool of
+ * connection handles. */
+struct matrix_transfer_stats {
+	size_t bytes_received;
+	size_t reallocs;
+	size_t peak_capacity;
+	size_t handle_hits;	  /* Requests that reused a pooled handle. */
+	size_t handle_misses; /* Requests that had to create a new handle. */
+	size_t parse_peak;	  /* The most memory used to parse one response. */
+	size_t parse_capacity; /* The memory currently kept for parsing. */
+};
+
+/* A filter for /sync responses, presence and account data are always
+ * excluded. */
+struct matrix_sync_filter {
+	unsigned timeline_limit; /* Events per room, 0 for the server's default. */
+	bool lazy_load_members;	 /* Only send the members that sent events. */
+	/* Only send the event types that the iterators parse (And state events in
+	 * the timeline). Timeline events of other types are then no longer passed
+	 * as attachments. */
+	bool known_types_only;
+};
+
 typedef void (*matrix_sync_cb)(struct matrix *, struct matrix_sync_response *);
 
 /* Functions returning int (Except enums) return -1 on failure and 0 on success.
@@ -234,7 +266,8 @@ typedef void (*matrix_sync_cb)(struct matrix *, struct matrix_sync_response *);
 
 /* ALLOC/DESTROY */
 
-/* Must be the first function called only a single time. */
+/* Must be the first function called only a single time. Installs allocation
+ * hooks with cJSON_InitHooks(), which must not be replaced afterwards. */
 int
 matrix_global_init(void);
 struct matrix *
@@ -242,10 +275,20 @@ matrix_alloc(matrix_sync_cb sync_cb, const char *mxid, const char *homeserver,
 			 void *userp);
 void
 matrix_destroy(struct matrix *matrix);
+/* Returns the userp passed to matrix_alloc(). */
+void *
+matrix_userdata(struct matrix *matrix);
 /* Must be the last function called only a single time. */
 void
 matrix_global_cleanup(void);
 
+/* STATS */
+
+/* A steady-state sync loop shouldn't increase reallocs or peak_capacity. */
+void
+matrix_get_transfer_stats(struct matrix *matrix,
+						  struct matrix_transfer_stats *stats);
+
 /* SYNC */
 
 enum matrix_code
@@ -255,6 +298,33 @@ enum matrix_code
 matrix_login(struct matrix *matrix, const char *password,
 			 const char *device_id);
 
+/* In streaming mode, the /sync body is parsed as it arrives and sync_cb is
+ * called once per room as soon as that room has been received, rather than once
+ * per response. This lowers peak memory usage and the time until the first room
+ * is available on large syncs. Disabled by default. */
+void
+matrix_set_sync_streaming(struct matrix *matrix, bool streaming);
+
+/* Keep next_batch and the accumulated state of every room in the file at path,
+ * which is replaced atomically. If the file exists, the first
+ * matrix_sync_start() without a next_batch passes the cached rooms to sync_cb
+ * before returning and resumes from the cached next_batch. Rooms that are
+ * replayed only hold their latest timeline events, marked as limited. Must be
+ * called after matrix_alloc() and before syncing, a NULL path disables the
+ * cache. */
+/* nullable: path */
+int
+matrix_set_cache(struct matrix *matrix, const char *path);
+
+/* Upload the filter, or reuse its ID from the cache if an identical filter
+ * was uploaded before, and send it with every following /sync. A NULL filter
+ * stops sending it. Call it after logging in and before syncing, the cache is
+ * only consulted if it was set before. */
+/* nullable: filter */
+enum matrix_code
+matrix_set_sync_filter(struct matrix *matrix,
+					   const struct matrix_sync_filter *filter);
+
 /* timeout specifies the maximum time in milliseconds that the server will wait
  * for events to be received. The recommended minimum is 1000 == 1 second to
  * avoid burning CPU cycles. */
@@ -263,6 +333,34 @@ enum matrix_code
 matrix_sync_forever(struct matrix *matrix, const char *next_batch,
 					unsigned timeout);
 
+/* NON-BLOCKING SYNC */
+
+/* Start syncing in the background, with the same arguments as
+ * matrix_sync_forever(). The sync is driven by polling the descriptors from
+ * matrix_get_pollfds() for at most matrix_get_timeout() milliseconds and
+ * passing them to matrix_perform_step(), which calls sync_cb for every
+ * response. sync_cb must not call matrix_perform_step() or matrix_sync_stop().
+ * Starting a sync stops the previous one. */
+/* nullable: next_batch */
+enum matrix_code
+matrix_sync_start(struct matrix *matrix, const char *next_batch,
+				  unsigned timeout);
+void
+matrix_sync_stop(struct matrix *matrix);
+/* Copies up to max descriptors to fds and returns the total number of
+ * descriptors, which may be larger than max. */
+size_t
+matrix_get_pollfds(struct matrix *matrix, struct pollfd *fds, size_t max);
+/* Returns the timeout in milliseconds for poll(), -1 if there's none. */
+int
+matrix_get_timeout(struct matrix *matrix);
+/* fds are the descriptors from matrix_get_pollfds() with revents filled in by
+ * poll(). Must also be called when the timeout expires. The sync is stopped if
+ * anything other than MATRIX_SUCCESS is returned. */
+enum matrix_code
+matrix_perform_step(struct matrix *matrix, const struct pollfd *fds,
+					size_t nfds);
+
 /* These functions fill in the passed struct with the corresponding JSON item's
  * representation at the current index. */
 int
@@ -287,6 +385,187 @@ matrix_sync_ephemeral_next(struct matrix_room *room,
 			 : matrix_sync_timeline_next, struct matrix_ephemeral_event *      \
 			 : matrix_sync_ephemeral_next)(response_or_room, result)
 
+/* THREADED SYNC */
+
+/* A room with its events parsed into arrays that own their storage along with
+ * the room, so that it can be handed to another thread. room.events can still
+ * be iterated with matrix_sync_next(). */
+struct matrix_parsed_room {
+	struct matrix_room room;
+	struct matrix_state_event *state;
+	struct matrix_timeline_event *timeline;
+	struct matrix_ephemeral_event *ephemeral;
+	size_t state_len;
+	size_t timeline_len;
+	size_t ephemeral_len;
+	matrix_json_t *json; /* Holds the strings of everything above. */
+};
+
+struct matrix_queue_stats {
+	size_t depth; /* Rooms waiting to be popped. */
+	size_t peak_depth;
+	size_t capacity;
+	size_t pushed;
+	size_t dropped; /* Rooms that arrived while the queue was full. */
+};
+
+/* Run matrix_sync_forever() on a thread of its own, which parses every room of
+ * every response (And of the cache's replay) into a struct matrix_parsed_room
+ * and queues it instead of calling sync_cb. The queue holds capacity rooms,
+ * rounded up to a power of 2, and rooms that arrive while it's full are
+ * dropped and counted. They still reach the cache and the store. Until
+ * matrix_sync_thread_stop(), the thread owns the struct matrix and only the
+ * functions below may be called, all from the same thread. Snapshots of the
+ * store can be read from any thread meanwhile. */
+/* nullable: next_batch */
+enum matrix_code
+matrix_sync_thread_start(struct matrix *matrix, const char *next_batch,
+						 unsigned timeout, size_t capacity);
+/* Stop the thread if it's still running and wait for it, freeing the rooms
+ * that weren't popped. Returns the code that the sync stopped with, which is
+ * MATRIX_SUCCESS if this call stopped it. */
+enum matrix_code
+matrix_sync_thread_stop(struct matrix *matrix);
+/* Returns false once the thread stopped by itself, rooms that are still
+ * queued can be popped afterwards. */
+bool
+matrix_sync_thread_running(struct matrix *matrix);
+/* Returns a descriptor to poll for reading, alongside others, or -1 if no
+ * thread was started. It becomes readable when rooms are queued after
+ * matrix_queue_pop() returned NULL and when the thread stops by itself. */
+int
+matrix_queue_get_fd(struct matrix *matrix);
+/* Returns the oldest queued room, or NULL if the queue is empty. Pop until it
+ * returns NULL before waiting on the descriptor again. */
+struct matrix_parsed_room *
+matrix_queue_pop(struct matrix *matrix);
+void
+matrix_get_queue_stats(struct matrix *matrix, struct matrix_queue_stats *stats);
+/* nullable: room */
+void
+matrix_parsed_room_free(struct matrix_parsed_room *room);
+/* Parse the rooms of a response on this many threads in threaded mode,
+ * counting the sync thread, so that large initial syncs (And the cache's
+ * replay) scale with the number of cores. Rooms are still queued in the order
+ * of the response. Small responses, and every room in streaming mode, are
+ * parsed on the sync thread alone. 0 and 1 disable it, which is the default.
+ * Must not be called while a sync thread runs. */
+int
+matrix_set_parse_workers(struct matrix *matrix, unsigned workers);
+
+/* STORE */
+
+/* Keep the current state of every joined and invited room in memory, updated
+ * from each sync (And the cache's replay) before sync_cb is called. Lookups are
+ * hash table lookups that don't allocate, so they're cheap enough to do for
+ * every event. The store is emptied if memory runs out, and when it's disabled.
+ * Disabled by default. */
+void
+matrix_set_store(struct matrix *matrix, bool enabled);
+
+/* Fill event with the current state event of the given type and state_key.
+ * Pointers in event are valid until the next sync is dispatched, so it must
+ * be called from sync_cb or between calls to matrix_perform_step(). Returns -1
+ * if the event isn't known or its type can't be parsed. */
+int
+matrix_store_get_state(struct matrix *matrix, const char *room_id,
+					   const char *type, const char *state_key,
+					   struct matrix_state_event *event);
+/* Returns the display name of the member under the same conditions as
+ * matrix_store_get_state(), or NULL if they don't have one. */
+const char *
+matrix_store_get_displayname(struct matrix *matrix, const char *room_id,
+							 const char *mxid);
+
+/* Keep up to this many of the latest timeline events of every joined room,
+ * evicting the oldest ones, so that memory stays bounded however long the
+ * client runs. Rooms are resized as they receive events. 0 keeps none, the
+ * default is 32. */
+void
+matrix_set_store_timeline(struct matrix *matrix, unsigned events_per_room);
+/* Returns the number of timeline events kept for the room. */
+size_t
+matrix_store_timeline_len(struct matrix *matrix, const char *room_id);
+/* Fill event with the timeline event at index, 0 being the oldest, under the
+ * same conditions as matrix_store_get_state(). If a limited sync left a gap
+ * before the event, gap is set to the token to pass to matrix_paginate() to
+ * fill it. For the oldest event it's set to the token that continues before
+ * it if there's one. It's set to NULL otherwise. */
+/* nullable: gap */
+int
+matrix_store_timeline_get(struct matrix *matrix, const char *room_id,
+						  size_t index, struct matrix_timeline_event *event,
+						  const char **gap);
+
+/* Publish an immutable snapshot of the store after the store is updated from
+ * each sync (And the cache's replay), in streaming mode once the response is
+ * complete, so that other threads can read a consistent version of it while
+ * the next one is received. Only the rooms that changed are copied, the events
+ * are shared. Readers never block the sync and the sync never waits for
+ * readers, memory is freed once no pinned snapshot can see it. Must not be
+ * called while a sync thread runs or a reader is acquired. */
+int
+matrix_set_store_snapshots(struct matrix *matrix, bool enabled);
+/* Every thread that reads snapshots needs a reader of its own. Returns NULL if
+ * snapshots are disabled or MATRIX_READERS_MAX readers are acquired. May be
+ * called from any thread. */
+struct matrix_reader *
+matrix_reader_acquire(struct matrix *matrix);
+/* Unpins the snapshot. */
+/* nullable: reader */
+void
+matrix_reader_release(struct matrix_reader *reader);
+/* Returns the latest snapshot, which stays valid along with every pointer
+ * read from it until matrix_snapshot_unpin(). Pinning again unpins the
+ * previous one. Never blocks. */
+const struct matrix_snapshot *
+matrix_snapshot_pin(struct matrix_reader *reader);
+void
+matrix_snapshot_unpin(struct matrix_reader *reader);
+/* Incremented for every published snapshot. */
+size_t
+matrix_snapshot_version(const struct matrix_snapshot *snapshot);
+/* Like the matrix_store_*() functions, with pointers that are valid while the
+ * snapshot is pinned. */
+int
+matrix_snapshot_get_state(const struct matrix_snapshot *snapshot,
+						  const char *room_id, const char *type,
+						  const char *state_key,
+						  struct matrix_state_event *event);
+const char *
+matrix_snapshot_get_displayname(const struct matrix_snapshot *snapshot,
+								const char *room_id, const char *mxid);
+size_t
+matrix_snapshot_timeline_len(const struct matrix_snapshot *snapshot,
+							 const char *room_id);
+/* nullable: gap */
+int
+matrix_snapshot_timeline_get(const struct matrix_snapshot *snapshot,
+							 const char *room_id, size_t index,
+							 struct matrix_timeline_event *event,
+							 const char **gap);
+
+/* room->events[MATRIX_EVENT_TIMELINE] holds the events before the token,
+ * newest first, without those that the store already has.
+ * room->events[MATRIX_EVENT_STATE] holds the state needed to display them and
+ * room->timeline.prev_batch continues from the oldest one, it's NULL once the
+ * start of the room is reached. room is only valid during the call, and NULL if
+ * the request failed. */
+/* nullable: room */
+typedef void (*matrix_paginate_cb)(struct matrix *matrix,
+								   struct matrix_room *room, void *userp);
+
+/* Fetch up to limit timeline events before from, which is either the token of
+ * a gap or a previous prev_batch. The request runs alongside the sync and
+ * paginate_cb is called from matrix_perform_step() once it completes, with the
+ * same restrictions as sync_cb. A NULL from continues from the oldest event
+ * kept by the store. The events aren't added to the store. May be called from
+ * sync_cb, but not in threaded mode. */
+/* nullable: from */
+enum matrix_code
+matrix_paginate(struct matrix *matrix, const char *room_id, const char *from,
+				unsigned limit, matrix_paginate_cb paginate_cb, void *userp);
+
 /* API */
 
 #endif /* !MATRIX_MATRIX_H */
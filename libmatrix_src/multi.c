@@ -0,0 +1,189 @@
+#include "matrix-priv.h"
+#include <limits.h>
+#include <time.h>
+
+/* Glue between curl's multi socket interface and the caller's event loop. curl
+ * tells us which sockets it wants to wait on and for how long, and we hand
+ * those out as pollfds so they can be polled alongside other descriptors. */
+
+static long
+now_ms(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	const long ms_per_sec = 1000;
+	const long ns_per_ms = 1000000;
+
+	return (ts.tv_sec * ms_per_sec) + (ts.tv_nsec / ns_per_ms);
+}
+
+static int
+socket_cb(CURL *easy, curl_socket_t fd, int what, void *userp,
+		  void *socketp) {
+	(void) easy;
+	(void) socketp;
+
+	struct matrix *matrix = userp;
+
+	size_t index = 0;
+
+	while (index < matrix->nfds && matrix->fds[index].fd != fd) {
+		index++;
+	}
+
+	if (what == CURL_POLL_REMOVE) {
+		if (index < matrix->nfds) {
+			/* Order doesn't matter, fill the hole with the last fd. */
+			matrix->fds[index] = matrix->fds[--matrix->nfds];
+		}
+
+		return 0;
+	}
+
+	if (index == matrix->nfds) {
+		if (matrix->nfds == matrix->fds_cap) {
+			size_t new_cap = matrix->fds_cap ? matrix->fds_cap * 2 : 4;
+			struct pollfd *tmp =
+				realloc(matrix->fds, new_cap * sizeof(*matrix->fds));
+
+			if (!tmp) {
+				return -1;
+			}
+
+			matrix->fds = tmp;
+			matrix->fds_cap = new_cap;
+		}
+
+		matrix->nfds++;
+	}
+
+	matrix->fds[index] = (struct pollfd){
+		.fd = fd,
+		.events = (short) (((what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+								? POLLIN
+								: 0) |
+						   ((what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+								? POLLOUT
+								: 0)),
+	};
+
+	return 0;
+}
+
+static int
+timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+	(void) multi;
+
+	struct matrix *matrix = userp;
+
+	matrix->deadline_ms = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+
+	return 0;
+}
+
+int
+matrix_multi_init(struct matrix *matrix) {
+	matrix->deadline_ms = -1;
+
+	if ((matrix->multi = curl_multi_init()) &&
+		(curl_multi_setopt(matrix->multi, CURLMOPT_SOCKETFUNCTION,
+						   socket_cb)) == CURLM_OK &&
+		(curl_multi_setopt(matrix->multi, CURLMOPT_SOCKETDATA, matrix)) ==
+			CURLM_OK &&
+		(curl_multi_setopt(matrix->multi, CURLMOPT_TIMERFUNCTION, timer_cb)) ==
+			CURLM_OK &&
+		(curl_multi_setopt(matrix->multi, CURLMOPT_TIMERDATA, matrix)) ==
+			CURLM_OK &&
+		(curl_multi_setopt(matrix->multi, CURLMOPT_PIPELINING,
+						   CURLPIPE_MULTIPLEX)) == CURLM_OK) {
+		return 0;
+	}
+
+	return -1;
+}
+
+void
+matrix_multi_finish(struct matrix *matrix) {
+	curl_multi_cleanup(matrix->multi);
+	free(matrix->fds);
+
+	matrix->multi = NULL;
+	matrix->fds = NULL;
+	matrix->nfds = matrix->fds_cap = 0;
+}
+
+size_t
+matrix_get_pollfds(struct matrix *matrix, struct pollfd *fds, size_t max) {
+	for (size_t i = 0; i < matrix->nfds && i < max; i++) {
+		fds[i] = matrix->fds[i];
+		fds[i].revents = 0;
+	}
+
+	return matrix->nfds;
+}
+
+int
+matrix_get_timeout(struct matrix *matrix) {
+	if (matrix->deadline_ms < 0) {
+		return -1;
+	}
+
+	long remaining = matrix->deadline_ms - now_ms();
+
+	if (remaining <= 0) {
+		return 0;
+	}
+
+	return remaining > INT_MAX ? INT_MAX : (int) remaining;
+}
+
+enum matrix_code
+matrix_perform_step(struct matrix *matrix, const struct pollfd *fds,
+					size_t nfds) {
+	int running = 0;
+
+	for (size_t i = 0; i < nfds; i++) {
+		if (!fds[i].revents) {
+			continue;
+		}
+
+		int action = ((fds[i].revents & (POLLIN | POLLHUP)) ? CURL_CSELECT_IN
+															: 0) |
+					 ((fds[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0) |
+					 ((fds[i].revents & (POLLERR | POLLNVAL)) ? CURL_CSELECT_ERR
+															  : 0);
+
+		if ((curl_multi_socket_action(matrix->multi, fds[i].fd, action,
+									  &running)) != CURLM_OK) {
+			return MATRIX_CURL_FAILURE;
+		}
+	}
+
+	if (matrix->deadline_ms >= 0 && (matrix_get_timeout(matrix)) == 0) {
+		matrix->deadline_ms = -1;
+
+		if ((curl_multi_socket_action(matrix->multi, CURL_SOCKET_TIMEOUT, 0,
+									  &running)) != CURLM_OK) {
+			return MATRIX_CURL_FAILURE;
+		}
+	}
+
+	enum matrix_code code = MATRIX_SUCCESS;
+
+	CURLMsg *msg = NULL;
+	int msgs_left = 0;
+
+	while ((msg = curl_multi_info_read(matrix->multi, &msgs_left))) {
+		if (msg->msg == CURLMSG_DONE) {
+			enum matrix_code tmp = matrix_transfer_done(
+				matrix, msg->easy_handle, msg->data.result);
+
+			if (code == MATRIX_SUCCESS) {
+				code = tmp;
+			}
+		}
+	}
+
+	return code;
+}
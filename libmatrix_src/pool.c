@@ -0,0 +1,202 @@
+#include "matrix-priv.h"
+
+/* A pool of easy handles that is shared by all requests of a struct matrix.
+ * An easy handle keeps its connection open after a transfer, so reusing handles
+ * means that requests to the homeserver skip the TCP and TLS handshakes. DNS
+ * results and TLS sessions are additionally shared between all handles, which
+ * also makes new handles cheap to connect. The connection cache itself isn't
+ * shared since curl doesn't support that between concurrent threads, so the
+ * blocking requests never use the connection of /sync. The pool can be used
+ * from multiple threads. */
+
+static void
+lock_cb(CURL *easy, curl_lock_data data, curl_lock_access access,
+		void *userp) {
+	(void) easy;
+	(void) access;
+
+	struct matrix_pool *pool = userp;
+
+	pthread_mutex_lock(&pool->share_locks[data]);
+}
+
+static void
+unlock_cb(CURL *easy, curl_lock_data data, void *userp) {
+	(void) easy;
+
+	struct matrix_pool *pool = userp;
+
+	pthread_mutex_unlock(&pool->share_locks[data]);
+}
+
+/* Options that every request wants, re-applied after curl_easy_reset(). */
+static int
+handle_setup(struct matrix_pool *pool, CURL *easy) {
+	return ((curl_easy_setopt(easy, CURLOPT_SHARE, pool->share)) == CURLE_OK &&
+			(curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L)) == CURLE_OK &&
+			(curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L)) == CURLE_OK &&
+			/* Transfers running on the multi handle are multiplexed over a
+			 * single connection if the server speaks HTTP/2. Blocking
+			 * requests run on their own and aren't. */
+			(curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+							  CURL_HTTP_VERSION_2TLS)) == CURLE_OK &&
+			(curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L)) == CURLE_OK)
+			   ? 0
+			   : -1;
+}
+
+static void
+handle_destroy(struct matrix_pool *pool, struct matrix_handle *handle) {
+	if (!handle) {
+		return;
+	}
+
+	pool->retired_bytes += handle->buf.total;
+	pool->retired_reallocs += handle->buf.reallocs;
+
+	if (handle->buf.cap > pool->retired_peak) {
+		pool->retired_peak = handle->buf.cap;
+	}
+
+	curl_easy_cleanup(handle->easy);
+	matrix_buf_finish(&handle->buf);
+	matrix_buf_finish(&handle->url);
+	free(handle);
+}
+
+int
+matrix_pool_init(struct matrix_pool *pool) {
+	*pool = (struct matrix_pool){0};
+
+	if ((pthread_mutex_init(&pool->mutex, NULL)) != 0) {
+		return -1;
+	}
+
+	pool->has_mutex = true;
+
+	/* Only the initialized locks are destroyed if one fails. */
+	for (; pool->nlocks < CURL_LOCK_DATA_LAST; pool->nlocks++) {
+		if ((pthread_mutex_init(&pool->share_locks[pool->nlocks], NULL)) !=
+			0) {
+			return -1;
+		}
+	}
+
+	if ((pool->share = curl_share_init()) &&
+		(curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, lock_cb)) ==
+			CURLSHE_OK &&
+		(curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, unlock_cb)) ==
+			CURLSHE_OK &&
+		(curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool)) ==
+			CURLSHE_OK &&
+		(curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS)) ==
+			CURLSHE_OK &&
+		(curl_share_setopt(pool->share, CURLSHOPT_SHARE,
+						   CURL_LOCK_DATA_SSL_SESSION)) == CURLSHE_OK) {
+		return 0;
+	}
+
+	return -1;
+}
+
+/* All handles must have been released. */
+void
+matrix_pool_finish(struct matrix_pool *pool) {
+	for (size_t i = 0; i < pool->nidle; i++) {
+		handle_destroy(pool, pool->idle[i]);
+	}
+
+	curl_share_cleanup(pool->share);
+
+	for (size_t i = 0; i < pool->nlocks; i++) {
+		pthread_mutex_destroy(&pool->share_locks[i]);
+	}
+
+	if (pool->has_mutex) {
+		pthread_mutex_destroy(&pool->mutex);
+	}
+
+	*pool = (struct matrix_pool){0};
+}
+
+struct matrix_handle *
+matrix_pool_acquire(struct matrix_pool *pool) {
+	struct matrix_handle *handle = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->nidle > 0) {
+		handle = pool->idle[--pool->nidle];
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (handle) {
+		/* Clears the previous request's options but keeps the connection. */
+		curl_easy_reset(handle->easy);
+	} else if ((handle = calloc(1, sizeof(*handle))) &&
+			   !(handle->easy = curl_easy_init())) {
+		free(handle);
+		return NULL;
+	}
+
+	if (handle && (handle_setup(pool, handle->easy)) == -1) {
+		pthread_mutex_lock(&pool->mutex);
+		handle_destroy(pool, handle);
+		pthread_mutex_unlock(&pool->mutex);
+
+		return NULL;
+	}
+
+	return handle;
+}
+
+void
+matrix_pool_release(struct matrix_pool *pool, struct matrix_handle *handle) {
+	if (!handle) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->nidle < MATRIX_POOL_MAX) {
+		pool->idle[pool->nidle++] = handle;
+	} else {
+		handle_destroy(pool, handle);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Add the pool's counters to stats. Buffers of handles that are in use are
+ * counted once they are released. */
+void
+matrix_pool_stats(struct matrix_pool *pool,
+				  struct matrix_transfer_stats *stats) {
+	pthread_mutex_lock(&pool->mutex);
+
+	stats->bytes_received += pool->retired_bytes;
+	stats->reallocs += pool->retired_reallocs;
+	stats->handle_hits += pool->hits;
+	stats->handle_misses += pool->misses;
+
+	if (pool->retired_peak > stats->peak_capacity) {
+		stats->peak_capacity = pool->retired_peak;
+	}
+
+	for (size_t i = 0; i < pool->nidle; i++) {
+		const struct matrix_buf *buf = &pool->idle[i]->buf;
+
+		stats->bytes_received += buf->total;
+		stats->reallocs += buf->reallocs;
+
+		if (buf->cap > stats->peak_capacity) {
+			stats->peak_capacity = buf->cap;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,112 @@
+#include "matrix-priv.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* The queue between the sync thread and its consumer. The indices only ever
+ * increase and are masked on access, so that a full ring can be told apart
+ * from an empty one without a spare slot. The consumer sleeps in poll() on an
+ * eventfd, which is only written when the ring goes from empty to non-empty
+ * so that a busy sync doesn't cost a system call per room. */
+
+int
+matrix_ring_init(struct matrix_ring *ring, size_t capacity) {
+	size_t cap = 1;
+
+	while (cap < capacity) {
+		if (cap > ((SIZE_MAX / sizeof(*ring->slots)) / 2)) {
+			return -1;
+		}
+
+		cap *= 2;
+	}
+
+	if (!(ring->slots = calloc(cap, sizeof(*ring->slots))) ||
+		(ring->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		return -1;
+	}
+
+	ring->cap = cap;
+
+	return 0;
+}
+
+void
+matrix_ring_finish(struct matrix_ring *ring) {
+	if (ring->slots) {
+		for (struct matrix_parsed_room *room = NULL;
+			 (room = matrix_ring_pop(ring));) {
+			matrix_parsed_room_free(room);
+		}
+	}
+
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+
+	free(ring->slots);
+
+	ring->slots = NULL;
+	ring->cap = 0;
+	ring->fd = -1;
+}
+
+int
+matrix_ring_push(struct matrix_ring *ring, struct matrix_parsed_room *room) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	/* Acquire, so the consumer is done with the slot before it's reused. */
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (!room || (tail - head) == ring->cap) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	ring->slots[tail & (ring->cap - 1)] = room;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+
+	/* Only the producer writes peak, so this doesn't have to be a CAS. */
+	size_t depth = tail + 1 - head;
+
+	if (depth > atomic_load_explicit(&ring->peak, memory_order_relaxed)) {
+		atomic_store_explicit(&ring->peak, depth, memory_order_relaxed);
+	}
+
+	/* Only write to the descriptor if the consumer may have found the ring
+	 * empty. Paired with the fence in matrix_ring_pop(), either this sees that
+	 * the consumer advanced past the previous room, or the consumer sees this
+	 * room when it checks again. */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if ((atomic_load_explicit(&ring->head, memory_order_relaxed)) == tail) {
+		(void) eventfd_write(ring->fd, 1);
+	}
+
+	return 0;
+}
+
+struct matrix_parsed_room *
+matrix_ring_pop(struct matrix_ring *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail) {
+		/* Clear the descriptor before checking again, so that a room pushed
+		 * in between is either returned now or leaves it readable. */
+		eventfd_t value = 0;
+
+		(void) eventfd_read(ring->fd, &value);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if ((tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) ==
+			head) {
+			return NULL;
+		}
+	}
+
+	struct matrix_parsed_room *room = ring->slots[head & (ring->cap - 1)];
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return room;
+}
@@ -0,0 +1,548 @@
+#include "matrix-priv.h"
+#include <limits.h>
+
+/* Snapshots let other threads read the store while the sync updates it. Each
+ * published snapshot is an index of immutable room versions, and a room is
+ * only copied when a sync changes it. Versions share their events with the
+ * store, so the store retires what it replaces instead of freeing it.
+ *
+ * Memory is reclaimed by epochs: a reader announces the epoch it saw before
+ * loading the current snapshot, and everything retired up to a publish is
+ * tagged with the epoch that the publish then ends. A batch can be freed once
+ * every pinned reader announced a later epoch, because those readers loaded a
+ * snapshot that was published after it was unlinked. */
+
+/* Rooms are indexed by their ID with an empty kind, like in the store. */
+static const char *const kind_room = "";
+
+/* nullable: shard */
+static void
+shard_free(struct matrix_index *shard) {
+	if (shard) {
+		matrix_index_finish(shard);
+		free(shard);
+	}
+}
+
+static void
+retired_free(struct matrix_retired_item item) {
+	switch (item.type) {
+	case MATRIX_RETIRED_STRING:
+		free(item.ptr);
+		break;
+	case MATRIX_RETIRED_JSON:
+		cJSON_Delete(item.ptr);
+		break;
+	case MATRIX_RETIRED_ROOM:
+		matrix_snapshot_room_free(item.ptr);
+		break;
+	case MATRIX_RETIRED_SNAPSHOT:
+		free(item.ptr);
+		break;
+	case MATRIX_RETIRED_SHARD:
+		shard_free(item.ptr);
+		break;
+	case MATRIX_RETIRED_INTERN:
+		matrix_intern_finish(item.ptr);
+		free(item.ptr);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static void
+batch_clear(struct matrix_retired *batch) {
+	for (size_t i = 0; i < batch->len; i++) {
+		retired_free(batch->items[i]);
+	}
+
+	free(batch->items);
+
+	batch->items = NULL;
+	batch->len = batch->cap = 0;
+}
+
+/* The oldest epoch that a reader is pinned in, ULLONG_MAX if none is. */
+static unsigned long long
+oldest_pinned(struct matrix_snapshots *snapshots) {
+	unsigned long long oldest = ULLONG_MAX;
+
+	for (size_t i = 0; i < MATRIX_READERS_MAX; i++) {
+		unsigned long long epoch = atomic_load(&snapshots->readers[i].epoch);
+
+		if (epoch != 0 && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	return oldest;
+}
+
+static void
+reclaim(struct matrix_snapshots *snapshots) {
+	unsigned long long oldest = oldest_pinned(snapshots);
+
+	while (snapshots->oldest && snapshots->oldest->epoch < oldest) {
+		struct matrix_retired *batch = snapshots->oldest;
+
+		if (!(snapshots->oldest = batch->next)) {
+			snapshots->newest = NULL;
+		}
+
+		batch_clear(batch);
+		free(batch);
+	}
+}
+
+/* Tag what was retired since the last publish with the current epoch and end
+ * it. The pending batch is kept if memory runs out, it then ends with a later
+ * epoch, which is only later to be freed. */
+static void
+end_epoch(struct matrix_snapshots *snapshots) {
+	struct matrix_retired *batch = NULL;
+
+	if (snapshots->pending.len > 0 && (batch = malloc(sizeof(*batch)))) {
+		*batch = snapshots->pending;
+		batch->epoch = atomic_load(&snapshots->epoch);
+
+		if (snapshots->newest) {
+			snapshots->newest->next = batch;
+		} else {
+			snapshots->oldest = batch;
+		}
+
+		snapshots->newest = batch;
+		snapshots->pending = (struct matrix_retired){0};
+	}
+
+	atomic_fetch_add(&snapshots->epoch, 1);
+}
+
+static size_t
+shard_of(const char *id) {
+	/* The low bits place the room within its shard. */
+	return (matrix_index_hash(kind_room, id) >> 24) % MATRIX_SNAPSHOT_SHARDS;
+}
+
+/* The room's version in the snapshot, NULL if it has none. */
+/* nullable: snapshot */
+static struct matrix_snapshot_room *
+snapshot_room(const struct matrix_snapshot *snapshot, const char *id) {
+	const struct matrix_index *shard =
+		snapshot ? snapshot->shards[shard_of(id)] : NULL;
+
+	return shard ? matrix_index_get(shard, kind_room, id) : NULL;
+}
+
+/* Replace the room's version with a copy of the store's room, or remove it if
+ * the store doesn't have it. Shards that aren't owned yet are copied from
+ * prev first. */
+/* nullable: prev */
+static int
+snapshot_set(struct matrix *matrix, struct matrix_snapshot *snapshot,
+			 const struct matrix_snapshot *prev, bool owned[],
+			 const char *id) {
+	size_t i = shard_of(id);
+
+	if (!owned[i] || !snapshot->shards[i]) {
+		struct matrix_index *shard = calloc(1, sizeof(*shard));
+
+		if (!shard || (!owned[i] && snapshot->shards[i] &&
+					   (matrix_index_copy(shard, snapshot->shards[i])) == -1)) {
+			free(shard);
+			return -1;
+		}
+
+		snapshot->shards[i] = shard;
+		owned[i] = true;
+	}
+
+	/* The previous version still belongs to prev. */
+	const struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, id);
+	struct matrix_snapshot_room *version =
+		matrix_index_remove(snapshot->shards[i], kind_room, id);
+
+	if (version && version != snapshot_room(prev, id)) {
+		matrix_snapshot_room_free(version);
+	}
+
+	if (!room) {
+		return 0;
+	}
+
+	if (!(version = matrix_store_snapshot_room(matrix, room)) ||
+		(matrix_index_put(snapshot->shards[i], kind_room, id, version)) ==
+			-1) {
+		matrix_snapshot_room_free(version);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Free what the snapshot doesn't share with prev. */
+/* nullable: prev */
+static void
+snapshot_discard(struct matrix_snapshot *snapshot,
+				 const struct matrix_snapshot *prev, const bool owned[]) {
+	for (size_t i = 0; i < MATRIX_SNAPSHOT_SHARDS; i++) {
+		struct matrix_index *shard = owned[i] ? snapshot->shards[i] : NULL;
+
+		for (size_t j = 0; shard && j < shard->cap; j++) {
+			struct matrix_index_entry *entry = &shard->entries[j];
+
+			if (entry->item && entry->item != snapshot_room(prev, entry->key)) {
+				matrix_snapshot_room_free(entry->item);
+			}
+		}
+
+		shard_free(shard);
+	}
+
+	free(snapshot);
+}
+
+/* Copy the rooms that changed since prev and share the others. Every room is
+ * copied if the store must be rebuilt. */
+/* nullable: prev */
+static struct matrix_snapshot *
+snapshot_build(struct matrix *matrix, const struct matrix_snapshot *prev,
+			   bool owned[]) {
+	struct matrix_store *store = &matrix->store;
+	struct matrix_snapshot *snapshot = calloc(1, sizeof(*snapshot));
+
+	if (!snapshot) {
+		return NULL;
+	}
+
+	snapshot->version = prev ? prev->version + 1 : 1;
+
+	if (!store->rebuild && prev) {
+		memcpy(snapshot->shards, prev->shards, sizeof(snapshot->shards));
+	}
+
+	const struct matrix_index *ids = store->rebuild ? &store->rooms
+													: &store->dirty;
+
+	for (size_t i = 0; i < ids->cap; i++) {
+		if (ids->entries[i].item &&
+			(snapshot_set(matrix, snapshot, prev, owned,
+						  ids->entries[i].key)) == -1) {
+			snapshot_discard(snapshot, prev, owned);
+			return NULL;
+		}
+	}
+
+	return snapshot;
+}
+
+void
+matrix_retire(struct matrix *matrix, enum matrix_retired_type type, void *ptr) {
+	if (!ptr) {
+		return;
+	}
+
+	struct matrix_retired_item item = {
+		.ptr = ptr,
+		.type = type,
+	};
+
+	if (!matrix->snapshots) {
+		retired_free(item);
+		return;
+	}
+
+	struct matrix_retired *pending = &matrix->snapshots->pending;
+
+	if (pending->len == pending->cap) {
+		size_t cap = pending->cap ? pending->cap * 2 : 64;
+		struct matrix_retired_item *items =
+			realloc(pending->items, cap * sizeof(*items));
+
+		/* A reader may still see it, so leaking it is the only safe option. */
+		if (!items) {
+			return;
+		}
+
+		pending->items = items;
+		pending->cap = cap;
+	}
+
+	pending->items[pending->len++] = item;
+}
+
+void
+matrix_snapshot_publish(struct matrix *matrix) {
+	struct matrix_snapshots *snapshots = matrix->snapshots;
+	struct matrix_store *store = &matrix->store;
+
+	if (!snapshots) {
+		return;
+	}
+
+	/* Readers may have moved on since the last publish. */
+	if (!store->rebuild && store->dirty.len == 0) {
+		reclaim(snapshots);
+		return;
+	}
+
+	/* Only the writer stores it. */
+	struct matrix_snapshot *prev =
+		atomic_load_explicit(&snapshots->current, memory_order_relaxed);
+	bool owned[MATRIX_SNAPSHOT_SHARDS] = {0};
+	struct matrix_snapshot *snapshot = snapshot_build(matrix, prev, owned);
+
+	/* Readers keep the previous snapshot, the store stays dirty so the next
+	 * publish tries again. */
+	if (!snapshot) {
+		reclaim(snapshots);
+		return;
+	}
+
+	atomic_store(&snapshots->current, snapshot);
+
+	/* Retire the versions and shards that were replaced. */
+	for (size_t i = 0; prev && i < MATRIX_SNAPSHOT_SHARDS; i++) {
+		struct matrix_index *shard = prev->shards[i];
+
+		if (!shard || shard == snapshot->shards[i]) {
+			continue;
+		}
+
+		for (size_t j = 0; j < shard->cap; j++) {
+			struct matrix_index_entry *entry = &shard->entries[j];
+
+			if (entry->item &&
+				(!snapshot->shards[i] ||
+				 matrix_index_get(snapshot->shards[i], kind_room,
+								  entry->key) != entry->item)) {
+				matrix_retire(matrix, MATRIX_RETIRED_ROOM, entry->item);
+			}
+		}
+
+		matrix_retire(matrix, MATRIX_RETIRED_SHARD, shard);
+	}
+
+	matrix_retire(matrix, MATRIX_RETIRED_SNAPSHOT, prev);
+
+	matrix_index_finish(&store->dirty);
+	store->rebuild = false;
+
+	end_epoch(snapshots);
+	reclaim(snapshots);
+}
+
+void
+matrix_snapshot_room_free(struct matrix_snapshot_room *room) {
+	if (room) {
+		matrix_index_finish(&room->state);
+		free(room->states);
+		free(room->timeline);
+		free(room);
+	}
+}
+
+void
+matrix_snapshots_finish(struct matrix *matrix) {
+	struct matrix_snapshots *snapshots = matrix->snapshots;
+
+	if (!snapshots) {
+		return;
+	}
+
+	struct matrix_snapshot *current = atomic_load(&snapshots->current);
+
+	if (current) {
+		bool owned[MATRIX_SNAPSHOT_SHARDS];
+
+		for (size_t i = 0; i < MATRIX_SNAPSHOT_SHARDS; i++) {
+			owned[i] = true;
+		}
+
+		snapshot_discard(current, NULL, owned);
+	}
+
+	for (struct matrix_retired *batch = snapshots->oldest; batch;) {
+		struct matrix_retired *next = batch->next;
+
+		batch_clear(batch);
+		free(batch);
+		batch = next;
+	}
+
+	batch_clear(&snapshots->pending);
+	free(snapshots);
+
+	matrix->snapshots = NULL;
+	matrix_index_finish(&matrix->store.dirty);
+}
+
+int
+matrix_set_store_snapshots(struct matrix *matrix, bool enabled) {
+	matrix_snapshots_finish(matrix);
+
+	if (!enabled) {
+		return 0;
+	}
+
+	struct matrix_snapshots *snapshots = aligned_alloc(
+		_Alignof(struct matrix_snapshots), sizeof(*snapshots));
+
+	if (!snapshots) {
+		return -1;
+	}
+
+	*snapshots = (struct matrix_snapshots){
+		.epoch = 1,
+	};
+
+	for (size_t i = 0; i < MATRIX_READERS_MAX; i++) {
+		snapshots->readers[i].snapshots = snapshots;
+	}
+
+	matrix->snapshots = snapshots;
+
+	/* Publish what the store already has, so that pinning never fails. */
+	matrix->store.rebuild = true;
+	matrix_snapshot_publish(matrix);
+
+	if (!atomic_load(&snapshots->current)) {
+		matrix_snapshots_finish(matrix);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct matrix_reader *
+matrix_reader_acquire(struct matrix *matrix) {
+	struct matrix_snapshots *snapshots = matrix->snapshots;
+
+	for (size_t i = 0; snapshots && i < MATRIX_READERS_MAX; i++) {
+		bool used = false;
+
+		if (atomic_compare_exchange_strong(&snapshots->readers[i].used, &used,
+										   true)) {
+			return &snapshots->readers[i];
+		}
+	}
+
+	return NULL;
+}
+
+void
+matrix_reader_release(struct matrix_reader *reader) {
+	if (reader) {
+		matrix_snapshot_unpin(reader);
+		atomic_store(&reader->used, false);
+	}
+}
+
+const struct matrix_snapshot *
+matrix_snapshot_pin(struct matrix_reader *reader) {
+	struct matrix_snapshots *snapshots = reader->snapshots;
+
+	/* The epoch must be visible before current is loaded, both are
+	 * sequentially consistent so that the writer can't miss it when it
+	 * reclaims after publishing the next snapshot. */
+	atomic_store(&reader->epoch, atomic_load(&snapshots->epoch));
+
+	return atomic_load(&snapshots->current);
+}
+
+void
+matrix_snapshot_unpin(struct matrix_reader *reader) {
+	atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+size_t
+matrix_snapshot_version(const struct matrix_snapshot *snapshot) {
+	return snapshot->version;
+}
+
+int
+matrix_snapshot_get_state(const struct matrix_snapshot *snapshot,
+						  const char *room_id, const char *type,
+						  const char *state_key,
+						  struct matrix_state_event *event) {
+	if (!snapshot || !room_id || !type || !state_key || !event) {
+		return -1;
+	}
+
+	const struct matrix_snapshot_room *room = snapshot_room(snapshot, room_id);
+	const struct matrix_snapshot_state *state =
+		room ? matrix_index_get(&room->state, type, state_key) : NULL;
+
+	if (!state) {
+		return -1;
+	}
+
+	struct matrix_state_base base = {
+		.event_id = state->event_id,
+		.sender = state->sender,
+		.type = state->type,
+		.state_key = state->state_key,
+		.origin_server_ts = state->origin_server_ts,
+	};
+
+	return matrix_parse_state_content(base, state->content, event);
+}
+
+const char *
+matrix_snapshot_get_displayname(const struct matrix_snapshot *snapshot,
+								const char *room_id, const char *mxid) {
+	struct matrix_state_event event;
+
+	if ((matrix_snapshot_get_state(snapshot, room_id, "m.room.member", mxid,
+								   &event)) == -1 ||
+		event.type != MATRIX_ROOM_MEMBER) {
+		return NULL;
+	}
+
+	return event.member.displayname;
+}
+
+size_t
+matrix_snapshot_timeline_len(const struct matrix_snapshot *snapshot,
+							 const char *room_id) {
+	if (!snapshot || !room_id) {
+		return 0;
+	}
+
+	const struct matrix_snapshot_room *room = snapshot_room(snapshot, room_id);
+
+	return room ? room->timeline_len : 0;
+}
+
+int
+matrix_snapshot_timeline_get(const struct matrix_snapshot *snapshot,
+							 const char *room_id, size_t index,
+							 struct matrix_timeline_event *event,
+							 const char **gap) {
+	if (!snapshot || !room_id || !event) {
+		return -1;
+	}
+
+	const struct matrix_snapshot_room *room = snapshot_room(snapshot, room_id);
+
+	if (!room || index >= room->timeline_len) {
+		return -1;
+	}
+
+	const struct matrix_snapshot_event *stored = &room->timeline[index];
+
+	struct matrix_room_base base = {
+		.event_id = stored->event_id,
+		.sender = stored->sender,
+		.type = stored->type,
+		.origin_server_ts = stored->origin_server_ts,
+	};
+
+	if (gap) {
+		*gap = stored->gap || index == 0 ? stored->token : NULL;
+	}
+
+	return matrix_parse_timeline_content(base, stored->content, event);
+}
@@ -0,0 +1,624 @@
+#include "matrix-priv.h"
+
+enum {
+	STORE_STATE_INITIAL = 16,
+};
+
+/* Rooms are indexed by their interned ID with an empty kind. */
+static const char *const kind_room = "";
+
+static size_t
+hash_handles(uint32_t type, uint32_t state_key) {
+	uint32_t hash = (type * 2654435761U) ^ state_key;
+
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6BU;
+	hash ^= hash >> 13;
+
+	return hash;
+}
+
+/* Returns the slot of the event, which is empty (type == 0) if the room
+ * doesn't have it. */
+static struct matrix_store_state *
+state_find(const struct matrix_store_room *room, uint32_t type,
+		   uint32_t state_key) {
+	assert(room->state_cap > 0);
+
+	for (size_t i = hash_handles(type, state_key) & (room->state_cap - 1);;
+		 i = (i + 1) & (room->state_cap - 1)) {
+		struct matrix_store_state *state = &room->state[i];
+
+		if (state->type == 0 ||
+			(state->type == type && state->state_key == state_key)) {
+			return state;
+		}
+	}
+}
+
+static int
+state_grow(struct matrix_store_room *room) {
+	struct matrix_store_room grown = {
+		.state_cap =
+			room->state_cap ? room->state_cap * 2 : STORE_STATE_INITIAL,
+		.state_len = room->state_len,
+	};
+
+	if (!(grown.state = calloc(grown.state_cap, sizeof(*grown.state)))) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < room->state_cap; i++) {
+		if (room->state[i].type != 0) {
+			*state_find(&grown, room->state[i].type, room->state[i].state_key) =
+				room->state[i];
+		}
+	}
+
+	free(room->state);
+
+	room->state = grown.state;
+	room->state_cap = grown.state_cap;
+
+	return 0;
+}
+
+static void
+state_clear(struct matrix *matrix, struct matrix_store_room *room) {
+	for (size_t i = 0; i < room->state_cap; i++) {
+		matrix_retire(matrix, MATRIX_RETIRED_STRING, room->state[i].event_id);
+		matrix_retire(matrix, MATRIX_RETIRED_JSON, room->state[i].content);
+	}
+
+	free(room->state);
+
+	room->state = NULL;
+	room->state_cap = room->state_len = 0;
+}
+
+static void
+event_free(struct matrix *matrix, struct matrix_store_event *event) {
+	matrix_retire(matrix, MATRIX_RETIRED_STRING, event->event_id);
+	matrix_retire(matrix, MATRIX_RETIRED_STRING, event->token);
+	matrix_retire(matrix, MATRIX_RETIRED_JSON, event->content);
+}
+
+/* index 0 is the oldest event. */
+static struct matrix_store_event *
+timeline_at(const struct matrix_store_timeline *timeline, size_t index) {
+	assert(index < timeline->len);
+
+	return &timeline->events[(timeline->head + index) % timeline->cap];
+}
+
+static void
+timeline_clear(struct matrix *matrix, struct matrix_store_timeline *timeline) {
+	for (size_t i = 0; i < timeline->len; i++) {
+		event_free(matrix, timeline_at(timeline, i));
+	}
+
+	free(timeline->events);
+
+	*timeline = (struct matrix_store_timeline){0};
+}
+
+/* Drop the oldest event. The token of a later batch also covers it, so the new
+ * oldest event takes the first one to keep paginating from there. */
+static int
+timeline_evict(struct matrix *matrix, struct matrix_store_timeline *timeline) {
+	struct matrix_store_event evicted = *timeline_at(timeline, 0);
+
+	timeline->head = (timeline->head + 1) % timeline->cap;
+	timeline->len--;
+
+	struct matrix_store_event *front =
+		timeline->len > 0 ? timeline_at(timeline, 0) : NULL;
+
+	for (size_t i = 1; front && !front->token && i < timeline->len; i++) {
+		const char *token = timeline_at(timeline, i)->token;
+
+		if (token && !(front->token = strdup(token))) {
+			event_free(matrix, &evicted);
+			return -1;
+		}
+	}
+
+	/* All that's left is the evicted event's token, which skips it. */
+	if (front && !front->token) {
+		front->token = evicted.token;
+		evicted.token = NULL;
+	}
+
+	event_free(matrix, &evicted);
+
+	return 0;
+}
+
+/* Keep the latest events that fit. */
+static int
+timeline_resize(struct matrix *matrix, struct matrix_store_timeline *timeline,
+				size_t cap) {
+	if (cap == 0) {
+		timeline_clear(matrix, timeline);
+		return 0;
+	}
+
+	while (timeline->len > cap) {
+		if ((timeline_evict(matrix, timeline)) == -1) {
+			return -1;
+		}
+	}
+
+	struct matrix_store_event *events = calloc(cap, sizeof(*events));
+
+	if (!events) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < timeline->len; i++) {
+		events[i] = *timeline_at(timeline, i);
+	}
+
+	free(timeline->events);
+
+	timeline->events = events;
+	timeline->cap = cap;
+	timeline->head = 0;
+
+	return 0;
+}
+
+static void
+room_free(struct matrix *matrix, struct matrix_store_room *room) {
+	if (room) {
+		state_clear(matrix, room);
+		timeline_clear(matrix, &room->timeline);
+		free(room);
+	}
+}
+
+/* Remember to copy the room into the next snapshot. */
+static void
+mark_dirty(struct matrix *matrix, uint32_t id) {
+	struct matrix_store *store = &matrix->store;
+	char *key = matrix_intern_str(&matrix->intern, id);
+
+	if (matrix->snapshots && !matrix_index_get(&store->dirty, kind_room, key) &&
+		(matrix_index_put(&store->dirty, kind_room, key, key)) == -1) {
+		/* Copying every room is slow, but never wrong. */
+		store->rebuild = true;
+	}
+}
+
+static struct matrix_store_room *
+room_get(struct matrix *matrix, const char *id, enum matrix_room_type type) {
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, id);
+
+	if (room) {
+		/* Stripped invite state is dropped once the full state arrives. */
+		if (room->type != type) {
+			state_clear(matrix, room);
+			timeline_clear(matrix, &room->timeline);
+			room->type = type;
+		}
+
+		mark_dirty(matrix, room->id);
+
+		return room;
+	}
+
+	uint32_t handle = matrix_intern(&matrix->intern, id);
+
+	if (handle == 0 || !(room = calloc(1, sizeof(*room)))) {
+		return NULL;
+	}
+
+	*room = (struct matrix_store_room){
+		.id = handle,
+		.type = type,
+	};
+
+	if ((matrix_index_put(&matrix->store.rooms, kind_room,
+						  matrix_intern_str(&matrix->intern, handle), room)) ==
+		-1) {
+		room_free(matrix, room);
+		return NULL;
+	}
+
+	mark_dirty(matrix, handle);
+
+	return room;
+}
+
+static int
+get_ts(const cJSON *event) {
+	double ts = cJSON_GetNumberValue(
+		cJSON_GetObjectItemCaseSensitive(event, "origin_server_ts"));
+
+	return isnan(ts) ? 0 : matrix_double_to_int(ts);
+}
+
+/* Replace the stored events with newer ones with the same type and state_key,
+ * and add the rest. Only the content is copied, identifiers are interned. */
+static int
+merge_state(struct matrix *matrix, struct matrix_store_room *room,
+			const cJSON *events) {
+	const cJSON *event = NULL;
+
+	cJSON_ArrayForEach(event, events) {
+		const char *event_id = GETSTR(event, "event_id");
+		const cJSON *content =
+			cJSON_GetObjectItemCaseSensitive(event, "content");
+		int origin_server_ts = get_ts(event);
+
+		/* The same events that the iterators skip. */
+		if (!GETSTR(event, "type") || !GETSTR(event, "state_key") ||
+			!GETSTR(event, "sender") || !event_id || !content ||
+			!origin_server_ts) {
+			continue;
+		}
+
+		struct matrix_store_state incoming = {
+			.type = matrix_intern(&matrix->intern, GETSTR(event, "type")),
+			.state_key =
+				matrix_intern(&matrix->intern, GETSTR(event, "state_key")),
+			.sender = matrix_intern(&matrix->intern, GETSTR(event, "sender")),
+			.origin_server_ts = origin_server_ts,
+		};
+
+		if (incoming.type == 0 || incoming.state_key == 0 ||
+			incoming.sender == 0 ||
+			(((room->state_len + 1) * 2) > room->state_cap &&
+			 (state_grow(room)) == -1) ||
+			!(incoming.event_id = strdup(event_id)) ||
+			!(incoming.content = cJSON_Duplicate(content, true))) {
+			free(incoming.event_id);
+			return -1;
+		}
+
+		struct matrix_store_state *state =
+			state_find(room, incoming.type, incoming.state_key);
+
+		if (state->type == 0) {
+			room->state_len++;
+		}
+
+		matrix_retire(matrix, MATRIX_RETIRED_STRING, state->event_id);
+		matrix_retire(matrix, MATRIX_RETIRED_JSON, state->content);
+
+		*state = incoming;
+	}
+
+	return 0;
+}
+
+/* Append the events that the timeline iterator returns, evicting the oldest
+ * ones once the room has timeline_max of them. A limited batch leaves a gap
+ * before its first event, which is filled by paginating from its token. */
+static bool
+timeline_contains(const struct matrix_store_timeline *timeline,
+				  const char *event_id) {
+	for (size_t i = 0; i < timeline->len; i++) {
+		if ((strcmp(timeline_at(timeline, i)->event_id, event_id)) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int
+append_timeline(struct matrix *matrix, struct matrix_store_room *room,
+				const cJSON *timeline) {
+	struct matrix_store_timeline *ring = &room->timeline;
+
+	if (ring->cap != matrix->store.timeline_max &&
+		(timeline_resize(matrix, ring, matrix->store.timeline_max)) == -1) {
+		return -1;
+	}
+
+	if (ring->cap == 0) {
+		return 0;
+	}
+
+	const cJSON *events = cJSON_GetObjectItemCaseSensitive(timeline, "events");
+	const char *prev_batch = GETSTR(timeline, "prev_batch");
+	bool first = true;
+	cJSON *event = NULL;
+
+	if (ring->len > 0 &&
+		cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(timeline, "limited"))) {
+		ring->gap = true;
+	}
+
+	cJSON_ArrayForEach(event, events) {
+		struct matrix_timeline_event parsed;
+
+		/* A sync that failed midway is received again from its start. */
+		if ((matrix_parse_timeline_event(event, &parsed)) == -1 ||
+			timeline_contains(ring, GETSTR(event, "event_id"))) {
+			continue;
+		}
+
+		struct matrix_store_event incoming = {
+			.type = matrix_intern(&matrix->intern, GETSTR(event, "type")),
+			.sender = matrix_intern(&matrix->intern, GETSTR(event, "sender")),
+			.origin_server_ts = get_ts(event),
+			.gap = ring->gap,
+		};
+
+		/* redacts is moved into the content so that it can be parsed from the
+		 * content alone. */
+		if (incoming.type == 0 || incoming.sender == 0 ||
+			!(incoming.event_id = strdup(GETSTR(event, "event_id"))) ||
+			(first && prev_batch && !(incoming.token = strdup(prev_batch))) ||
+			!(incoming.content = cJSON_Duplicate(
+				  cJSON_GetObjectItemCaseSensitive(event, "content"), true)) ||
+			(parsed.type == MATRIX_ROOM_REDACTION &&
+			 !cJSON_GetObjectItemCaseSensitive(incoming.content, "redacts") &&
+			 !(cJSON_AddStringToObject(incoming.content, "redacts",
+									   parsed.redaction.redacts))) ||
+			(ring->len == ring->cap && (timeline_evict(matrix, ring)) == -1)) {
+			event_free(matrix, &incoming);
+			return -1;
+		}
+
+		ring->events[(ring->head + ring->len) % ring->cap] = incoming;
+		ring->len++;
+		ring->gap = first = false;
+	}
+
+	return 0;
+}
+
+static const cJSON *
+get_events(const cJSON *room, const char *section) {
+	return cJSON_GetObjectItemCaseSensitive(
+		cJSON_GetObjectItemCaseSensitive(room, section), "events");
+}
+
+void
+matrix_store_finish(struct matrix *matrix) {
+	struct matrix_store *store = &matrix->store;
+
+	for (size_t i = 0; i < store->rooms.cap; i++) {
+		room_free(matrix, store->rooms.entries[i].item);
+	}
+
+	matrix_index_finish(&store->rooms);
+	matrix_index_finish(&store->dirty);
+
+	store->rebuild = true;
+}
+
+struct matrix_snapshot_room *
+matrix_store_snapshot_room(struct matrix *matrix,
+						   const struct matrix_store_room *room) {
+	struct matrix_snapshot_room *version = calloc(1, sizeof(*version));
+
+	if (!version) {
+		return NULL;
+	}
+
+	if ((room->state_len > 0 &&
+		 !(version->states =
+			   calloc(room->state_len, sizeof(*version->states)))) ||
+		(room->timeline.len > 0 &&
+		 !(version->timeline =
+			   calloc(room->timeline.len, sizeof(*version->timeline))))) {
+		matrix_snapshot_room_free(version);
+		return NULL;
+	}
+
+	for (size_t i = 0, n = 0; i < room->state_cap; i++) {
+		const struct matrix_store_state *state = &room->state[i];
+
+		if (state->type == 0) {
+			continue;
+		}
+
+		struct matrix_snapshot_state *copy = &version->states[n++];
+
+		*copy = (struct matrix_snapshot_state){
+			.type = matrix_intern_str(&matrix->intern, state->type),
+			.state_key = matrix_intern_str(&matrix->intern, state->state_key),
+			.sender = matrix_intern_str(&matrix->intern, state->sender),
+			.origin_server_ts = state->origin_server_ts,
+			.event_id = state->event_id,
+			.content = state->content,
+		};
+
+		if ((matrix_index_put(&version->state, copy->type, copy->state_key,
+							  copy)) == -1) {
+			matrix_snapshot_room_free(version);
+			return NULL;
+		}
+	}
+
+	for (size_t i = 0; i < room->timeline.len; i++) {
+		const struct matrix_store_event *event =
+			timeline_at(&room->timeline, i);
+
+		version->timeline[i] = (struct matrix_snapshot_event){
+			.type = matrix_intern_str(&matrix->intern, event->type),
+			.sender = matrix_intern_str(&matrix->intern, event->sender),
+			.origin_server_ts = event->origin_server_ts,
+			.event_id = event->event_id,
+			.token = event->token,
+			.content = event->content,
+			.gap = event->gap,
+		};
+	}
+
+	version->timeline_len = room->timeline.len;
+
+	return version;
+}
+
+void
+matrix_store_room(struct matrix *matrix, enum matrix_room_type type,
+				  const cJSON *room) {
+	struct matrix_store *store = &matrix->store;
+
+	if (!store->enabled || !room || !room->string) {
+		return;
+	}
+
+	struct matrix_store_room *stored = NULL;
+	const cJSON *timeline = cJSON_GetObjectItemCaseSensitive(room, "timeline");
+	int ret = 0;
+
+	switch (type) {
+	case MATRIX_ROOM_LEAVE:
+		if ((stored =
+				 matrix_index_remove(&store->rooms, kind_room, room->string))) {
+			mark_dirty(matrix, stored->id);
+			room_free(matrix, stored);
+		}
+		break;
+	case MATRIX_ROOM_JOIN:
+		/* State events in the timeline happened after those in state. */
+		if (!(stored = room_get(matrix, room->string, type)) ||
+			(merge_state(matrix, stored, get_events(room, "state"))) != 0 ||
+			(merge_state(matrix, stored, get_events(room, "timeline"))) != 0 ||
+			(append_timeline(matrix, stored, timeline)) != 0) {
+			ret = -1;
+		}
+		break;
+	case MATRIX_ROOM_INVITE:
+		/* invite_state is always complete. */
+		if ((stored = room_get(matrix, room->string, type))) {
+			state_clear(matrix, stored);
+		}
+
+		ret = stored && (merge_state(matrix, stored,
+									 get_events(room, "invite_state"))) == 0
+				  ? 0
+				  : -1;
+		break;
+	default:
+		assert(0);
+	}
+
+	/* Missing events would silently turn into wrong answers, so give up. */
+	if (ret == -1) {
+		matrix_store_finish(matrix);
+		store->enabled = false;
+	}
+}
+
+int
+matrix_store_get_state(struct matrix *matrix, const char *room_id,
+					   const char *type, const char *state_key,
+					   struct matrix_state_event *event) {
+	if (!matrix || !room_id || !type || !state_key || !event) {
+		return -1;
+	}
+
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, room_id);
+
+	/* Strings that were never interned can't be in the store. */
+	uint32_t type_handle = matrix_intern_find(&matrix->intern, type);
+	uint32_t state_key_handle = matrix_intern_find(&matrix->intern, state_key);
+
+	if (!room || room->state_cap == 0 || type_handle == 0 ||
+		state_key_handle == 0) {
+		return -1;
+	}
+
+	const struct matrix_store_state *state =
+		state_find(room, type_handle, state_key_handle);
+
+	if (state->type == 0) {
+		return -1;
+	}
+
+	struct matrix_state_base base = {
+		.event_id = state->event_id,
+		.sender = matrix_intern_str(&matrix->intern, state->sender),
+		.type = matrix_intern_str(&matrix->intern, state->type),
+		.state_key = matrix_intern_str(&matrix->intern, state->state_key),
+		.origin_server_ts = state->origin_server_ts,
+	};
+
+	return matrix_parse_state_content(base, state->content, event);
+}
+
+size_t
+matrix_store_timeline_len(struct matrix *matrix, const char *room_id) {
+	if (!matrix || !room_id) {
+		return 0;
+	}
+
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, room_id);
+
+	return room ? room->timeline.len : 0;
+}
+
+int
+matrix_store_timeline_get(struct matrix *matrix, const char *room_id,
+						  size_t index, struct matrix_timeline_event *event,
+						  const char **gap) {
+	if (!matrix || !room_id || !event) {
+		return -1;
+	}
+
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, room_id);
+
+	if (!room || index >= room->timeline.len) {
+		return -1;
+	}
+
+	const struct matrix_store_event *stored =
+		timeline_at(&room->timeline, index);
+
+	struct matrix_room_base base = {
+		.event_id = stored->event_id,
+		.sender = matrix_intern_str(&matrix->intern, stored->sender),
+		.type = matrix_intern_str(&matrix->intern, stored->type),
+		.origin_server_ts = stored->origin_server_ts,
+	};
+
+	if (gap) {
+		*gap = stored->gap || index == 0 ? stored->token : NULL;
+	}
+
+	return matrix_parse_timeline_content(base, stored->content, event);
+}
+
+const char *
+matrix_store_timeline_token(struct matrix *matrix, const char *room_id) {
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, room_id);
+
+	return room && room->timeline.len > 0
+			   ? timeline_at(&room->timeline, 0)->token
+			   : NULL;
+}
+
+bool
+matrix_store_timeline_has(struct matrix *matrix, const char *room_id,
+						  const char *event_id) {
+	struct matrix_store_room *room =
+		matrix_index_get(&matrix->store.rooms, kind_room, room_id);
+
+	return room && timeline_contains(&room->timeline, event_id);
+}
+
+const char *
+matrix_store_get_displayname(struct matrix *matrix, const char *room_id,
+							 const char *mxid) {
+	struct matrix_state_event event;
+
+	if ((matrix_store_get_state(matrix, room_id, "m.room.member", mxid,
+								&event)) == -1 ||
+		event.type != MATRIX_ROOM_MEMBER) {
+		return NULL;
+	}
+
+	return event.member.displayname;
+}
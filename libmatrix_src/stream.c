@@ -0,0 +1,240 @@
+#include "matrix-priv.h"
+
+/* An incremental scanner for /sync responses. It only understands enough JSON
+ * to find rooms.{join,leave,invite}.<room_id> objects, and hands each room to
+ * sync_cb as soon as its closing brace arrives. Only the room currently being
+ * received is kept in memory, everything else is skipped over. */
+
+enum section {
+	SECTION_OTHER = 0,
+	SECTION_TOP,
+	SECTION_ROOMS,
+	SECTION_LEAVE,
+	SECTION_JOIN,
+	SECTION_INVITE,
+};
+
+static bool
+key_is(const struct matrix_sync_stream *stream, const char *key) {
+	size_t len = strlen(key);
+
+	return stream->key.len == len && (memcmp(stream->key.data, key, len)) == 0;
+}
+
+static enum section
+child_section(const struct matrix_sync_stream *stream, char open) {
+	if (open != '{') {
+		return SECTION_OTHER;
+	}
+
+	if (stream->depth == 0) {
+		return SECTION_TOP;
+	}
+
+	switch (stream->sections[stream->depth]) {
+	case SECTION_TOP:
+		return key_is(stream, "rooms") ? SECTION_ROOMS : SECTION_OTHER;
+	case SECTION_ROOMS:
+		if ((key_is(stream, "leave"))) {
+			return SECTION_LEAVE;
+		}
+
+		if ((key_is(stream, "join"))) {
+			return SECTION_JOIN;
+		}
+
+		return key_is(stream, "invite") ? SECTION_INVITE : SECTION_OTHER;
+	default:
+		return SECTION_OTHER;
+	}
+}
+
+static int
+capture_start(struct matrix_sync_stream *stream) {
+	switch (stream->sections[stream->depth]) {
+	case SECTION_LEAVE:
+		stream->room_type = MATRIX_ROOM_LEAVE;
+		break;
+	case SECTION_JOIN:
+		stream->room_type = MATRIX_ROOM_JOIN;
+		break;
+	case SECTION_INVITE:
+		stream->room_type = MATRIX_ROOM_INVITE;
+		break;
+	default:
+		return 0;
+	}
+
+	/* Wrap the room in an object so that cJSON unescapes the room ID for us
+	 * and stores it in the room's string member, just like a full parse. */
+	stream->room.len = 0;
+	stream->capturing = true;
+
+	return ((matrix_buf_append(&stream->room, "{\"", 2)) == 0 &&
+			(matrix_buf_append(&stream->room, stream->key.data,
+							   stream->key.len)) == 0 &&
+			(matrix_buf_append(&stream->room, "\":", 2)) == 0)
+			   ? 0
+			   : -1;
+}
+
+static void
+capture_finish(struct matrix *matrix) {
+	struct matrix_sync_stream *stream = &matrix->stream;
+
+	stream->capturing = false;
+
+	matrix_arena_begin(&matrix->arena);
+	cJSON *wrapper = cJSON_ParseWithLength(stream->room.data, stream->room.len);
+	matrix_arena_end();
+
+	if (wrapper && wrapper->child) {
+		matrix_dispatch_sync_room(matrix, stream->room_type, wrapper->child,
+								  stream->next_batch.len > 0
+									  ? stream->next_batch.data
+									  : NULL);
+	}
+
+	matrix_arena_reset(&matrix->arena);
+}
+
+void
+matrix_sync_stream_reset(struct matrix_sync_stream *stream) {
+	struct matrix_buf key = stream->key;
+	struct matrix_buf room = stream->room;
+	struct matrix_buf next_batch = stream->next_batch;
+
+	key.len = room.len = next_batch.len = 0;
+
+	/* Keep the allocations around for the next response. */
+	*stream = (struct matrix_sync_stream){
+		.key = key,
+		.room = room,
+		.next_batch = next_batch,
+	};
+
+	if (stream->next_batch.data) {
+		stream->next_batch.data[0] = '\0';
+	}
+}
+
+void
+matrix_sync_stream_finish(struct matrix_sync_stream *stream) {
+	matrix_buf_finish(&stream->key);
+	matrix_buf_finish(&stream->room);
+	matrix_buf_finish(&stream->next_batch);
+}
+
+int
+matrix_sync_stream_feed(struct matrix *matrix, const char *data, size_t len) {
+	struct matrix_sync_stream *stream = &matrix->stream;
+
+	size_t capture_from = 0; /* Start of the unflushed room bytes in data. */
+
+	for (size_t i = 0; i < len && !stream->failed; i++) {
+		const char c = data[i];
+
+		if (stream->in_string) {
+			if (stream->escaped) {
+				stream->escaped = false;
+			} else if (c == '\\') {
+				stream->escaped = true;
+			} else if (c == '"') {
+				stream->in_string = stream->in_key = stream->in_next_batch =
+					false;
+				continue;
+			}
+
+			if ((stream->in_key &&
+				 (matrix_buf_append(&stream->key, &c, 1)) == -1) ||
+				(stream->in_next_batch &&
+				 (matrix_buf_append(&stream->next_batch, &c, 1)) == -1)) {
+				stream->failed = true;
+			}
+
+			continue;
+		}
+
+		switch (c) {
+		case '"':
+			stream->in_string = true;
+
+			if (stream->capturing ||
+				stream->depth > MATRIX_SYNC_STREAM_TRACKED_DEPTH) {
+				break;
+			}
+
+			if (stream->expect_key) {
+				stream->in_key = true;
+				stream->key.len = 0;
+			} else if (stream->depth == 1 && key_is(stream, "next_batch")) {
+				stream->in_next_batch = true;
+				stream->next_batch.len = 0;
+			}
+			break;
+		case '{':
+		case '[':
+			if (!stream->capturing &&
+				stream->depth == MATRIX_SYNC_STREAM_TRACKED_DEPTH &&
+				c == '{') {
+				if ((capture_start(stream)) == -1) {
+					stream->failed = true;
+					break;
+				}
+
+				capture_from = i;
+			}
+
+			if (stream->depth < MATRIX_SYNC_STREAM_TRACKED_DEPTH) {
+				stream->sections[stream->depth + 1] =
+					(unsigned char) child_section(stream, c);
+				stream->objects[stream->depth + 1] = (c == '{');
+			}
+
+			stream->depth++;
+			stream->expect_key = (c == '{');
+			break;
+		case '}':
+		case ']':
+			if (stream->depth == 0) {
+				stream->failed = true;
+				break;
+			}
+
+			stream->depth--;
+			stream->expect_key = false;
+
+			if (stream->capturing &&
+				stream->depth == MATRIX_SYNC_STREAM_TRACKED_DEPTH) {
+				if ((matrix_buf_append(&stream->room, &data[capture_from],
+									   i - capture_from + 1)) == -1 ||
+					(matrix_buf_append(&stream->room, "}", 1)) == -1) {
+					stream->failed = true;
+					break;
+				}
+
+				capture_finish(matrix);
+			}
+			break;
+		case ',':
+			stream->expect_key =
+				stream->depth > 0 &&
+				stream->depth <= MATRIX_SYNC_STREAM_TRACKED_DEPTH &&
+				stream->objects[stream->depth];
+			break;
+		case ':':
+			stream->expect_key = false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (stream->capturing && !stream->failed &&
+		(matrix_buf_append(&stream->room, &data[capture_from],
+						   len - capture_from)) == -1) {
+		stream->failed = true;
+	}
+
+	return stream->failed ? -1 : 0;
+}
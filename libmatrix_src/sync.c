@@ -1,8 +1,5 @@
 #include "matrix-priv.h"
 
-/* For boolean evaluation */
-#define STREQ(s1, s2) ((strcmp(s1, s2)) == 0)
-
 /* Safely get an int from a cJSON object without overflows. */
 static int
 get_int(const cJSON *json, const char name[], int int_default) {
@@ -105,10 +102,590 @@ matrix_sync_room_next(struct matrix_sync_response *response,
 	return -1;
 }
 
-/* Assign the event type and compare in the same statement to reduce chance of
- * typos. */
-#define TYPE(enumeration, string)                                              \
-	(revent->type = (enumeration), (STREQ(base.type, string)))
+#define LEN(array) (sizeof(array) / sizeof(*(array)))
+
+/* A lookup switches on the length of s and compares it with the few keys of
+ * that length, so it costs the same however many keys there are and nothing
+ * has to be built before the first one. The X-macro lists group the keys by
+ * length, KEY_CASE() starts a group and KEY_MATCH() adds to it. A key in the
+ * wrong group fails to compile, and a second group of the same length is a
+ * duplicate case. The comparisons have a constant length, so they're inlined
+ * into a few integer comparisons. */
+#define KEY_CASE(index, key)                                                   \
+	break;                                                                     \
+	}                                                                          \
+	case sizeof(key) - 1: {                                                    \
+		enum { KEY_LEN = sizeof(key) - 1 };                                    \
+		KEY_COMPARE(index, key)
+#define KEY_MATCH(index, key)                                                  \
+	_Static_assert(sizeof(key) - 1 == KEY_LEN, "Misplaced key " key);          \
+	KEY_COMPARE(index, key)
+#define KEY_COMPARE(index, key)                                                \
+	if ((memcmp(s, key, KEY_LEN)) == 0) {                                      \
+		return (int) (index);                                                  \
+	}
+
+/* The keys that we read from events, from their content and from the info
+ * object of files in the content. */
+/* CASE(enumeration, key), X(enumeration, key), grouped by length. */
+#define EVENT_FIELDS(CASE, X)                                                  \
+	CASE(EVENT_TYPE, "type")                                                   \
+	CASE(EVENT_SENDER, "sender")                                               \
+	CASE(EVENT_CONTENT, "content")                                             \
+	X(EVENT_REDACTS, "redacts")                                                \
+	X(EVENT_ROOM_ID, "room_id")                                                \
+	CASE(EVENT_EVENT_ID, "event_id")                                           \
+	CASE(EVENT_STATE_KEY, "state_key")                                         \
+	CASE(EVENT_PREV_CONTENT, "prev_content")                                   \
+	CASE(EVENT_ORIGIN_SERVER_TS, "origin_server_ts")
+
+#define CONTENT_FIELDS(CASE, X)                                                \
+	CASE(CONTENT_BAN, "ban")                                                   \
+	X(CONTENT_URL, "url")                                                      \
+	CASE(CONTENT_BODY, "body")                                                 \
+	X(CONTENT_INFO, "info")                                                    \
+	X(CONTENT_KICK, "kick")                                                    \
+	X(CONTENT_NAME, "name")                                                    \
+	CASE(CONTENT_ALIAS, "alias")                                               \
+	X(CONTENT_TOPIC, "topic")                                                  \
+	X(CONTENT_USERS, "users")                                                  \
+	CASE(CONTENT_EVENTS, "events")                                             \
+	X(CONTENT_FORMAT, "format")                                                \
+	X(CONTENT_INVITE, "invite")                                                \
+	X(CONTENT_REASON, "reason")                                                \
+	X(CONTENT_REDACT, "redact")                                                \
+	CASE(CONTENT_CREATOR, "creator")                                           \
+	X(CONTENT_MSGTYPE, "msgtype")                                              \
+	X(CONTENT_REDACTS, "redacts")                                              \
+	CASE(CONTENT_FILENAME, "filename")                                         \
+	X(CONTENT_USER_IDS, "user_ids")                                            \
+	CASE(CONTENT_IS_DIRECT, "is_direct")                                       \
+	X(CONTENT_JOIN_RULE, "join_rule")                                          \
+	CASE(CONTENT_AVATAR_URL, "avatar_url")                                     \
+	X(CONTENT_FEDERATE, "m.federate")                                          \
+	X(CONTENT_MEMBERSHIP, "membership")                                        \
+	CASE(CONTENT_DISPLAYNAME, "displayname")                                   \
+	CASE(CONTENT_ROOM_VERSION, "room_version")                                 \
+	CASE(CONTENT_NOTIFICATIONS, "notifications")                               \
+	X(CONTENT_STATE_DEFAULT, "state_default")                                  \
+	X(CONTENT_USERS_DEFAULT, "users_default")                                  \
+	CASE(CONTENT_EVENTS_DEFAULT, "events_default")                             \
+	X(CONTENT_FORMATTED_BODY, "formatted_body")
+
+#define INFO_FIELDS(CASE, X)                                                   \
+	CASE(INFO_SIZE, "size")                                                    \
+	CASE(INFO_MIMETYPE, "mimetype")
+
+#define FIELD_ENUM(enumeration, key) enumeration,
+#define FIELD_CASE(enumeration, key) KEY_CASE(enumeration, key)
+#define FIELD_MATCH(enumeration, key) KEY_MATCH(enumeration, key)
+
+enum event_field { EVENT_FIELDS(FIELD_ENUM, FIELD_ENUM) EVENT_FIELD_MAX };
+enum content_field { CONTENT_FIELDS(FIELD_ENUM, FIELD_ENUM) CONTENT_FIELD_MAX };
+enum info_field { INFO_FIELDS(FIELD_ENUM, FIELD_ENUM) INFO_FIELD_MAX };
+
+/* Returns the field of the key or -1 if it's unknown. */
+static int
+event_field_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		EVENT_FIELDS(FIELD_CASE, FIELD_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+static int
+content_field_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		CONTENT_FIELDS(FIELD_CASE, FIELD_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+static int
+info_field_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		INFO_FIELDS(FIELD_CASE, FIELD_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+#undef FIELD_ENUM
+#undef FIELD_CASE
+#undef FIELD_MATCH
+
+/* Walk the object's members once, storing each member that we're interested in
+ * in the slot of it's key. Unlike cJSON_GetObjectItem(), this is case
+ * sensitive and costs O(members) instead of O(members * keys). */
+static void
+get_fields(const cJSON *object, int (*find)(const char *), cJSON *slots[],
+		   size_t len) {
+	memset(slots, 0, len * sizeof(*slots));
+
+	for (cJSON *child = object ? object->child : NULL; child;
+		 child = child->next) {
+		int i = child->string ? find(child->string) : -1;
+
+		/* Like cJSON_GetObjectItem(), the first duplicate wins. */
+		if (i != -1 && !slots[i]) {
+			slots[i] = child;
+		}
+	}
+}
+
+#define GET_EVENT_FIELDS(object, slots)                                        \
+	get_fields((object), event_field_find, (slots), EVENT_FIELD_MAX)
+#define GET_CONTENT_FIELDS(object, slots)                                      \
+	get_fields((object), content_field_find, (slots), CONTENT_FIELD_MAX)
+#define GET_INFO_FIELDS(object, slots)                                         \
+	get_fields((object), info_field_find, (slots), INFO_FIELD_MAX)
+
+/* Safely get an int from a field without overflows. */
+static int
+field_int(const cJSON *field, int int_default) {
+	double tmp = cJSON_GetNumberValue(field);
+
+	if (!(isnan(tmp))) {
+		return matrix_double_to_int(tmp);
+	}
+
+	return int_default;
+}
+
+static bool
+parse_member(cJSON *const event[], cJSON *const content[],
+			 struct matrix_state_base base, struct matrix_state_event *revent) {
+	cJSON *prev_content[CONTENT_FIELD_MAX];
+
+	GET_CONTENT_FIELDS(event[EVENT_PREV_CONTENT], prev_content);
+
+	revent->member = (struct matrix_room_member){
+		.base = base,
+		.is_direct = cJSON_IsTrue(content[CONTENT_IS_DIRECT]),
+		.membership = cJSON_GetStringValue(content[CONTENT_MEMBERSHIP]),
+		.prev_membership =
+			cJSON_GetStringValue(prev_content[CONTENT_MEMBERSHIP]),
+		.avatar_url = cJSON_GetStringValue(content[CONTENT_AVATAR_URL]),
+		.displayname = cJSON_GetStringValue(content[CONTENT_DISPLAYNAME]),
+	};
+
+	return !!revent->member.membership;
+}
+
+static bool
+parse_power_levels(cJSON *const event[], cJSON *const content[],
+				   struct matrix_state_base base,
+				   struct matrix_state_event *revent) {
+	(void) event;
+
+	const int default_power = 50;
+
+	revent->power_levels = (struct matrix_room_power_levels){
+		.base = base,
+		.ban = field_int(content[CONTENT_BAN], default_power),
+		.events_default =
+			field_int(content[CONTENT_EVENTS_DEFAULT], 0), /* Exception. */
+		.invite = field_int(content[CONTENT_INVITE], default_power),
+		.kick = field_int(content[CONTENT_KICK], default_power),
+		.redact = field_int(content[CONTENT_REDACT], default_power),
+		.state_default =
+			field_int(content[CONTENT_STATE_DEFAULT], default_power),
+		.users_default =
+			field_int(content[CONTENT_USERS_DEFAULT], 0), /* Exception. */
+		.events = content[CONTENT_EVENTS],
+		.notifications = content[CONTENT_NOTIFICATIONS],
+		.users = content[CONTENT_USERS],
+	};
+
+	return true;
+}
+
+static bool
+parse_canonical_alias(cJSON *const event[], cJSON *const content[],
+					  struct matrix_state_base base,
+					  struct matrix_state_event *revent) {
+	(void) event;
+
+	revent->canonical_alias = (struct matrix_room_canonical_alias){
+		.base = base,
+		.alias = cJSON_GetStringValue(content[CONTENT_ALIAS]),
+	};
+
+	return true;
+}
+
+static bool
+parse_create(cJSON *const event[], cJSON *const content[],
+			 struct matrix_state_base base, struct matrix_state_event *revent) {
+	(void) event;
+
+	const char *version = cJSON_GetStringValue(content[CONTENT_ROOM_VERSION]);
+
+	if (!version) {
+		version = "1";
+	}
+
+	revent->create = (struct matrix_room_create){
+		.base = base,
+		/* The key is m.federate, servers never send a plain federate. */
+		.federate = content[CONTENT_FEDERATE]
+						? cJSON_IsTrue(content[CONTENT_FEDERATE])
+						: true, /* Federation is enabled if the key doesn't
+								   exist. */
+		.creator = cJSON_GetStringValue(content[CONTENT_CREATOR]),
+		.room_version = version,
+	};
+
+	return true;
+}
+
+static bool
+parse_join_rules(cJSON *const event[], cJSON *const content[],
+				 struct matrix_state_base base,
+				 struct matrix_state_event *revent) {
+	(void) event;
+
+	revent->join_rules = (struct matrix_room_join_rules){
+		.base = base,
+		.join_rule = cJSON_GetStringValue(content[CONTENT_JOIN_RULE]),
+	};
+
+	return !!revent->join_rules.join_rule;
+}
+
+static bool
+parse_name(cJSON *const event[], cJSON *const content[],
+		   struct matrix_state_base base, struct matrix_state_event *revent) {
+	(void) event;
+
+	revent->name = (struct matrix_room_name){
+		.base = base,
+		.name = cJSON_GetStringValue(content[CONTENT_NAME]),
+	};
+
+	return true;
+}
+
+static bool
+parse_topic(cJSON *const event[], cJSON *const content[],
+			struct matrix_state_base base, struct matrix_state_event *revent) {
+	(void) event;
+
+	revent->topic = (struct matrix_room_topic){
+		.base = base,
+		.topic = cJSON_GetStringValue(content[CONTENT_TOPIC]),
+	};
+
+	return true;
+}
+
+static struct matrix_file_info
+parse_file_info(const cJSON *info) {
+	cJSON *fields[INFO_FIELD_MAX];
+
+	GET_INFO_FIELDS(info, fields);
+
+	return (struct matrix_file_info){
+		.size = field_int(fields[INFO_SIZE], 0),
+		.mimetype = cJSON_GetStringValue(fields[INFO_MIMETYPE]),
+	};
+}
+
+static bool
+parse_avatar(cJSON *const event[], cJSON *const content[],
+			 struct matrix_state_base base, struct matrix_state_event *revent) {
+	(void) event;
+
+	revent->avatar = (struct matrix_room_avatar){
+		.base = base,
+		.url = cJSON_GetStringValue(content[CONTENT_URL]),
+		.info = parse_file_info(content[CONTENT_INFO]),
+	};
+
+	return true;
+}
+
+static bool
+parse_message(cJSON *const event[], cJSON *const content[],
+			  struct matrix_room_base base,
+			  struct matrix_timeline_event *revent) {
+	(void) event;
+
+	revent->message = (struct matrix_room_message){
+		.base = base,
+		.body = cJSON_GetStringValue(content[CONTENT_BODY]),
+		.msgtype = cJSON_GetStringValue(content[CONTENT_MSGTYPE]),
+		.format = cJSON_GetStringValue(content[CONTENT_FORMAT]),
+		.formatted_body = cJSON_GetStringValue(content[CONTENT_FORMATTED_BODY]),
+	};
+
+	return !!revent->message.body && !!revent->message.msgtype;
+}
+
+static bool
+parse_redaction(cJSON *const event[], cJSON *const content[],
+				struct matrix_room_base base,
+				struct matrix_timeline_event *revent) {
+	revent->redaction = (struct matrix_room_redaction){
+		.base = base,
+		/* Moved into the content in room version 11. */
+		.redacts = event[EVENT_REDACTS]
+					   ? cJSON_GetStringValue(event[EVENT_REDACTS])
+					   : cJSON_GetStringValue(content[CONTENT_REDACTS]),
+		.reason = cJSON_GetStringValue(content[CONTENT_REASON]),
+	};
+
+	return !!revent->redaction.redacts;
+}
+
+static bool
+parse_attachment(cJSON *const event[], cJSON *const content[],
+				 struct matrix_room_base base,
+				 struct matrix_timeline_event *revent) {
+	(void) event;
+
+	revent->attachment = (struct matrix_room_attachment){
+		.base = base,
+		.body = cJSON_GetStringValue(content[CONTENT_BODY]),
+		.msgtype = cJSON_GetStringValue(content[CONTENT_MSGTYPE]),
+		.url = cJSON_GetStringValue(content[CONTENT_URL]),
+		.filename = cJSON_GetStringValue(content[CONTENT_FILENAME]),
+		.info = parse_file_info(content[CONTENT_INFO]),
+	};
+
+	return !!revent->attachment.body && !!revent->attachment.msgtype &&
+		   !!revent->attachment.url && !!revent->attachment.filename;
+}
+
+static bool
+parse_typing(cJSON *const event[], cJSON *const content[],
+			 struct matrix_ephemeral_base base,
+			 struct matrix_ephemeral_event *revent) {
+	(void) event;
+
+	revent->typing = (struct matrix_room_typing){
+		.base = base,
+		.user_ids = content[CONTENT_USER_IDS],
+	};
+
+	return !!revent->typing.user_ids;
+}
+
+/* The event types that we understand. Adding a type only requires a line here
+ * (along with its enum member and parser). A NULL parser means that events of
+ * that type are skipped. The types are grouped by length, see KEY_CASE(). */
+/* CASE(enumeration, type, parser), X(enumeration, type, parser) */
+#define STATE_EVENTS(CASE, X)                                                  \
+	CASE(MATRIX_ROOM_NAME, "m.room.name", parse_name)                          \
+	CASE(MATRIX_ROOM_TOPIC, "m.room.topic", parse_topic)                       \
+	CASE(MATRIX_ROOM_MEMBER, "m.room.member", parse_member)                    \
+	X(MATRIX_ROOM_CREATE, "m.room.create", parse_create)                       \
+	X(MATRIX_ROOM_AVATAR, "m.room.avatar", parse_avatar)                       \
+	CASE(MATRIX_ROOM_JOIN_RULES, "m.room.join_rules", parse_join_rules)        \
+	CASE(MATRIX_ROOM_POWER_LEVELS, "m.room.power_levels", parse_power_levels)  \
+	CASE(MATRIX_ROOM_CANONICAL_ALIAS, "m.room.canonical_alias",                \
+		 parse_canonical_alias)
+
+/* Types not in this table are assumed to be attachments. */
+#define TIMELINE_EVENTS(CASE, X)                                               \
+	CASE(MATRIX_ROOM_ATTACHMENT, "m.location", NULL)                           \
+	CASE(MATRIX_ROOM_MESSAGE, "m.room.message", parse_message)                 \
+	CASE(MATRIX_ROOM_REDACTION, "m.room.redaction", parse_redaction)
+
+#define EPHEMERAL_EVENTS(CASE, X)                                              \
+	CASE(MATRIX_ROOM_TYPING, "m.typing", parse_typing)
+
+#define TYPE_ENTRY(enumeration, type_str, parser)                              \
+	{.name = (type_str), .type = (enumeration), .parse = (parser)},
+
+static const struct {
+	const char *name;
+	enum matrix_state_type type;
+	bool (*parse)(cJSON *const[], cJSON *const[], struct matrix_state_base,
+				  struct matrix_state_event *);
+} state_types[] = {STATE_EVENTS(TYPE_ENTRY, TYPE_ENTRY)};
+
+static const struct {
+	const char *name;
+	enum matrix_timeline_type type;
+	bool (*parse)(cJSON *const[], cJSON *const[], struct matrix_room_base,
+				  struct matrix_timeline_event *);
+} timeline_types[] = {TIMELINE_EVENTS(TYPE_ENTRY, TYPE_ENTRY)};
+
+static const struct {
+	const char *name;
+	enum matrix_ephemeral_type type;
+	bool (*parse)(cJSON *const[], cJSON *const[], struct matrix_ephemeral_base,
+				  struct matrix_ephemeral_event *);
+} ephemeral_types[] = {EPHEMERAL_EVENTS(TYPE_ENTRY, TYPE_ENTRY)};
+
+/* The index of every type in its table. */
+#define TYPE_INDEX(enumeration, type_str, parser) INDEX_##enumeration,
+#define TYPE_CASE(enumeration, type_str, parser)                               \
+	KEY_CASE(INDEX_##enumeration, type_str)
+#define TYPE_MATCH(enumeration, type_str, parser)                              \
+	KEY_MATCH(INDEX_##enumeration, type_str)
+
+enum { STATE_EVENTS(TYPE_INDEX, TYPE_INDEX) };
+enum { TIMELINE_EVENTS(TYPE_INDEX, TYPE_INDEX) };
+enum { EPHEMERAL_EVENTS(TYPE_INDEX, TYPE_INDEX) };
+
+/* Return the index of the type in its table or -1 if it's unknown. */
+static int
+state_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		STATE_EVENTS(TYPE_CASE, TYPE_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+static int
+timeline_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		TIMELINE_EVENTS(TYPE_CASE, TYPE_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+static int
+ephemeral_find(const char *s) {
+	size_t len = strlen(s);
+
+	switch (len) {
+	default: {
+		EPHEMERAL_EVENTS(TYPE_CASE, TYPE_MATCH)
+	}
+	}
+
+	return -1;
+}
+
+#undef TYPE_ENTRY
+#undef TYPE_INDEX
+#undef TYPE_CASE
+#undef TYPE_MATCH
+
+/* Types without a parser are always skipped, so they aren't requested. */
+#define ADD_PARSED(types)                                                      \
+	for (size_t i = 0; i < LEN(types); i++) {                                  \
+		if (types[i].parse && (add_type(array, types[i].name)) == -1) {        \
+			return -1;                                                         \
+		}                                                                      \
+	}
+
+static int
+add_type(cJSON *array, const char *type) {
+	cJSON *name = cJSON_CreateString(type);
+
+	if (!name || !(cJSON_AddItemToArray(array, name))) {
+		cJSON_Delete(name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+matrix_sync_add_types(cJSON *array, enum matrix_event_type type) {
+	switch (type) {
+	case MATRIX_EVENT_STATE:
+		ADD_PARSED(state_types);
+		break;
+	case MATRIX_EVENT_TIMELINE:
+		/* State changes are also sent in the timeline. */
+		if ((matrix_sync_add_types(array, MATRIX_EVENT_STATE)) == -1) {
+			return -1;
+		}
+
+		ADD_PARSED(timeline_types);
+		break;
+	case MATRIX_EVENT_EPHEMERAL:
+		ADD_PARSED(ephemeral_types);
+		break;
+	default:
+		assert(0);
+		return -1;
+	}
+
+	return 0;
+}
+
+#undef ADD_PARSED
+
+static int
+parse_state(cJSON *const fields[], cJSON *content_object,
+			struct matrix_state_base base, struct matrix_state_event *revent) {
+	int i = state_find(base.type);
+
+	if (i == -1 || !state_types[i].parse) {
+		return -1;
+	}
+
+	cJSON *content[CONTENT_FIELD_MAX];
+
+	GET_CONTENT_FIELDS(content_object, content);
+
+	revent->type = state_types[i].type;
+
+	return state_types[i].parse(fields, content, base, revent) ? 0 : -1;
+}
+
+static int
+parse_state_event(cJSON *event, struct matrix_state_event *revent) {
+	cJSON *fields[EVENT_FIELD_MAX];
+
+	GET_EVENT_FIELDS(event, fields);
+
+	struct matrix_state_base base = {
+		.origin_server_ts =
+			field_int(fields[EVENT_ORIGIN_SERVER_TS], 0), /* TODO time_t */
+		.event_id = cJSON_GetStringValue(fields[EVENT_EVENT_ID]),
+		.sender = cJSON_GetStringValue(fields[EVENT_SENDER]),
+		.type = cJSON_GetStringValue(fields[EVENT_TYPE]),
+		.state_key = cJSON_GetStringValue(fields[EVENT_STATE_KEY]),
+	};
+
+	if (!base.origin_server_ts || !base.event_id || !base.sender ||
+		!base.type || !base.state_key || !fields[EVENT_CONTENT]) {
+		return -1;
+	}
+
+	return parse_state(fields, fields[EVENT_CONTENT], base, revent);
+}
+
+int
+matrix_parse_state_content(struct matrix_state_base base, cJSON *content,
+						   struct matrix_state_event *revent) {
+	/* The members outside of base and content are only used for the previous
+	 * membership, which stored events don't have. */
+	cJSON *const fields[EVENT_FIELD_MAX] = {0};
+
+	return parse_state(fields, content, base, revent);
+}
 
 int
 matrix_sync_state_next(struct matrix_room *room,
@@ -120,120 +697,72 @@ matrix_sync_state_next(struct matrix_room *room,
 	cJSON *event = room->events[MATRIX_EVENT_STATE];
 
 	while (event) {
-		bool is_valid = true;
-
-		struct matrix_state_base base = {
-			.origin_server_ts =
-				get_int(event, "origin_server_ts", 0), /* TODO time_t */
-			.event_id = GETSTR(event, "event_id"),
-			.sender = GETSTR(event, "sender"),
-			.type = GETSTR(event, "type"),
-		};
+		int ret = parse_state_event(event, revent);
 
-		cJSON *content = NULL;
+		event = room->events[MATRIX_EVENT_STATE] = event->next;
 
-		if (!base.origin_server_ts || !base.event_id || !base.sender ||
-			!base.type || !(content = cJSON_GetObjectItem(event, "content"))) {
-			event = room->events[MATRIX_EVENT_STATE] = event->next;
-			continue;
+		if (ret == 0) {
+			return 0;
 		}
+	}
 
-		if (TYPE(MATRIX_ROOM_MEMBER, "m.room.member")) {
-			revent->member = (struct matrix_room_member){
-				.base = base,
-				.is_direct =
-					cJSON_IsTrue(cJSON_GetObjectItem(content, "is_direct")),
-				.membership = GETSTR(content, "membership"),
-				.prev_membership = GETSTR(
-					cJSON_GetObjectItem(event, "prev_content"), "membership"),
-				.avatar_url = GETSTR(content, "avatar_url"),
-				.displayname = GETSTR(content, "displayname"),
-			};
+	return -1;
+}
 
-			is_valid = !!revent->member.membership;
-		} else if (TYPE(MATRIX_ROOM_POWER_LEVELS, "m.room.power_levels")) {
-			const int default_power = 50;
-
-			revent->power_levels = (struct matrix_room_power_levels){
-				.base = base,
-				.ban = get_int(content, "ban", default_power),
-				.events_default =
-					get_int(content, "events_default", 0), /* Exception. */
-				.invite = get_int(content, "invite", default_power),
-				.kick = get_int(content, "kick", default_power),
-				.redact = get_int(content, "redact", default_power),
-				.state_default =
-					get_int(content, "state_default", default_power),
-				.users_default =
-					get_int(content, "users_default", 0), /* Exception. */
-				.events = cJSON_GetObjectItem(content, "events"),
-				.notifications = cJSON_GetObjectItem(content, "notifications"),
-				.users = cJSON_GetObjectItem(content, "users"),
-			};
-		} else if (TYPE(MATRIX_ROOM_CANONICAL_ALIAS,
-						"m.room.canonical_alias")) {
-			revent->canonical_alias = (struct matrix_room_canonical_alias){
-				.base = base,
-				.alias = GETSTR(content, "alias"),
-			};
-		} else if (TYPE(MATRIX_ROOM_CREATE, "m.room.create")) {
-			cJSON *federate = cJSON_GetObjectItem(content, "federate");
-			const char *version = GETSTR(content, "room_version");
+static int
+parse_timeline_fields(cJSON *const fields[], cJSON *content_object,
+					  struct matrix_room_base base,
+					  struct matrix_timeline_event *revent) {
+	int i = timeline_find(base.type);
 
-			if (!version) {
-				version = "1";
-			}
+	if (i != -1 && !timeline_types[i].parse) {
+		return -1;
+	}
 
-			revent->create = (struct matrix_room_create){
-				.base = base,
-				.federate = federate ? cJSON_IsTrue(federate)
-									 : true, /* Federation is enabled if the key
-												doesn't exist. */
-				.creator = GETSTR(content, "creator"),
-				.room_version = version,
-			};
-		} else if (TYPE(MATRIX_ROOM_JOIN_RULES, "m.room.join_rules")) {
-			revent->join_rules = (struct matrix_room_join_rules){
-				.base = base,
-				.join_rule = GETSTR(content, "join_rule"),
-			};
+	cJSON *content[CONTENT_FIELD_MAX];
 
-			is_valid = !!revent->join_rules.join_rule;
-		} else if (TYPE(MATRIX_ROOM_NAME, "m.room.name")) {
-			revent->name = (struct matrix_room_name){
-				.base = base,
-				.name = GETSTR(content, "name"),
-			};
-		} else if (TYPE(MATRIX_ROOM_TOPIC, "m.room.topic")) {
-			revent->topic = (struct matrix_room_topic){
-				.base = base,
-				.topic = GETSTR(content, "topic"),
-			};
-		} else if (TYPE(MATRIX_ROOM_AVATAR, "m.room.avatar")) {
-			cJSON *info = cJSON_GetObjectItem(content, "info");
-
-			revent->avatar = (struct matrix_room_avatar){
-				.base = base,
-				.url = GETSTR(content, "url"),
-				.info =
-					{
-						.size = get_int(info, "size", 0),
-						.mimetype = GETSTR(info, "mimetype"),
-					},
-			};
-		} else {
-			/* TODO unknown */
-			is_valid = false;
-		}
+	GET_CONTENT_FIELDS(content_object, content);
 
-		event = room->events[MATRIX_EVENT_STATE] = event->next;
+	if (i == -1) {
+		/* Assume that the event is an attachment. */
+		revent->type = MATRIX_ROOM_ATTACHMENT;
+		return parse_attachment(fields, content, base, revent) ? 0 : -1;
+	}
 
-		if (is_valid) {
-			return 0;
-		}
+	revent->type = timeline_types[i].type;
+
+	return timeline_types[i].parse(fields, content, base, revent) ? 0 : -1;
+}
+
+int
+matrix_parse_timeline_event(cJSON *event,
+							struct matrix_timeline_event *revent) {
+	cJSON *fields[EVENT_FIELD_MAX];
+
+	GET_EVENT_FIELDS(event, fields);
+
+	struct matrix_room_base base = {
+		.origin_server_ts =
+			field_int(fields[EVENT_ORIGIN_SERVER_TS], 0), /* TODO time_t */
+		.event_id = cJSON_GetStringValue(fields[EVENT_EVENT_ID]),
+		.sender = cJSON_GetStringValue(fields[EVENT_SENDER]),
+		.type = cJSON_GetStringValue(fields[EVENT_TYPE]),
+	};
+
+	if (!base.origin_server_ts || !base.event_id || !base.sender ||
+		!base.type || !fields[EVENT_CONTENT]) {
+		return -1;
 	}
 
-	return -1;
+	return parse_timeline_fields(fields, fields[EVENT_CONTENT], base, revent);
+}
+
+int
+matrix_parse_timeline_content(struct matrix_room_base base, cJSON *content,
+							  struct matrix_timeline_event *revent) {
+	cJSON *const fields[EVENT_FIELD_MAX] = {0};
+
+	return parse_timeline_fields(fields, content, base, revent);
 }
 
 int
@@ -246,64 +775,11 @@ matrix_sync_timeline_next(struct matrix_room *room,
 	cJSON *event = room->events[MATRIX_EVENT_TIMELINE];
 
 	while (event) {
-		bool is_valid = false;
-
-		struct matrix_room_base base = {
-			.origin_server_ts =
-				get_int(event, "origin_server_ts", 0), /* TODO time_t */
-			.event_id = GETSTR(event, "event_id"),
-			.sender = GETSTR(event, "sender"),
-			.type = GETSTR(event, "type"),
-		};
-
-		cJSON *content = NULL;
-
-		if (!base.origin_server_ts || !base.event_id || !base.sender ||
-			!base.type || !(content = cJSON_GetObjectItem(event, "content"))) {
-			event = room->events[MATRIX_EVENT_TIMELINE] = event->next;
-			continue;
-		}
-
-		if (TYPE(MATRIX_ROOM_MESSAGE, "m.room.message")) {
-			revent->message = (struct matrix_room_message){
-				.base = base,
-				.body = GETSTR(content, "body"),
-				.msgtype = GETSTR(content, "msgtype"),
-				.format = GETSTR(content, "format"),
-				.formatted_body = GETSTR(content, "formatted_body"),
-			};
-
-			is_valid = !!revent->message.body && !!revent->message.msgtype;
-		} else if (TYPE(MATRIX_ROOM_REDACTION, "m.room.redaction")) {
-			revent->redaction = (struct matrix_room_redaction){
-				.base = base,
-				.redacts = GETSTR(event, "redacts"),
-				.reason = GETSTR(content, "reason"),
-			};
-
-			is_valid = !!revent->redaction.redacts;
-		} else if (!TYPE(MATRIX_ROOM_ATTACHMENT, "m.location")) {
-			/* Assume that the event is an attachment. */
-			cJSON *info = cJSON_GetObjectItem(content, "info");
-
-			revent->attachment = (struct matrix_room_attachment){
-				.base = base,
-				.body = GETSTR(content, "body"),
-				.msgtype = GETSTR(content, "msgtype"),
-				.url = GETSTR(content, "url"),
-				.filename = GETSTR(content, "filename"),
-				.info = {.size = get_int(info, "size", 0),
-						 .mimetype = GETSTR(info, "mimetype")},
-			};
-
-			is_valid =
-				!!revent->attachment.body && !!revent->attachment.msgtype &&
-				!!revent->attachment.url && !!revent->attachment.filename;
-		}
+		int ret = matrix_parse_timeline_event(event, revent);
 
 		event = room->events[MATRIX_EVENT_TIMELINE] = event->next;
 
-		if (is_valid) {
+		if (ret == 0) {
 			return 0;
 		}
 	}
@@ -323,25 +799,29 @@ matrix_sync_ephemeral_next(struct matrix_room *room,
 	while (event) {
 		bool is_valid = false;
 
+		cJSON *fields[EVENT_FIELD_MAX];
+
+		GET_EVENT_FIELDS(event, fields);
+
 		struct matrix_ephemeral_base base = {
-			.type = GETSTR(event, "type"),
-			.room_id = GETSTR(event, "room_id"),
+			.type = cJSON_GetStringValue(fields[EVENT_TYPE]),
+			.room_id = cJSON_GetStringValue(fields[EVENT_ROOM_ID]),
 		};
 
-		cJSON *content = cJSON_GetObjectItem(event, "content");
-
-		if (!content) {
+		if (!fields[EVENT_CONTENT] || !base.type) {
 			event = room->events[MATRIX_EVENT_EPHEMERAL] = event->next;
 			continue;
 		}
 
-		if (TYPE(MATRIX_ROOM_TYPING, "m.typing")) {
-			revent->typing = (struct matrix_room_typing){
-				.base = base,
-				.user_ids = cJSON_GetObjectItem(content, "user_ids"),
-			};
+		int i = ephemeral_find(base.type);
+
+		if (i != -1 && ephemeral_types[i].parse) {
+			cJSON *content[CONTENT_FIELD_MAX];
 
-			is_valid = !!revent->typing.user_ids;
+			GET_CONTENT_FIELDS(fields[EVENT_CONTENT], content);
+
+			revent->type = ephemeral_types[i].type;
+			is_valid = ephemeral_types[i].parse(fields, content, base, revent);
 		}
 
 		event = room->events[MATRIX_EVENT_EPHEMERAL] = event->next;
@@ -354,11 +834,156 @@ matrix_sync_ephemeral_next(struct matrix_room *room,
 	return -1;
 }
 
-#undef TYPE
+/* Update the cache and the store before sync_cb sees the room, so that it can
+ * look up the new state. */
+static void
+retain_room(struct matrix *matrix, enum matrix_room_type type,
+			const cJSON *room) {
+	matrix_cache_room(&matrix->cache, type, room);
+	matrix_store_room(matrix, type, room);
+}
+
+static size_t
+count_events(const cJSON *event) {
+	size_t len = 0;
+
+	for (; event; event = event->next) {
+		len++;
+	}
+
+	return len;
+}
+
+struct matrix_parsed_room *
+matrix_parsed_room_new(enum matrix_room_type type, const cJSON *room) {
+	struct matrix_parsed_room *parsed = calloc(1, sizeof(*parsed));
+
+	if (!parsed || !(parsed->json = cJSON_Duplicate(room, true))) {
+		matrix_parsed_room_free(parsed);
+		return NULL;
+	}
+
+	struct matrix_sync_response response = {0};
+
+	response.rooms[type] = parsed->json;
+
+	if ((matrix_sync_room_next(&response, &parsed->room)) == -1) {
+		matrix_parsed_room_free(parsed);
+		return NULL;
+	}
+
+	/* The lengths of the arrays are upper bounds, events of unknown types are
+	 * skipped. */
+	struct matrix_room events = parsed->room;
+	size_t state_cap = count_events(events.events[MATRIX_EVENT_STATE]);
+	size_t timeline_cap = count_events(events.events[MATRIX_EVENT_TIMELINE]);
+	size_t ephemeral_cap = count_events(events.events[MATRIX_EVENT_EPHEMERAL]);
+
+	if ((state_cap > 0 &&
+		 !(parsed->state = calloc(state_cap, sizeof(*parsed->state)))) ||
+		(timeline_cap > 0 &&
+		 !(parsed->timeline =
+			   calloc(timeline_cap, sizeof(*parsed->timeline)))) ||
+		(ephemeral_cap > 0 &&
+		 !(parsed->ephemeral =
+			   calloc(ephemeral_cap, sizeof(*parsed->ephemeral))))) {
+		matrix_parsed_room_free(parsed);
+		return NULL;
+	}
+
+	while (parsed->state_len < state_cap &&
+		   (matrix_sync_state_next(
+			   &events, &parsed->state[parsed->state_len])) == 0) {
+		parsed->state_len++;
+	}
+
+	while (parsed->timeline_len < timeline_cap &&
+		   (matrix_sync_timeline_next(
+			   &events, &parsed->timeline[parsed->timeline_len])) == 0) {
+		parsed->timeline_len++;
+	}
+
+	while (parsed->ephemeral_len < ephemeral_cap &&
+		   (matrix_sync_ephemeral_next(
+			   &events, &parsed->ephemeral[parsed->ephemeral_len])) == 0) {
+		parsed->ephemeral_len++;
+	}
+
+	return parsed;
+}
+
+void
+matrix_parsed_room_free(struct matrix_parsed_room *room) {
+	if (!room) {
+		return;
+	}
+
+	cJSON_Delete(room->json);
+	free(room->state);
+	free(room->timeline);
+	free(room->ephemeral);
+	free(room);
+}
+
+void
+matrix_parse_sync(struct matrix *matrix,
+				  const struct matrix_sync_response *response,
+				  void (*cb)(struct matrix *, struct matrix_parsed_room *)) {
+	struct matrix_workers *workers = matrix->workers;
+	size_t len = 0;
+
+	for (int type = 0; type < MATRIX_ROOM_MAX; type++) {
+		for (const cJSON *room = response->rooms[type]; room;
+			 room = room->next) {
+			len++;
+		}
+	}
+
+	if (!workers || len < MATRIX_WORKERS_BATCH_MIN ||
+		(matrix_workers_reserve(workers, len)) == -1) {
+		for (int type = 0; type < MATRIX_ROOM_MAX; type++) {
+			for (const cJSON *room = response->rooms[type]; room;
+				 room = room->next) {
+				cb(matrix,
+				   matrix_parsed_room_new((enum matrix_room_type) type, room));
+			}
+		}
+
+		return;
+	}
+
+	size_t i = 0;
+
+	for (int type = 0; type < MATRIX_ROOM_MAX; type++) {
+		for (const cJSON *room = response->rooms[type]; room;
+			 room = room->next) {
+			workers->scratch[i++] = (struct matrix_parse_item){
+				.room = room,
+				.type = (enum matrix_room_type) type,
+			};
+		}
+	}
+
+	matrix_workers_parse(workers, workers->scratch, len);
+
+	for (i = 0; i < len; i++) {
+		cb(matrix, workers->scratch[i].parsed);
+	}
+}
+
+void
+matrix_deliver_sync(struct matrix *matrix,
+					struct matrix_sync_response *response) {
+	if (matrix->thread) {
+		matrix_parse_sync(matrix, response, matrix_thread_push);
+	} else {
+		matrix->sync_cb(matrix, response);
+	}
+}
 
 int
 matrix_dispatch_sync(struct matrix *matrix, const cJSON *sync) {
-	if (!sync || !matrix->sync_cb) {
+	if (!sync || (!matrix->sync_cb && !matrix->thread)) {
 		return -1;
 	}
 
@@ -374,7 +999,38 @@ matrix_dispatch_sync(struct matrix *matrix, const cJSON *sync) {
 			},
 	};
 
-	matrix->sync_cb(matrix, &response);
+	for (int type = 0; type < MATRIX_ROOM_MAX; type++) {
+		for (const cJSON *room = response.rooms[type]; room;
+			 room = room->next) {
+			retain_room(matrix, (enum matrix_room_type) type, room);
+		}
+	}
+
+	matrix_snapshot_publish(matrix);
+	matrix_deliver_sync(matrix, &response);
+
+	return 0;
+}
+
+int
+matrix_dispatch_sync_room(struct matrix *matrix, enum matrix_room_type type,
+						  cJSON *room, char *next_batch) {
+	if (!room || (!matrix->sync_cb && !matrix->thread) ||
+		type >= MATRIX_ROOM_MAX) {
+		return -1;
+	}
+
+	struct matrix_sync_response response = {
+		.next_batch = next_batch,
+	};
+
+	response.rooms[type] = room;
+
+	/* The cache must keep matching its next_batch, which isn't known until
+	 * the transfer completes. */
+	matrix_cache_stage(&matrix->cache, type, room);
+	matrix_store_room(matrix, type, room);
+	matrix_deliver_sync(matrix, &response);
 
 	return 0;
 }
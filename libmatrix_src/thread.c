@@ -0,0 +1,144 @@
+#include "matrix-priv.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Threaded mode runs the sync loop on a thread of its own, which also parses
+ * the rooms, so that neither a slow consumer stalls the network nor a large
+ * response stalls the consumer. Rooms are handed over in a struct matrix_ring,
+ * everything else is only touched by the sync thread while it runs. */
+
+static void
+thread_free(struct matrix_thread *thread) {
+	matrix_ring_finish(&thread->ring);
+
+	if (thread->stop_fd != -1) {
+		close(thread->stop_fd);
+	}
+
+	free(thread->next_batch);
+	free(thread);
+}
+
+static void *
+sync_thread(void *arg) {
+	struct matrix *matrix = arg;
+	struct matrix_thread *thread = matrix->thread;
+
+	thread->code = matrix_sync_run(matrix, thread->next_batch, thread->timeout,
+								   thread->stop_fd);
+
+	atomic_store_explicit(&thread->done, true, memory_order_release);
+	(void) eventfd_write(thread->ring.fd, 1);
+
+	return NULL;
+}
+
+void
+matrix_thread_push(struct matrix *matrix, struct matrix_parsed_room *room) {
+	if ((matrix_ring_push(&matrix->thread->ring, room)) == -1) {
+		matrix_parsed_room_free(room);
+	}
+}
+
+enum matrix_code
+matrix_sync_thread_start(struct matrix *matrix, const char *next_batch,
+						 unsigned timeout, size_t capacity) {
+	if (!matrix->access_token) {
+		return MATRIX_NOT_LOGGED_IN;
+	}
+
+	if (capacity == 0) {
+		return MATRIX_INVALID_ARGUMENT;
+	}
+
+	matrix_sync_thread_stop(matrix);
+	matrix_sync_stop(matrix);
+
+	struct matrix_thread *thread =
+		aligned_alloc(_Alignof(struct matrix_thread), sizeof(*thread));
+
+	if (!thread) {
+		return MATRIX_NOMEM;
+	}
+
+	*thread = (struct matrix_thread){
+		.ring = {.fd = -1},
+		.timeout = timeout,
+		.stop_fd = -1,
+	};
+
+	if ((matrix_ring_init(&thread->ring, capacity)) == -1 ||
+		(next_batch && !(thread->next_batch = matrix_strdup(next_batch))) ||
+		(thread->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		thread_free(thread);
+		return MATRIX_NOMEM;
+	}
+
+	matrix->thread = thread;
+
+	if ((pthread_create(&thread->thread, NULL, sync_thread, matrix)) != 0) {
+		matrix->thread = NULL;
+		thread_free(thread);
+		return MATRIX_NOMEM;
+	}
+
+	return MATRIX_SUCCESS;
+}
+
+enum matrix_code
+matrix_sync_thread_stop(struct matrix *matrix) {
+	struct matrix_thread *thread = matrix->thread;
+
+	if (!thread) {
+		return MATRIX_SUCCESS;
+	}
+
+	(void) eventfd_write(thread->stop_fd, 1);
+	pthread_join(thread->thread, NULL);
+
+	enum matrix_code code = thread->code;
+
+	matrix->thread = NULL;
+	thread_free(thread);
+
+	return code;
+}
+
+bool
+matrix_sync_thread_running(struct matrix *matrix) {
+	return matrix->thread &&
+		   !atomic_load_explicit(&matrix->thread->done, memory_order_acquire);
+}
+
+int
+matrix_queue_get_fd(struct matrix *matrix) {
+	return matrix->thread ? matrix->thread->ring.fd : -1;
+}
+
+struct matrix_parsed_room *
+matrix_queue_pop(struct matrix *matrix) {
+	return matrix->thread ? matrix_ring_pop(&matrix->thread->ring) : NULL;
+}
+
+void
+matrix_get_queue_stats(struct matrix *matrix,
+					   struct matrix_queue_stats *stats) {
+	*stats = (struct matrix_queue_stats){0};
+
+	if (!matrix->thread) {
+		return;
+	}
+
+	struct matrix_ring *ring = &matrix->thread->ring;
+
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	*stats = (struct matrix_queue_stats){
+		.depth = tail - head,
+		.peak_depth = atomic_load_explicit(&ring->peak, memory_order_relaxed),
+		.capacity = ring->cap,
+		.pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed),
+		.dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed),
+	};
+}
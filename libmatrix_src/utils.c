@@ -19,3 +19,62 @@ char *
 matrix_strdup(const char *s) {
 	return s ? strdup(s) : NULL;
 }
+
+/* Ensure that the buffer can hold at least size bytes, doubling the capacity
+ * to amortize the cost of many small appends. */
+int
+matrix_buf_reserve(struct matrix_buf *buf, size_t size) {
+	if (size <= buf->cap) {
+		return 0;
+	}
+
+	const size_t initial_cap = 4096;
+
+	size_t new_cap = buf->cap ? buf->cap : initial_cap;
+
+	while (new_cap < size) {
+		if (new_cap > (SIZE_MAX / 2)) {
+			new_cap = size;
+			break;
+		}
+
+		new_cap *= 2;
+	}
+
+	char *ptr = realloc(buf->data, new_cap);
+
+	if (!ptr) {
+		return -1;
+	}
+
+	if (!buf->data) {
+		ptr[0] = '\0';
+	}
+
+	buf->data = ptr;
+	buf->cap = new_cap;
+	buf->reallocs++;
+
+	return 0;
+}
+
+int
+matrix_buf_append(struct matrix_buf *buf, const void *data, size_t len) {
+	if (len > (SIZE_MAX - buf->len - 1) ||
+		(matrix_buf_reserve(buf, buf->len + len + 1)) == -1) {
+		return -1;
+	}
+
+	memcpy(&buf->data[buf->len], data, len);
+	buf->data[buf->len += len] = '\0';
+	buf->total += len;
+
+	return 0;
+}
+
+void
+matrix_buf_finish(struct matrix_buf *buf) {
+	free(buf->data);
+
+	memset(buf, 0, sizeof(*buf));
+}
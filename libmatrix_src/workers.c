@@ -0,0 +1,158 @@
+#include "matrix-priv.h"
+
+/* The rooms of a response are independent, so parsing them into struct
+ * matrix_parsed_room scales with the number of threads. A batch is posted
+ * under the mutex, after which the threads claim rooms from a shared counter
+ * without locking until every room is claimed. The results stay in the
+ * order of the response as every room has its own slot. */
+
+static void
+run_batch(struct matrix_workers *workers) {
+	for (size_t i = 0;
+		 (i = atomic_fetch_add_explicit(&workers->next, 1,
+										memory_order_relaxed)) <
+		 workers->nitems;) {
+		struct matrix_parse_item *item = &workers->items[i];
+
+		item->parsed = matrix_parsed_room_new(item->type, item->room);
+	}
+}
+
+static void *
+worker(void *arg) {
+	struct matrix_workers *workers = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&workers->mutex);
+
+	for (;;) {
+		while (!workers->stop && workers->batch == seen) {
+			pthread_cond_wait(&workers->posted, &workers->mutex);
+		}
+
+		if (workers->stop) {
+			break;
+		}
+
+		seen = workers->batch;
+
+		pthread_mutex_unlock(&workers->mutex);
+		run_batch(workers);
+		pthread_mutex_lock(&workers->mutex);
+
+		if (--workers->busy == 0) {
+			pthread_cond_signal(&workers->finished);
+		}
+	}
+
+	pthread_mutex_unlock(&workers->mutex);
+
+	return NULL;
+}
+
+int
+matrix_workers_init(struct matrix_workers *workers, size_t threads) {
+	*workers = (struct matrix_workers){0};
+
+	/* Only what was initialized is destroyed if something fails. */
+	if (!(workers->has_mutex =
+			  (pthread_mutex_init(&workers->mutex, NULL)) == 0) ||
+		!(workers->has_posted =
+			  (pthread_cond_init(&workers->posted, NULL)) == 0) ||
+		!(workers->has_finished =
+			  (pthread_cond_init(&workers->finished, NULL)) == 0) ||
+		!(workers->threads = calloc(threads, sizeof(*workers->threads)))) {
+		return -1;
+	}
+
+	for (; workers->len < threads; workers->len++) {
+		if ((pthread_create(&workers->threads[workers->len], NULL, worker,
+							workers)) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+matrix_workers_finish(struct matrix_workers *workers) {
+	/* Threads are only started once everything else was initialized. */
+	if (workers->len > 0) {
+		pthread_mutex_lock(&workers->mutex);
+		workers->stop = true;
+		pthread_cond_broadcast(&workers->posted);
+		pthread_mutex_unlock(&workers->mutex);
+	}
+
+	for (size_t i = 0; i < workers->len; i++) {
+		pthread_join(workers->threads[i], NULL);
+	}
+
+	if (workers->has_finished) {
+		pthread_cond_destroy(&workers->finished);
+	}
+
+	if (workers->has_posted) {
+		pthread_cond_destroy(&workers->posted);
+	}
+
+	if (workers->has_mutex) {
+		pthread_mutex_destroy(&workers->mutex);
+	}
+	free(workers->threads);
+	free(workers->scratch);
+
+	*workers = (struct matrix_workers){0};
+}
+
+int
+matrix_workers_reserve(struct matrix_workers *workers, size_t len) {
+	if (len <= workers->scratch_cap) {
+		return 0;
+	}
+
+	size_t cap = workers->scratch_cap ? workers->scratch_cap : 64;
+
+	while (cap < len) {
+		cap *= 2;
+	}
+
+	struct matrix_parse_item *scratch =
+		realloc(workers->scratch, cap * sizeof(*scratch));
+
+	if (!scratch) {
+		return -1;
+	}
+
+	workers->scratch = scratch;
+	workers->scratch_cap = cap;
+
+	return 0;
+}
+
+void
+matrix_workers_parse(struct matrix_workers *workers,
+					 struct matrix_parse_item *items, size_t len) {
+	pthread_mutex_lock(&workers->mutex);
+
+	workers->items = items;
+	workers->nitems = len;
+	atomic_store_explicit(&workers->next, 0, memory_order_relaxed);
+	workers->busy = workers->len;
+	workers->batch++;
+
+	pthread_cond_broadcast(&workers->posted);
+	pthread_mutex_unlock(&workers->mutex);
+
+	run_batch(workers);
+
+	/* The mutex also makes the parsed rooms visible to this thread. */
+	pthread_mutex_lock(&workers->mutex);
+
+	while (workers->busy > 0) {
+		pthread_cond_wait(&workers->finished, &workers->mutex);
+	}
+
+	pthread_mutex_unlock(&workers->mutex);
+}
@@ -6,19 +6,104 @@
 #include <string.h>
 #include <wctype.h>
 
-/* We use a basic array instead of something like a linked list of small arrays
- * / gap buffer as pretty much all messages are small enough that array
- * insertion / deletion performance isn't an issue. */
+/* A gap buffer, the codepoints before the cursor are at the start of the array
+ * and those after it at the end, with the unused space in between. Inserting
+ * and deleting at the cursor only moves the edge of the gap, and moving the
+ * cursor moves one codepoint across it, so long pastes and edits near the
+ * start of a long message are as cheap as those at its end. */
+
+enum {
+	BUFFER_INITIAL = 256,
+};
+
+static size_t
+gap_len(const struct buffer *buffer) {
+	return buffer->cap - buffer->len;
+}
+
+/* Make room for at least n more codepoints. */
+static int
+reserve(struct buffer *buffer, size_t n) {
+	if (n <= gap_len(buffer)) {
+		return BUFFER_SUCCESS;
+	}
+
+	size_t cap = buffer->cap;
+	size_t after = buffer->len - buffer->cur;
+
+	while ((cap - buffer->len) < n) {
+		if (cap > (SIZE_MAX / sizeof(*buffer->buf) / 2)) {
+			return BUFFER_FAIL;
+		}
+
+		cap *= 2;
+	}
+
+	uint32_t *buf = realloc(buffer->buf, cap * sizeof(*buf));
+
+	if (!buf) {
+		return BUFFER_FAIL;
+	}
+
+	/* Move the codepoints after the cursor to the new end. */
+	memmove(&buf[cap - after], &buf[buffer->cap - after], after * sizeof(*buf));
+
+	buffer->buf = buf;
+	buffer->cap = cap;
+
+	return BUFFER_SUCCESS;
+}
+
+/* Move the gap to index with a single memmove of the codepoints in between. */
+static void
+move_gap(struct buffer *buffer, size_t index) {
+	size_t gap = gap_len(buffer);
+
+	if (index < buffer->cur) {
+		memmove(&buffer->buf[index + gap], &buffer->buf[index],
+				(buffer->cur - index) * sizeof(*buffer->buf));
+	} else if (index > buffer->cur) {
+		memmove(&buffer->buf[buffer->cur], &buffer->buf[buffer->cur + gap],
+				(index - buffer->cur) * sizeof(*buffer->buf));
+	}
+
+	buffer->cur = index;
+}
+
+/* Where buffer_left_word() would move the cursor to. */
+static size_t
+left_word(const struct buffer *buffer) {
+	size_t cur = buffer->cur;
+
+	do {
+		cur--;
+	} while (cur > 0 && ((iswspace((wint_t) buffer_at(buffer, cur))) ||
+						 !(iswspace((wint_t) buffer_at(buffer, cur - 1)))));
+
+	return cur;
+}
 
-static const size_t buffer_max = 2000;
+static size_t
+right_word(const struct buffer *buffer) {
+	size_t cur = buffer->cur;
+
+	do {
+		cur++;
+	} while (cur < buffer->len &&
+			 !((iswspace((wint_t) buffer_at(buffer, cur))) &&
+			   !(iswspace((wint_t) buffer_at(buffer, cur - 1)))));
+
+	return cur;
+}
 
 int
 buffer_init(struct buffer *buffer) {
-	if (!(buffer->buf = calloc(buffer_max, sizeof(*buffer->buf)))) {
-		return -1;
-	}
+	*buffer = (struct buffer){
+		.buf = calloc(BUFFER_INITIAL, sizeof(*buffer->buf)),
+		.cap = BUFFER_INITIAL,
+	};
 
-	return 0;
+	return buffer->buf ? 0 : -1;
 }
 
 void
@@ -28,21 +113,37 @@ buffer_finish(struct buffer *buffer) {
 	memset(buffer, 0, sizeof(*buffer));
 }
 
+uint32_t
+buffer_at(const struct buffer *buffer, size_t index) {
+	return buffer->buf[index < buffer->cur ? index : index + gap_len(buffer)];
+}
+
+const uint32_t *
+buffer_span(const struct buffer *buffer, size_t index, size_t *len) {
+	if (index < buffer->cur) {
+		*len = buffer->cur - index;
+		return &buffer->buf[index];
+	}
+
+	*len = buffer->len - index;
+	return &buffer->buf[index + gap_len(buffer)];
+}
+
 int
 buffer_add(struct buffer *buffer, uint32_t uc) {
-	if ((buffer->len + 1) >= buffer_max) {
+	return buffer_insert_n(buffer, &uc, 1);
+}
+
+int
+buffer_insert_n(struct buffer *buffer, const uint32_t *ucs, size_t n) {
+	if ((reserve(buffer, n)) == BUFFER_FAIL) {
 		return BUFFER_FAIL;
 	}
 
-	/* Insertion in between, move everything forward by 1 char. */
-	if (buffer->buf[buffer->cur]) {
-		for (size_t i = buffer->len; i > buffer->cur; i--) {
-			buffer->buf[i] = buffer->buf[i - 1];
-		}
-	}
+	memcpy(&buffer->buf[buffer->cur], ucs, n * sizeof(*ucs));
 
-	buffer->len++;
-	buffer->buf[buffer->cur++] = uc;
+	buffer->cur += n;
+	buffer->len += n;
 
 	return BUFFER_SUCCESS;
 }
@@ -51,6 +152,7 @@ int
 buffer_left(struct buffer *buffer) {
 	if (buffer->cur > 0) {
 		buffer->cur--;
+		buffer->buf[buffer->cur + gap_len(buffer)] = buffer->buf[buffer->cur];
 
 		return BUFFER_SUCCESS;
 	}
@@ -61,11 +163,7 @@ buffer_left(struct buffer *buffer) {
 int
 buffer_left_word(struct buffer *buffer) {
 	if (buffer->cur > 0) {
-		do {
-			buffer->cur--;
-		} while (buffer->cur > 0 &&
-				 ((iswspace((wint_t) buffer->buf[buffer->cur])) ||
-				  !(iswspace((wint_t) buffer->buf[buffer->cur - 1]))));
+		move_gap(buffer, left_word(buffer));
 
 		return BUFFER_SUCCESS;
 	}
@@ -76,6 +174,7 @@ buffer_left_word(struct buffer *buffer) {
 int
 buffer_right(struct buffer *buffer) {
 	if (buffer->cur < buffer->len) {
+		buffer->buf[buffer->cur] = buffer->buf[buffer->cur + gap_len(buffer)];
 		buffer->cur++;
 
 		return BUFFER_SUCCESS;
@@ -87,11 +186,7 @@ buffer_right(struct buffer *buffer) {
 int
 buffer_right_word(struct buffer *buffer) {
 	if (buffer->cur < buffer->len) {
-		do {
-			buffer->cur++;
-		} while (buffer->cur < buffer->len &&
-				 !((iswspace((wint_t) buffer->buf[buffer->cur])) &&
-				   !(iswspace((wint_t) buffer->buf[buffer->cur - 1]))));
+		move_gap(buffer, right_word(buffer));
 
 		return BUFFER_SUCCESS;
 	}
@@ -102,14 +197,10 @@ buffer_right_word(struct buffer *buffer) {
 int
 buffer_delete(struct buffer *buffer) {
 	if (buffer->cur > 0) {
-		/* len > 0 as cur < len. */
+		/* Widen the gap over the codepoint. */
+		buffer->cur--;
 		buffer->len--;
 
-		/* Move everything back by 1 char. */
-		for (size_t i = --buffer->cur; i < buffer->len; i++) {
-			buffer->buf[i] = buffer->buf[i + 1];
-		}
-
 		return BUFFER_SUCCESS;
 	}
 
@@ -118,21 +209,32 @@ buffer_delete(struct buffer *buffer) {
 
 int
 buffer_delete_word(struct buffer *buffer) {
-	size_t original_cur = buffer->cur;
-
-	if ((buffer_left_word(buffer)) == -1) {
+	if (buffer->cur == 0) {
 		return BUFFER_FAIL;
 	}
 
-	size_t new_cur = buffer->cur;
+	return buffer_delete_range(buffer, left_word(buffer), buffer->cur);
+}
 
-	buffer->cur = original_cur;
+int
+buffer_delete_range(struct buffer *buffer, size_t start, size_t end) {
+	if (start > end || end > buffer->len) {
+		return BUFFER_FAIL;
+	}
 
-	/* Maybe just realloc the array instead of iterating over the whole array
-	 * multiple times. */
-	for (size_t i = original_cur; i > new_cur; i--) {
-		buffer_delete(buffer);
+	/* Only the codepoints on the other side of the gap from the range move,
+	 * then the gap is widened over it. */
+	if (end <= buffer->cur) {
+		move_gap(buffer, end);
+	} else {
+		move_gap(buffer, start);
 	}
 
+	if (buffer->cur == end) {
+		buffer->cur = start;
+	}
+
+	buffer->len -= end - start;
+
 	return BUFFER_SUCCESS;
 }
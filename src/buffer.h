@@ -5,9 +5,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* A gap buffer of codepoints, see buffer.c. buf must only be read through
+ * buffer_at(). */
 struct buffer {
 	uint32_t *buf;
-	size_t cur, len;
+	size_t cap;
+	size_t cur, len; /* The cursor is also the start of the gap. */
 };
 
 enum {
@@ -20,8 +23,19 @@ buffer_init(struct buffer *buffer);
 void
 buffer_finish(struct buffer *buffer);
 
+/* Returns the codepoint at index, which must be less than len. */
+uint32_t
+buffer_at(const struct buffer *buffer, size_t index);
+/* Returns the contiguous codepoints from index up to the cursor or the end,
+ * and their number in len. index must be less than buffer->len. */
+const uint32_t *
+buffer_span(const struct buffer *buffer, size_t index, size_t *len);
+
 int
 buffer_add(struct buffer *buffer, uint32_t uc);
+/* Insert n codepoints at the cursor and move the cursor past them. */
+int
+buffer_insert_n(struct buffer *buffer, const uint32_t *ucs, size_t n);
 int
 buffer_left(struct buffer *buffer);
 int
@@ -34,3 +48,6 @@ int
 buffer_delete(struct buffer *buffer);
 int
 buffer_delete_word(struct buffer *buffer);
+/* Delete the codepoints in [start, end) and leave the cursor at start. */
+int
+buffer_delete_range(struct buffer *buffer, size_t start, size_t end);
@@ -2,72 +2,134 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include "input.h"
+#include "width.h"
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <wchar.h>
 
-static const int ch_width = 2; /* Max width of a character. */
+enum {
+	/* Characters inserted by a single buffer_insert_n() call. */
+	INPUT_RUN_MAX = 256,
+};
+
+/* Forget the lines that may have changed after an edit at index. Lines that
+ * start at or before it are kept, as they only depend on the codepoints before
+ * their start. */
+static void
+layout_invalidate(struct input_layout *layout, size_t index) {
+	while (layout->len > 1 && layout->starts[layout->len - 1] > index) {
+		layout->len--;
+	}
 
-static uint32_t
-uc_sanitize(uint32_t uc, int *width) {
-	int tmp_width = wcwidth((wchar_t) uc);
-
-	switch (uc) {
-	case '\n':
-		*width = 0;
-		return uc;
-	case '\t':
-		*width = 1;
-		return ' ';
-	default:
-		if (tmp_width <= 0 || tmp_width > ch_width) {
-			*width = 1;
-			return '?';
+	if (layout->len > 0) {
+		layout->done = layout->starts[layout->len - 1];
+		layout->x = 0;
+	}
+}
+
+/* Lay out lines until the codepoint at index and at least nlines lines are
+ * known, or the buffer ends. */
+static int
+layout_extend(struct input_layout *layout, const struct buffer *buffer,
+			  size_t index, size_t nlines) {
+	if (layout->width != tb_width()) {
+		layout->width = tb_width();
+		layout_invalidate(layout, 0);
+	}
+
+	if (layout->len == 0) {
+		if (!(layout->starts = malloc(sizeof(*layout->starts) * 16))) {
+			return -1;
 		}
 
-		*width = tmp_width;
-		return uc;
+		layout->starts[0] = layout->done = 0;
+		layout->len = 1;
+		layout->cap = 16;
+		layout->x = 0;
 	}
-}
 
-static bool
-should_forcebreak(int width) {
-	return width == 0;
-}
+	int y = 0, width = 0;
 
-static bool
-should_scroll(int x, int width) {
-	return (x >= (tb_width() - width) || should_forcebreak(width));
-}
+	while (layout->done < buffer->len &&
+		   (layout->done < index || layout->len < nlines)) {
+		int advanced = 0;
+		int room = tb_width() - WIDTH_MAX - layout->x;
+		size_t run = 0;
 
-/* Returns the number of times y was advanced. */
-static int
-adjust_xy(int width, int *x, int *y) {
-	int original_y = *y;
+		/* Printable ASCII is a single column wide, so a run of it fills the
+		 * line up to where width_adjust_xy() would break it. */
+		if (room > 0) {
+			size_t len = 0;
+			const uint32_t *span = buffer_span(buffer, layout->done, &len);
 
-	if (should_scroll(*x, width)) {
-		*x = 0;
-		(*y)++;
-	}
+			run = width_ascii_run(span,
+								  len < (size_t) room ? len : (size_t) room);
+		}
+
+		if (run > 0) {
+			layout->done += run;
+			layout->x += (int) run;
+
+			if (layout->x >= (tb_width() - WIDTH_MAX)) {
+				layout->x = 0;
+				advanced = 1;
+			}
+		} else {
+			width_sanitize(buffer_at(buffer, layout->done++), &width);
+			advanced = width_adjust_xy(width, tb_width(), &layout->x, &y);
+		}
+
+		for (; advanced > 0; advanced--) {
+			if (layout->len == layout->cap) {
+				size_t *starts = realloc(
+					layout->starts, sizeof(*starts) * layout->cap * 2);
+
+				if (!starts) {
+					return -1;
+				}
 
-	/* Newline, already scrolled. */
-	if (should_forcebreak(width)) {
-		return *y - original_y;
+				layout->starts = starts;
+				layout->cap *= 2;
+			}
+
+			/* The line starts after the codepoint that broke it. */
+			layout->starts[layout->len++] = layout->done;
+		}
 	}
 
-	*x += width;
+	return 0;
+}
+
+/* Returns the line that the codepoint at index is on, which must be laid
+ * out. */
+static size_t
+layout_line(const struct input_layout *layout, size_t index) {
+	size_t low = 0, high = layout->len;
 
-	/* We must accomodate for another character to move the cursor to the next
-	 * line, which prevents us from adding an unreachable character. */
-	if (should_scroll(*x, ch_width)) {
-		*x = 0;
-		(*y)++;
+	/* The last line starting at or before index. */
+	while ((high - low) > 1) {
+		size_t mid = low + ((high - low) / 2);
+
+		if (layout->starts[mid] <= index) {
+			low = mid;
+		} else {
+			high = mid;
+		}
 	}
 
-	return *y - original_y;
+	return low;
+}
+
+/* All edits happen at the cursor, so the edited range lies between where the
+ * cursor was before the edit and where it is now. */
+static void
+input_edited(struct input *input, size_t cur, size_t len) {
+	if (input->buffer.len != len) {
+		layout_invalidate(&input->layout,
+						  cur < input->buffer.cur ? cur : input->buffer.cur);
+	}
 }
 
 int
@@ -85,28 +147,39 @@ input_init(struct input *input, int input_height) {
 void
 input_finish(struct input *input) {
 	buffer_finish(&input->buffer);
+	free(input->layout.starts);
 
 	memset(input, 0, sizeof(*input));
 }
 
 void
 input_redraw(struct input *input) {
-	tb_clear_buffer();
+	/* Only clear the input field, the rest of the screen is kept. */
+	int top = tb_height() > input->max_height ? tb_height() - input->max_height
+											  : 0;
 
-	int cur_x = 0, cur_line = 1, lines = 1;
+	for (int y = top; y < tb_height(); y++) {
+		for (int x = 0; x < tb_width(); x++) {
+			tb_char(x, y, TB_DEFAULT, TB_DEFAULT, ' ');
+		}
+	}
 
-	{
-		int x = 0, y = 0, width = 0;
+	struct input_layout *layout = &input->layout;
 
-		for (size_t written = 0; written < input->buffer.len; written++) {
-			uc_sanitize(input->buffer.buf[written], &width);
+	if ((layout_extend(layout, &input->buffer, input->buffer.cur, 0)) == -1) {
+		return;
+	}
 
-			lines += adjust_xy(width, &x, &y);
+	/* Lines are 1-indexed here. */
+	size_t cur_start = layout->starts[layout_line(layout, input->buffer.cur)];
+	int cur_x = 0, cur_line = (int) layout_line(layout, input->buffer.cur) + 1;
 
-			if ((written + 1) == input->buffer.cur) {
-				cur_x = x;
-				cur_line = lines;
-			}
+	{
+		int y = 0, width = 0;
+
+		for (size_t i = cur_start; i < input->buffer.cur; i++) {
+			width_sanitize(buffer_at(&input->buffer, i), &width);
+			width_adjust_xy(width, tb_width(), &cur_x, &y);
 		}
 	}
 
@@ -128,43 +201,35 @@ input_redraw(struct input *input) {
 		}
 	}
 
+	/* Don't lay out more lines than will be visible. */
+	if ((layout_extend(layout, &input->buffer, input->buffer.cur,
+					   (size_t) (input->line_off + input->max_height))) == -1) {
+		return;
+	}
+
+	int lines = (int) layout->len;
+
 	assert(input->line_off >= 0);
 	assert(input->cur_y >= 0);
 	assert(input->cur_y < input->max_height);
 	assert(input->line_off < lines);
 
-	if (!input->line_off) {
-		/* Prevent overflow if the cursor if on the first line and input would
-		 * take more than the available lines to represent. */
-		lines = lines > input->max_height ? input->max_height : lines;
-	} else {
-		/* Don't write more lines than will be visible. */
-		lines = (input->line_off + input->max_height) < lines
-					? input->line_off + input->max_height
-					: lines;
-	}
+	/* Prevent overflow if the input would take more than the available lines
+	 * to represent. */
+	lines = (input->line_off + input->max_height) < lines
+				? input->line_off + input->max_height
+				: lines;
 
 	assert(input->line_off < lines);
 
 	input->last_cur_line = cur_line;
 
-	int width = 0, line = 0;
+	int width = 0, line = input->line_off;
 
-	size_t written = 0;
+	size_t written = layout->starts[line];
 
 	uint32_t uc = 0;
 
-	/* Calculate starting index. */
-	for (int x = 0, y = 0; written < input->buffer.len; written++) {
-		if (line == input->line_off) {
-			break;
-		}
-
-		uc_sanitize(input->buffer.buf[written], &width);
-
-		line += adjust_xy(width, &x, &y);
-	}
-
 	int x = 0;
 	int y = tb_height() - (input->line_off ? input->max_height : lines);
 
@@ -178,14 +243,14 @@ input_redraw(struct input *input) {
 		assert(y < tb_height());
 		assert((tb_height() - y) <= input->max_height);
 
-		uc = uc_sanitize(input->buffer.buf[written++], &width);
+		uc = width_sanitize(buffer_at(&input->buffer, written++), &width);
 
 		/* Don't print newlines directly as they mess up the screen. */
-		if (!should_forcebreak(width)) {
+		if (!width_forcebreak(width)) {
 			tb_char(x, y, TB_DEFAULT, TB_DEFAULT, uc);
 		}
 
-		line += adjust_xy(width, &x, &y);
+		line += width_adjust_xy(width, tb_width(), &x, &y);
 	}
 }
 
@@ -196,8 +261,8 @@ input_set_initial_cursor(struct input *input) {
 	tb_set_cursor(0, tb_height() - 1);
 }
 
-int
-input_event(struct tb_event event, struct input *input) {
+static int
+input_event_edit(struct tb_event event, struct input *input) {
 	if (!event.key && event.ch) {
 		return buffer_add(&input->buffer, event.ch);
 	}
@@ -235,3 +300,65 @@ input_event(struct tb_event event, struct input *input) {
 		return INPUT_NOOP;
 	}
 }
+
+int
+input_event(struct tb_event event, struct input *input) {
+	size_t cur = input->buffer.cur, len = input->buffer.len;
+	int ret = input_event_edit(event, input);
+
+	input_edited(input, cur, len);
+
+	return ret;
+}
+
+/* Returns the character that the event inserts, or 0 if it doesn't. */
+static uint32_t
+event_char(struct tb_event event) {
+	if (!event.key && event.ch) {
+		return event.ch;
+	}
+
+	return event.key == TB_KEY_SPACE ? ' ' : 0;
+}
+
+static int
+max_action(int a, int b) {
+	return a > b ? a : b;
+}
+
+int
+input_events(const struct tb_event *events, size_t n, struct input *input) {
+	uint32_t run[INPUT_RUN_MAX];
+	size_t run_len = 0;
+	int action = INPUT_NOOP;
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t uc = event_char(events[i]);
+
+		if (uc) {
+			run[run_len++] = uc;
+		}
+
+		if (run_len > 0 &&
+			(!uc || run_len == INPUT_RUN_MAX || (i + 1) == n)) {
+			size_t cur = input->buffer.cur, len = input->buffer.len;
+
+			action = max_action(
+				action, buffer_insert_n(&input->buffer, run, run_len));
+			input_edited(input, cur, len);
+			run_len = 0;
+		}
+
+		if (!uc) {
+			int ret = input_event(events[i], input);
+
+			if (ret == INPUT_GOT_SHUTDOWN) {
+				return ret;
+			}
+
+			action = max_action(action, ret);
+		}
+	}
+
+	return action;
+}
@@ -5,8 +5,21 @@
 #include "buffer.h"
 #include "termbox.h"
 
+/* Where the lines of the wrapped buffer start. Lines are laid out lazily, only
+ * as far as the cursor and the visible lines, and discarded from the first
+ * edited codepoint onward, so redraws don't walk the whole buffer. */
+struct input_layout {
+	size_t *starts; /* The index of the first codepoint of each line. */
+	size_t len;		/* Lines laid out. */
+	size_t cap;
+	size_t done; /* Codepoints laid out. */
+	int x;		 /* Where the codepoint at done goes. */
+	int width;	 /* The terminal width that the lines were laid out for. */
+};
+
 struct input {
 	struct buffer buffer;
+	struct input_layout layout;
 	int max_height;
 	int line_off; /* The number of lines to skip when rendering the buffer. */
 	int last_cur_line; /* The "line" where the cursor was placed in the last
@@ -32,3 +45,7 @@ void
 input_set_initial_cursor(struct input *input);
 int
 input_event(struct tb_event event, struct input *input);
+/* Handle key events that arrived together. Runs of characters, as in a paste,
+ * are inserted at once. Returns the most significant action of all events. */
+int
+input_events(const struct tb_event *events, size_t n, struct input *input);
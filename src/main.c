@@ -1,16 +1,25 @@
 /* SPDX-FileCopyrightText: 2021 git-bruh
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include "cJSON.h"
 #include "input.h"
 #include "log.h"
 #include "matrix.h"
+#include "timeline.h"
 #include <assert.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <langinfo.h>
 #include <locale.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #if 1
 #define MXID "@testuser:localhost"
@@ -23,89 +32,585 @@
 #endif
 
 #define LOG_PATH "/tmp/" CLIENT_NAME ".log"
+#define CACHE_NAME CLIENT_NAME ".cache"
 
 #define ERRLOG(cond, ...) (!(cond) ? (log_fatal(__VA_ARGS__), true) : false)
 
+enum timer {
+	TIMER_SYNC_RESTART,
+	TIMER_FRAME,
+	TIMER_MAX,
+};
+
 struct state {
 	char *current_room;
+	char *next_batch; /* Where to resume the sync from if it fails. */
+	char *cache_path; /* nullable, NULL if there's nowhere to cache. */
 	FILE *log_fp;
+	int tty_fd; /* Where termbox reads keys from, closed by tb_shutdown(). */
 	struct matrix *matrix;
 	struct input input;
+	struct timeline timeline; /* Of current_room. */
+	long long timers[TIMER_MAX]; /* Monotonic deadlines in ms, -1 if unset. */
+	long long last_frame;
+	int restart_delay;
+	bool input_damaged; /* The input field must be redrawn in the next frame. */
+	bool paginating;	 /* Older events of current_room are being fetched. */
+	bool history_failed; /* Don't fetch them again until the next scroll. */
+	sigset_t wait_mask; /* The signal mask while waiting in loop(). */
 };
 
-static const int input_height = 5;
-static const unsigned sync_timeout = 1000;
+enum {
+	/* The tty and curl's sockets, usually just a connection or two. */
+	MAX_POLLFDS = 16,
+	/* Key events handled at once, a paste arrives as one per character. */
+	INPUT_EVENTS_MAX = 1024,
+	/* Back off exponentially between these when the connection is lost. */
+	RESTART_DELAY_MIN = 1000,
+	RESTART_DELAY_MAX = 60000,
+	/* Draw at most one frame per display interval. */
+	FRAME_INTERVAL_MS = 16,
+	/* Older events fetched at once when the pane reaches the oldest one. */
+	HISTORY_PAGE = 50,
+};
 
-static void
-redraw(struct state *state) {
-	input_redraw(&state->input);
-	tb_render();
-}
+static volatile sig_atomic_t got_sigterm = 0;
+
+static const int input_height = 5;
+/* Input is polled alongside the sync, so this doesn't affect latency. */
+static const unsigned sync_timeout = 30000;
+static const struct matrix_sync_filter sync_filter = {
+	.timeline_limit = 50,
+	.lazy_load_members = true,
+	.known_types_only = true,
+};
 
 static void
 cleanup(struct state *state) {
-#if 0
+	free(state->current_room);
+	free(state->next_batch);
+	free(state->cache_path);
+	timeline_finish(&state->timeline);
 	input_finish(&state->input);
-#endif
 	matrix_destroy(state->matrix);
 
-#if 0
 	tb_shutdown();
-#endif
 	matrix_global_cleanup();
 
 	fclose(state->log_fp);
 }
 
+/* In $XDG_CACHE_HOME, or ~/.cache if it isn't set. The cache holds private
+ * room state, so it never goes in a shared directory. */
+static char *
+cache_path_create(void) {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *dir = NULL;
+
+	/* Relative paths are invalid and must be ignored. */
+	if (xdg && *xdg == '/') {
+		dir = strdup(xdg);
+	} else if (home && *home == '/' &&
+			   (asprintf(&dir, "%s/.cache", home)) == -1) {
+		dir = NULL;
+	}
+
+	if (!dir) {
+		return NULL;
+	}
+
+	char *path = NULL;
+
+	if (((mkdir(dir, 0700)) == -1 && errno != EEXIST) ||
+		(asprintf(&path, "%s/" CACHE_NAME, dir)) == -1) {
+		path = NULL;
+	}
+
+	free(dir);
+
+	return path;
+}
+
+static long long
+now_ms(void) {
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void
+timer_set(struct state *state, enum timer timer, int delay) {
+	state->timers[timer] = now_ms() + delay;
+}
+
+/* Coalesce the changes until the next display interval into one frame. */
+static void
+frame_request(struct state *state) {
+	if (state->timers[TIMER_FRAME] == -1) {
+		long long delay = state->last_frame + FRAME_INTERVAL_MS - now_ms();
+
+		timer_set(state, TIMER_FRAME, delay > 0 ? (int) delay : 0);
+	}
+}
+
+/* token fetches the events before this one. */
+/* nullable: token */
+static int
+add_event(struct state *state, const struct matrix_timeline_event *tevent,
+		  const char *token) {
+	switch (tevent->type) {
+	case MATRIX_ROOM_MESSAGE:
+		return timeline_add(&state->timeline, tevent->message.base.event_id,
+							tevent->message.base.sender, tevent->message.body,
+							token);
+	case MATRIX_ROOM_REDACTION:
+		return timeline_redact(&state->timeline, tevent->redaction.redacts);
+	case MATRIX_ROOM_ATTACHMENT:
+		return timeline_add(
+			&state->timeline, tevent->attachment.base.event_id,
+			tevent->attachment.base.sender, tevent->attachment.body, token);
+	default:
+		assert(0);
+	}
+
+	return 0;
+}
+
+/* Show the newest events of the current room again from the store, after the
+ * timeline evicted them to make room for older ones. */
+static void
+timeline_refill(struct state *state) {
+	size_t len = matrix_store_timeline_len(state->matrix, state->current_room);
+
+	timeline_clear(&state->timeline);
+
+	for (size_t i = 0; i < len; i++) {
+		struct matrix_timeline_event tevent;
+		const char *gap = NULL;
+
+		if ((matrix_store_timeline_get(state->matrix, state->current_room, i,
+									   &tevent, &gap)) != 0 ||
+			(add_event(state, &tevent, gap)) == -1) {
+			log_warn("Failed to show the newest events.");
+			break;
+		}
+	}
+}
+
+static void
+paginate_cb(struct matrix *matrix, struct matrix_room *room, void *userp) {
+	(void) matrix;
+
+	struct state *state = userp;
+
+	state->paginating = false;
+
+	if (!room) {
+		log_warn("Failed to fetch older events.");
+		state->history_failed = true;
+		return;
+	}
+
+	if (!state->current_room || (strcmp(state->current_room, room->id))) {
+		return;
+	}
+
+	/* Newest first, redacted events are already redacted in the history. */
+	struct timeline_message messages[HISTORY_PAGE];
+	struct matrix_timeline_event tevent;
+	size_t len = 0;
+
+	while (len < HISTORY_PAGE &&
+		   (matrix_sync_next(room, &tevent)) == MATRIX_SUCCESS) {
+		if (tevent.type == MATRIX_ROOM_MESSAGE) {
+			messages[len++] = (struct timeline_message){
+				tevent.message.base.event_id,
+				tevent.message.base.sender,
+				tevent.message.body,
+			};
+		} else if (tevent.type == MATRIX_ROOM_ATTACHMENT) {
+			messages[len++] = (struct timeline_message){
+				tevent.attachment.base.event_id,
+				tevent.attachment.base.sender,
+				tevent.attachment.body,
+			};
+		}
+	}
+
+	if ((timeline_add_older(&state->timeline, messages, len,
+							room->timeline.prev_batch)) == -1) {
+		log_warn("Failed to add older events to the timeline.");
+		state->history_failed = true;
+	}
+
+	frame_request(state);
+}
+
+/* Fetch older events once the pane shows the oldest one, and show the newest
+ * ones again once the pane follows them. */
+static void
+history_update(struct state *state) {
+	if (state->paginating || !state->current_room) {
+		return;
+	}
+
+	if (state->timeline.detached && !state->timeline.scrolled) {
+		timeline_refill(state);
+		frame_request(state);
+		return;
+	}
+
+	const char *token = timeline_history_token(&state->timeline);
+
+	if (!state->history_failed && token &&
+		timeline_top_visible(&state->timeline)) {
+		enum matrix_code code =
+			matrix_paginate(state->matrix, state->current_room, token,
+							HISTORY_PAGE, paginate_cb, state);
+
+		state->paginating = code == MATRIX_SUCCESS;
+		state->history_failed = !state->paginating;
+	}
+}
+
+/* Draw what changed since the last frame. */
+static void
+frame(struct state *state) {
+	if (state->input_damaged) {
+		input_redraw(&state->input);
+		state->input_damaged = false;
+	}
+
+	if ((timeline_redraw(&state->timeline, tb_height() - input_height)) ==
+		-1) {
+		log_warn("Failed to redraw the timeline.");
+	}
+
+	tb_render();
+
+	state->last_frame = now_ms();
+
+	history_update(state);
+}
+
+/* Scroll the timeline by a page, keeping a line of the last one in view. */
+static void
+scroll_page(struct state *state, int direction) {
+	/* The rows of the pane that show events. */
+	int page = tb_height() - input_height - 1;
+
+	timeline_scroll(&state->timeline, direction * (page > 2 ? page - 1 : 1));
+	state->history_failed = false;
+	frame_request(state);
+}
+
+/* Handle all pending terminal events without blocking. Key events are handled
+ * in batches so that a paste is inserted at once, and the screen is redrawn
+ * once in the next frame. */
 static bool
 input(struct state *state) {
-	struct tb_event event = {0};
+	struct tb_event events[INPUT_EVENTS_MAX];
+	size_t nevents = 0;
+	bool need_redraw = false;
+
+	for (bool more = true; more;) {
+		more = (tb_peek_event(&events[nevents], 0)) > 0;
+
+		if (more) {
+			switch (events[nevents].type) {
+			case TB_EVENT_KEY:
+				if (events[nevents].key == TB_KEY_PGUP) {
+					scroll_page(state, -1);
+				} else if (events[nevents].key == TB_KEY_PGDN) {
+					scroll_page(state, 1);
+				} else {
+					nevents++;
+				}
+				break;
+			case TB_EVENT_RESIZE:
+				/* termbox clears the screen. */
+				timeline_invalidate(&state->timeline);
+				need_redraw = true;
+				break;
+			default:
+				break;
+			}
+		}
 
-	if ((tb_peek_event(&event, 0)) != -1) {
-		switch (event.type) {
-		case TB_EVENT_KEY:
-			switch ((input_event(event, &state->input))) {
+		if (nevents == INPUT_EVENTS_MAX || (!more && nevents > 0)) {
+			switch ((input_events(events, nevents, &state->input))) {
 			case INPUT_NOOP:
 				break;
 			case INPUT_GOT_SHUTDOWN:
 				return false;
 			case INPUT_NEED_REDRAW:
-				redraw(state);
+				need_redraw = true;
 				break;
 			default:
 				assert(0);
 			}
 
-			break;
-		case TB_EVENT_RESIZE:
-			redraw(state);
+			nevents = 0;
+		}
+	}
+
+	if (need_redraw) {
+		state->input_damaged = true;
+		frame_request(state);
+	}
+
+	return true;
+}
+
+static bool
+syncing(const struct state *state) {
+	return state->timers[TIMER_SYNC_RESTART] == -1;
+}
+
+/* The delay is reset once a response arrives in sync_cb. */
+static void
+sync_schedule_restart(struct state *state) {
+	log_warn("Lost connection to homeserver, retrying in %d ms.",
+			 state->restart_delay);
+
+	timer_set(state, TIMER_SYNC_RESTART, state->restart_delay);
+
+	if (state->restart_delay < (RESTART_DELAY_MAX / 2)) {
+		state->restart_delay *= 2;
+	} else {
+		state->restart_delay = RESTART_DELAY_MAX;
+	}
+}
+
+static void
+sync_restart(struct state *state) {
+	if ((matrix_sync_start(state->matrix, state->next_batch, sync_timeout)) !=
+		MATRIX_SUCCESS) {
+		sync_schedule_restart(state);
+	}
+}
+
+static void (*const timer_cbs[TIMER_MAX])(struct state *) = {
+	[TIMER_SYNC_RESTART] = sync_restart,
+	[TIMER_FRAME] = frame,
+};
+
+static void
+timers_run(struct state *state) {
+	long long now = now_ms();
+
+	for (size_t i = 0; i < TIMER_MAX; i++) {
+		if (state->timers[i] != -1 && now >= state->timers[i]) {
+			state->timers[i] = -1;
+			timer_cbs[i](state);
+		}
+	}
+}
+
+/* Returns the milliseconds until the next timer expires or timeout, whichever
+ * is earlier. */
+static int
+timers_timeout(const struct state *state, int timeout) {
+	long long now = now_ms();
+
+	for (size_t i = 0; i < TIMER_MAX; i++) {
+		if (state->timers[i] != -1) {
+			long long left =
+				state->timers[i] > now ? state->timers[i] - now : 0;
+
+			if (timeout == -1 || left < timeout) {
+				timeout = (int) left;
+			}
+		}
+	}
+
+	return timeout;
+}
+
+static void
+sigterm_handler(int sig) {
+	(void) sig;
+
+	got_sigterm = 1;
+}
+
+/* SIGWINCH (Which termbox handles) and SIGTERM are only unblocked while
+ * waiting in ppoll(), so a signal that arrives between two waits stays pending
+ * and interrupts the next one instead of being missed until other input. */
+static int
+signals_init(struct state *state) {
+	sigset_t mask;
+
+	if ((sigemptyset(&mask)) == -1 || (sigaddset(&mask, SIGWINCH)) == -1 ||
+		(sigaddset(&mask, SIGTERM)) == -1 ||
+		(sigprocmask(SIG_BLOCK, &mask, &state->wait_mask)) == -1 ||
+		(sigdelset(&state->wait_mask, SIGWINCH)) == -1 ||
+		(sigdelset(&state->wait_mask, SIGTERM)) == -1) {
+		return -1;
+	}
+
+	struct sigaction action = {.sa_handler = sigterm_handler};
+
+	return sigaction(SIGTERM, &action, NULL);
+}
+
+/* Wait on the terminal, the homeserver connection, signals and timers
+ * together, sleeping until one of them is ready. */
+static enum matrix_code
+loop(struct state *state) {
+	struct pollfd fds[MAX_POLLFDS];
+
+	for (;;) {
+		timers_run(state);
+
+		fds[0] = (struct pollfd){.fd = state->tty_fd, .events = POLLIN};
+
+		size_t nfds = 0;
+		int timeout = -1;
+
+		/* Nothing to wait on for libmatrix until the sync is restarted. */
+		if (syncing(state)) {
+			nfds =
+				matrix_get_pollfds(state->matrix, &fds[1], MAX_POLLFDS - 1);
+			timeout = matrix_get_timeout(state->matrix);
+
+			if (nfds > (MAX_POLLFDS - 1)) {
+				log_warn("Too many sockets to poll (%zu), ignoring some.",
+						 nfds);
+				nfds = MAX_POLLFDS - 1;
+			}
+		}
+
+		timeout = timers_timeout(state, timeout);
+
+		struct timespec ts = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (timeout % 1000) * 1000000L,
+		};
+
+		if ((ppoll(fds, nfds + 1, timeout != -1 ? &ts : NULL,
+				   &state->wait_mask)) == -1 &&
+			errno != EINTR) {
+			return MATRIX_CURL_FAILURE;
+		}
+
+		if (got_sigterm) {
+			return MATRIX_SUCCESS;
+		}
+
+		/* termbox reports resizes through its own pipe, also drain on EINTR
+		 * to pick them up. */
+		if (!(input(state))) {
+			return MATRIX_SUCCESS;
+		}
+
+		if (!syncing(state)) {
+			continue;
+		}
+
+		enum matrix_code code =
+			matrix_perform_step(state->matrix, &fds[1], nfds);
+
+		if (code == MATRIX_NOMEM) {
+			return code;
+		}
+
+		if (code != MATRIX_SUCCESS) {
+			sync_schedule_restart(state);
+		}
+	}
+}
+
+/* Show who is typing in the typing row of the timeline. */
+static int
+set_typing(struct state *state, const struct matrix_room_typing *typing) {
+	int len = cJSON_GetArraySize(typing->user_ids);
+	const char *user_id =
+		cJSON_GetStringValue(cJSON_GetArrayItem(typing->user_ids, 0));
+	char *text = NULL;
+
+	if (len == 0 || (len == 1 && !user_id)) {
+		return timeline_set_typing(&state->timeline, NULL);
+	}
+
+	if ((len == 1 ? asprintf(&text, "%s is typing...", user_id)
+				  : asprintf(&text, "%d people are typing...", len)) == -1) {
+		return -1;
+	}
+
+	int ret = timeline_set_typing(&state->timeline, text);
+
+	free(text);
+
+	return ret;
+}
+
+/* Add the events of the current room to the timeline. */
+static int
+update_timeline(struct state *state, struct matrix_room *room) {
+	struct matrix_timeline_event tevent;
+	struct matrix_ephemeral_event eevent;
+	/* prev_batch fetches the events before the first one. */
+	const char *token = room->timeline.prev_batch;
+	int ret = 0;
+
+	while (ret == 0 && (matrix_sync_next(room, &tevent)) == MATRIX_SUCCESS) {
+		ret = add_event(state, &tevent, token);
+
+		if (tevent.type != MATRIX_ROOM_REDACTION) {
+			token = NULL;
+		}
+	}
+
+	while (ret == 0 && (matrix_sync_next(room, &eevent)) == MATRIX_SUCCESS) {
+		switch (eevent.type) {
+		case MATRIX_ROOM_TYPING:
+			ret = set_typing(state, &eevent.typing);
 			break;
 		default:
-			break;
+			assert(0);
 		}
 	}
 
-	return true;
+	return ret;
 }
 
 static void
 sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
+	struct state *state = matrix_userdata(matrix);
 	struct matrix_room room;
 
+	state->restart_delay = RESTART_DELAY_MIN;
+
 	while ((matrix_sync_next(response, &room)) == MATRIX_SUCCESS) {
-		struct matrix_timeline_event tevent;
+		/* Show the first joined room until rooms can be switched. */
+		if (!state->current_room && room.type == MATRIX_ROOM_JOIN &&
+			!(state->current_room = strdup(room.id))) {
+			log_warn("Failed to select room '%s'.", room.id);
+		}
 
-		while ((matrix_sync_next(&room, &tevent)) == MATRIX_SUCCESS) {
-			switch (tevent.type) {
-			case MATRIX_ROOM_MESSAGE:
-				break;
-			case MATRIX_ROOM_REDACTION:
-				break;
-			case MATRIX_ROOM_ATTACHMENT:
-				break;
-			default:
-				assert(0);
-			}
+		if (!state->current_room || (strcmp(state->current_room, room.id))) {
+			continue;
+		}
+
+		if ((update_timeline(state, &room)) == -1) {
+			log_warn("Failed to add events to the timeline.");
+		}
+
+		frame_request(state);
+	}
+
+	if (response->next_batch &&
+		(!state->next_batch ||
+		 (strcmp(state->next_batch, response->next_batch)))) {
+		char *next_batch = strdup(response->next_batch);
+
+		if (next_batch) {
+			free(state->next_batch);
+			state->next_batch = next_batch;
 		}
 	}
 }
@@ -118,7 +623,10 @@ main() {
 		return EXIT_FAILURE;
 	}
 
-	struct state state = {0};
+	struct state state = {
+		.timers = {[TIMER_SYNC_RESTART] = -1, [TIMER_FRAME] = -1},
+		.restart_delay = RESTART_DELAY_MIN,
+	};
 
 	{
 		FILE *log_fp = fopen(LOG_PATH, "w");
@@ -127,18 +635,21 @@ main() {
 			return EXIT_FAILURE;
 		}
 
-#if 0
 		bool success = false;
 
-		switch ((tb_init())) {
+		/* Opened here rather than by termbox so that loop() can wait on it,
+		 * stdin may be redirected. */
+		int tty_fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+
+		switch (tty_fd != -1 ? tb_init_fd(tty_fd) : TB_EFAILED_TO_OPEN_TTY) {
 		case TB_EUNSUPPORTED_TERMINAL:
-			ERRLOG(0, "Unsupported terminal. Is TERM set ?");
+			(void) ERRLOG(0, "Unsupported terminal. Is TERM set ?");
 			break;
 		case TB_EFAILED_TO_OPEN_TTY:
-			ERRLOG(0, "Failed to open TTY.");
+			(void) ERRLOG(0, "Failed to open TTY.");
 			break;
 		case TB_EPIPE_TRAP_ERROR:
-			ERRLOG(0, "Failed to create pipe.");
+			(void) ERRLOG(0, "Failed to create pipe.");
 			break;
 		case 0:
 			success = true;
@@ -148,37 +659,53 @@ main() {
 		}
 
 		if (!success) {
+			if (tty_fd != -1) {
+				close(tty_fd);
+			}
+
 			fclose(log_fp);
 			return EXIT_FAILURE;
 		}
-#endif
 
 		state.log_fp = log_fp;
+		state.tty_fd = tty_fd;
 	}
 
 	if (!ERRLOG(log_add_fp(state.log_fp, LOG_TRACE) == 0,
 				"Failed to initialize logging callbacks.") &&
+		!ERRLOG(signals_init(&state) == 0, "Failed to set up signals.") &&
 		!ERRLOG(matrix_global_init() == 0,
 				"Failed to initialize matrix globals.") &&
-#if 0
 		!ERRLOG(input_init(&state.input, input_height) == 0,
-					 "Failed to initialize input layer.") &&
-#endif
+				"Failed to initialize input layer.") &&
+		!ERRLOG(timeline_init(&state.timeline) == 0,
+				"Failed to initialize the timeline.") &&
 		!ERRLOG(state.matrix = matrix_alloc(sync_cb, MXID, HOMESERVER, &state),
-				"Failed to initialize libmatrix.")) {
-#if 0
+				"Failed to initialize libmatrix.") &&
+		!ERRLOG(matrix_set_cache(state.matrix,
+								 (state.cache_path = cache_path_create())) == 0,
+				"Failed to open the cache '%s'.",
+				state.cache_path ? state.cache_path : "")) {
+		matrix_set_store(state.matrix, true);
 		input_set_initial_cursor(&state.input);
-		redraw(&state);
-#endif
+		state.input_damaged = true;
+		frame(&state);
 
 		if (!ERRLOG(matrix_login(state.matrix, PASS, NULL) == MATRIX_SUCCESS,
 					"Failed to login.")) {
-#if 0
-			while ((input(&state))) {
-				/* Loop until Ctrl+C */
+			if ((matrix_set_sync_filter(state.matrix, &sync_filter)) !=
+				MATRIX_SUCCESS) {
+				log_warn("Failed to set the sync filter, syncing without it.");
 			}
-#endif
-			switch ((matrix_sync_forever(state.matrix, sync_timeout))) {
+
+			enum matrix_code code =
+				matrix_sync_start(state.matrix, NULL, sync_timeout);
+
+			if (code == MATRIX_SUCCESS) {
+				code = loop(&state); /* Loop until Ctrl+C or SIGTERM */
+			}
+
+			switch (code) {
 			case MATRIX_NOMEM:
 				(void) ERRLOG(0, "Out of memory!");
 				break;
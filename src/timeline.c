@@ -0,0 +1,774 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "timeline.h"
+#include "termbox.h"
+#include "width.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A redraw maps the rows of the pane to the lines of the events that fill it,
+ * and compares that with what each row showed before. The version of the
+ * event is part of what a row shows, so a redaction damages the rows of the
+ * event even if they still show the same lines.
+ *
+ * The line counts of the events are kept in a Fenwick tree, so that the line
+ * that an event starts at and the event at a line are found in O(log n) however
+ * long the history is. Only the events that a redraw walks over are wrapped.
+ * After a resize the counts of the others are those of the old width until
+ * they're shown, which only makes scroll offsets into them approximate.
+ *
+ * Older events are inserted in front and the tree is rebuilt in O(n), which a
+ * page of events costs anyway to move the others. Memory is bounded by
+ * evicting events in batches from the end that is farther from the pane. An
+ * event keeps the token that fetches what came before it, and only events
+ * with one are made the oldest, so the evicted events can be fetched again. */
+
+enum {
+	TIMELINE_INITIAL = 64,
+	TIMELINE_MAX = 4096,
+	TIMELINE_EVICT = 512,
+	UC_REPLACEMENT = 0xFFFD,
+};
+
+static const char *const redacted = "<redacted>";
+static const char *const separator = ": ";
+
+/* Decode the string into ucs, which must have room for strlen(s) codepoints.
+ * Invalid sequences are replaced. Returns the number of codepoints. */
+static size_t
+utf8_decode(const char *s, uint32_t *ucs) {
+	const unsigned char *p = (const unsigned char *) s;
+	size_t n = 0;
+
+	while (*p) {
+		unsigned char c = *p++;
+		uint32_t uc = 0, min = 0;
+		int more = 0;
+
+		if (c < 0x80) {
+			ucs[n++] = c;
+			continue;
+		}
+
+		if ((c & 0xE0) == 0xC0) {
+			uc = c & 0x1FU;
+			more = 1;
+			min = 0x80;
+		} else if ((c & 0xF0) == 0xE0) {
+			uc = c & 0x0FU;
+			more = 2;
+			min = 0x800;
+		} else if ((c & 0xF8) == 0xF0) {
+			uc = c & 0x07U;
+			more = 3;
+			min = 0x10000;
+		} else {
+			ucs[n++] = UC_REPLACEMENT;
+			continue;
+		}
+
+		for (; more > 0 && (*p & 0xC0) == 0x80; more--) {
+			uc = (uc << 6) | (*p++ & 0x3FU);
+		}
+
+		ucs[n++] = (more > 0 || uc < min || uc > 0x10FFFF ||
+					(uc >= 0xD800 && uc <= 0xDFFF))
+					   ? UC_REPLACEMENT
+					   : uc;
+	}
+
+	return n;
+}
+
+/* Returns "sender: body" as codepoints, with the length of "sender: " in
+ * prefix. */
+static uint32_t *
+make_text(const char *sender, const char *body, size_t *len, size_t *prefix) {
+	size_t max = strlen(sender) + strlen(separator) + strlen(body);
+	uint32_t *text = malloc((max > 0 ? max : 1) * sizeof(*text));
+
+	if (!text) {
+		return NULL;
+	}
+
+	*prefix = utf8_decode(sender, text);
+	*prefix += utf8_decode(separator, &text[*prefix]);
+	*len = *prefix + utf8_decode(body, &text[*prefix]);
+
+	return text;
+}
+
+/* Returns the number of lines that the text wraps to at cols columns. */
+static int
+count_lines(const uint32_t *text, size_t len, int cols) {
+	int x = 0, y = 0, width = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		width_sanitize(text[i], &width);
+		width_adjust_xy(width, cols, &x, &y);
+	}
+
+	/* Nothing was put on the line that the last character wrapped to. */
+	return (x == 0 && y > 0) ? y : y + 1;
+}
+
+static size_t
+lowbit(size_t i) {
+	return i & (~i + 1);
+}
+
+/* Returns the number of lines of the events before index. */
+static size_t
+lines_before(const struct timeline *timeline, size_t index) {
+	size_t sum = 0;
+
+	for (size_t i = index; i > 0; i -= lowbit(i)) {
+		sum += timeline->tree[i];
+	}
+
+	return sum;
+}
+
+/* Returns the event that the line is on and sets offset to the line within
+ * it. line must be less than the lines of all events. */
+static size_t
+find_line(const struct timeline *timeline, size_t line, size_t *offset) {
+	size_t index = 0, step = 1;
+
+	while (step <= (timeline->len / 2)) {
+		step *= 2;
+	}
+
+	/* Descend the tree, skipping whole subtrees that end before the line. */
+	for (; step > 0; step /= 2) {
+		if ((index + step) <= timeline->len &&
+			timeline->tree[index + step] <= line) {
+			index += step;
+			line -= timeline->tree[index];
+		}
+	}
+
+	*offset = line;
+
+	return index;
+}
+
+static void
+set_lines(struct timeline *timeline, size_t index, int lines) {
+	/* Sums wrap around like the difference does. */
+	size_t delta = (size_t) lines - (size_t) timeline->events[index].lines;
+
+	for (size_t i = index + 1; i <= timeline->len; i += lowbit(i)) {
+		timeline->tree[i] += delta;
+	}
+
+	timeline->events[index].lines = lines;
+}
+
+/* Returns the lines of the event, wrapping it again if the width changed. */
+static int
+event_lines(struct timeline *timeline, size_t index) {
+	struct timeline_event *event = &timeline->events[index];
+
+	if (event->width != timeline->width) {
+		set_lines(timeline, index,
+				  count_lines(event->text, event->len, timeline->width));
+		event->width = timeline->width;
+	}
+
+	return event->lines;
+}
+
+static size_t
+total_lines(const struct timeline *timeline) {
+	return lines_before(timeline, timeline->len);
+}
+
+/* Fill the tree from the lines of every event in O(n), each node adds its sum
+ * to the node of its parent range. */
+static void
+tree_build(struct timeline *timeline) {
+	for (size_t i = 1; i <= timeline->len; i++) {
+		timeline->tree[i] = (size_t) timeline->events[i - 1].lines;
+	}
+
+	for (size_t i = 1; i <= timeline->len; i++) {
+		size_t parent = i + lowbit(i);
+
+		if (parent <= timeline->len) {
+			timeline->tree[parent] += timeline->tree[i];
+		}
+	}
+}
+
+static int
+reserve(struct timeline *timeline, size_t len) {
+	size_t cap = timeline->cap;
+
+	while (cap < len) {
+		if (cap > (SIZE_MAX / sizeof(*timeline->events) / 2)) {
+			return -1;
+		}
+
+		cap *= 2;
+	}
+
+	if (cap == timeline->cap) {
+		return 0;
+	}
+
+	struct timeline_event *events =
+		realloc(timeline->events, cap * sizeof(*timeline->events));
+
+	if (!events) {
+		return -1;
+	}
+
+	timeline->events = events;
+
+	size_t *tree = realloc(timeline->tree, (cap + 1) * sizeof(*timeline->tree));
+
+	if (!tree) {
+		return -1;
+	}
+
+	timeline->tree = tree;
+	timeline->cap = cap;
+
+	return 0;
+}
+
+/* nullable: token */
+static int
+event_init(struct timeline_event *event, int width, const char *event_id,
+		   const char *sender, const char *body, const char *token) {
+	*event = (struct timeline_event){0};
+
+	if (!(event->event_id = strdup(event_id)) ||
+		(token && !(event->token = strdup(token))) ||
+		!(event->text = make_text(sender, body, &event->len, &event->prefix))) {
+		free(event->event_id);
+		free(event->token);
+		return -1;
+	}
+
+	/* Until the first redraw there's no width to wrap at. */
+	event->lines = width > 0 ? count_lines(event->text, event->len, width) : 1;
+	event->width = width;
+
+	return 0;
+}
+
+static void
+event_finish(struct timeline_event *event) {
+	free(event->event_id);
+	free(event->token);
+	free(event->text);
+}
+
+/* The rows of the pane that show events, the last one shows who's typing. */
+static size_t
+view_rows(const struct timeline *timeline) {
+	return timeline->height > 1 ? (size_t) (timeline->height - 1) : 0;
+}
+
+/* The events in [begin, end) moved to offset, the rows that showed other
+ * events must be drawn again. */
+static void
+rows_move(struct timeline *timeline, size_t begin, size_t end, size_t offset) {
+	for (size_t y = 0; timeline->rows && y < view_rows(timeline); y++) {
+		struct timeline_row *row = &timeline->rows[y];
+
+		if (row->event == SIZE_MAX) {
+			continue;
+		}
+
+		if (row->event >= begin && row->event < end) {
+			row->event = row->event - begin + offset;
+		} else {
+			*row = (struct timeline_row){.event = SIZE_MAX, .line = -1};
+		}
+	}
+}
+
+/* Remove the events in [begin, end), which are the oldest or the newest ones
+ * and never those that the pane is anchored to. */
+static void
+evict(struct timeline *timeline, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++) {
+		event_finish(&timeline->events[i]);
+	}
+
+	memmove(&timeline->events[begin], &timeline->events[end],
+			(timeline->len - end) * sizeof(*timeline->events));
+
+	if (begin == 0) {
+		rows_move(timeline, end, timeline->len, 0);
+		timeline->top_event -= timeline->scrolled ? end : 0;
+	} else {
+		rows_move(timeline, 0, begin, 0);
+		timeline->detached = true;
+	}
+
+	timeline->len -= end - begin;
+
+	tree_build(timeline);
+}
+
+/* Returns how many of the oldest events can be evicted so that the events
+ * before the rest can still be fetched, 0 if the pane shows them. */
+static size_t
+oldest_evictable(const struct timeline *timeline) {
+	size_t end = TIMELINE_EVICT;
+
+	while (end < timeline->len && !timeline->events[end].token) {
+		end++;
+	}
+
+	/* Without a token the history beyond is lost anyway. */
+	if (end == timeline->len) {
+		end = TIMELINE_EVICT;
+	}
+
+	return timeline->scrolled && timeline->top_event < end ? 0 : end;
+}
+
+/* Returns the index after the last event that the scrolled pane shows. */
+static size_t
+pane_end(struct timeline *timeline) {
+	size_t event = timeline->top_event;
+	int below = event_lines(timeline, event) - timeline->top_line;
+
+	while (event + 1 < timeline->len && below < (int) view_rows(timeline)) {
+		below += event_lines(timeline, ++event);
+	}
+
+	return event + 1;
+}
+
+static void
+clear_row(int y, int cols) {
+	for (int x = 0; x < cols; x++) {
+		tb_char(x, y, TB_DEFAULT, TB_DEFAULT, ' ');
+	}
+}
+
+static void
+draw_row(const struct timeline *timeline, int y, struct timeline_row row) {
+	clear_row(y, timeline->width);
+
+	if (row.event == SIZE_MAX) {
+		return;
+	}
+
+	const struct timeline_event *event = &timeline->events[row.event];
+	int x = 0, line = 0, width = 0;
+
+	for (size_t i = 0; i < event->len && line <= row.line; i++) {
+		uint32_t uc = width_sanitize(event->text[i], &width);
+
+		/* Don't print newlines directly as they mess up the screen. */
+		if (line == row.line && !width_forcebreak(width)) {
+			tb_char(x, y, i < event->prefix ? TB_BOLD : TB_DEFAULT, TB_DEFAULT,
+					uc);
+		}
+
+		width_adjust_xy(width, timeline->width, &x, &line);
+	}
+}
+
+/* Typing notifications are cut off instead of wrapped. */
+static void
+draw_typing(const struct timeline *timeline, int y) {
+	clear_row(y, timeline->width);
+
+	int x = 0, line = 0, width = 0;
+
+	for (size_t i = 0; i < timeline->typing_len && line == 0; i++) {
+		uint32_t uc = width_sanitize(timeline->typing[i], &width);
+
+		if (!width_forcebreak(width)) {
+			tb_char(x, y, TB_DEFAULT, TB_DEFAULT, uc);
+		}
+
+		width_adjust_xy(width, timeline->width, &x, &line);
+	}
+}
+
+int
+timeline_init(struct timeline *timeline) {
+	*timeline = (struct timeline){0};
+
+	if (!(timeline->events =
+			  malloc(TIMELINE_INITIAL * sizeof(*timeline->events))) ||
+		!(timeline->tree =
+			  calloc(TIMELINE_INITIAL + 1, sizeof(*timeline->tree)))) {
+		timeline_finish(timeline);
+		return -1;
+	}
+
+	timeline->cap = TIMELINE_INITIAL;
+
+	return 0;
+}
+
+void
+timeline_finish(struct timeline *timeline) {
+	for (size_t i = 0; i < timeline->len; i++) {
+		event_finish(&timeline->events[i]);
+	}
+
+	free(timeline->events);
+	free(timeline->tree);
+	free(timeline->rows);
+	free(timeline->typing);
+
+	memset(timeline, 0, sizeof(*timeline));
+}
+
+int
+timeline_add(struct timeline *timeline, const char *event_id,
+			 const char *sender, const char *body, const char *token) {
+	/* The events after the newest one are missing, they're shown again once
+	 * the pane reaches it. */
+	if (timeline->detached) {
+		return 0;
+	}
+
+	if (timeline->len >= TIMELINE_MAX) {
+		size_t evictable = oldest_evictable(timeline);
+
+		if (evictable == 0) {
+			timeline->detached = true;
+			return 0;
+		}
+
+		evict(timeline, 0, evictable);
+	}
+
+	struct timeline_event event;
+
+	if ((reserve(timeline, timeline->len + 1)) == -1 ||
+		(event_init(&event, timeline->width, event_id, sender, body, token)) ==
+			-1) {
+		return -1;
+	}
+
+	/* The node of the new event covers the events after the last node that
+	 * ends before its range, which only depends on the events before it. */
+	size_t index = ++timeline->len;
+
+	timeline->events[index - 1] = event;
+	timeline->tree[index] = (size_t) event.lines +
+							lines_before(timeline, index - 1) -
+							lines_before(timeline, index - lowbit(index));
+
+	return 0;
+}
+
+int
+timeline_add_older(struct timeline *timeline,
+				   const struct timeline_message *messages, size_t len,
+				   const char *token) {
+	char *copy = NULL;
+
+	if (token && !(copy = strdup(token))) {
+		return -1;
+	}
+
+	/* Nothing to show, but there may be more before. */
+	if (len == 0) {
+		if (timeline->len > 0) {
+			free(timeline->events[0].token);
+			timeline->events[0].token = copy;
+		} else {
+			free(copy);
+		}
+
+		return 0;
+	}
+
+	struct timeline_event *older = calloc(len, sizeof(*older));
+
+	if (!older) {
+		free(copy);
+		return -1;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		const struct timeline_message *message = &messages[len - i - 1];
+
+		if ((event_init(&older[i], timeline->width, message->event_id,
+						message->sender, message->body, NULL)) == -1) {
+			while (i > 0) {
+				event_finish(&older[--i]);
+			}
+
+			free(older);
+			free(copy);
+			return -1;
+		}
+	}
+
+	older[0].token = copy;
+
+	/* The pane shows the oldest events when more are fetched. */
+	if ((timeline->len + len) > TIMELINE_MAX && timeline->scrolled) {
+		size_t keep = TIMELINE_MAX > (len + TIMELINE_EVICT)
+						  ? TIMELINE_MAX - len - TIMELINE_EVICT
+						  : 0;
+
+		size_t end = pane_end(timeline);
+
+		keep = keep > end ? keep : end;
+
+		if (keep < timeline->len) {
+			evict(timeline, keep, timeline->len);
+		}
+	}
+
+	if ((reserve(timeline, timeline->len + len)) == -1) {
+		for (size_t i = 0; i < len; i++) {
+			event_finish(&older[i]);
+		}
+
+		free(older);
+		return -1;
+	}
+
+	memmove(&timeline->events[len], timeline->events,
+			timeline->len * sizeof(*timeline->events));
+	memcpy(timeline->events, older, len * sizeof(*older));
+	free(older);
+
+	rows_move(timeline, 0, timeline->len, len);
+	timeline->top_event += timeline->scrolled ? len : 0;
+	timeline->len += len;
+
+	tree_build(timeline);
+
+	return 0;
+}
+
+void
+timeline_clear(struct timeline *timeline) {
+	for (size_t i = 0; i < timeline->len; i++) {
+		event_finish(&timeline->events[i]);
+	}
+
+	timeline->len = 0;
+	timeline->scrolled = false;
+	timeline->detached = false;
+
+	timeline_invalidate(timeline);
+}
+
+const char *
+timeline_history_token(const struct timeline *timeline) {
+	return timeline->len > 0 ? timeline->events[0].token : NULL;
+}
+
+bool
+timeline_top_visible(const struct timeline *timeline) {
+	return timeline->scrolled
+			   ? timeline->top_event == 0 && timeline->top_line == 0
+			   : total_lines(timeline) <= view_rows(timeline);
+}
+
+int
+timeline_redact(struct timeline *timeline, const char *event_id) {
+	/* Redactions are usually of recent events. */
+	for (size_t i = timeline->len; i > 0; i--) {
+		struct timeline_event *event = &timeline->events[i - 1];
+
+		if ((strcmp(event->event_id, event_id)) != 0) {
+			continue;
+		}
+
+		uint32_t *text =
+			malloc((event->prefix + strlen(redacted)) * sizeof(*text));
+
+		if (!text) {
+			return -1;
+		}
+
+		memcpy(text, event->text, event->prefix * sizeof(*text));
+
+		free(event->text);
+
+		event->text = text;
+		event->len =
+			event->prefix + utf8_decode(redacted, &text[event->prefix]);
+		event->width = 0;
+		event->version++;
+
+		break;
+	}
+
+	return 0;
+}
+
+int
+timeline_set_typing(struct timeline *timeline, const char *typing) {
+	uint32_t *text = NULL;
+	size_t len = 0;
+
+	if (typing && *typing) {
+		if (!(text = malloc(strlen(typing) * sizeof(*text)))) {
+			return -1;
+		}
+
+		len = utf8_decode(typing, text);
+	}
+
+	free(timeline->typing);
+
+	timeline->typing = text;
+	timeline->typing_len = len;
+	timeline->typing_damaged = true;
+
+	return 0;
+}
+
+int
+timeline_redraw(struct timeline *timeline, int height) {
+	/* The last row shows who is typing. */
+	int view = height - 1;
+
+	if (view < 0) {
+		return 0;
+	}
+
+	if (height != timeline->height || tb_width() != timeline->width) {
+		struct timeline_row *rows = realloc(
+			timeline->rows, (size_t) (view > 0 ? view : 1) * sizeof(*rows));
+
+		if (!rows) {
+			return -1;
+		}
+
+		/* Unlike any row that can be drawn. */
+		for (int y = 0; y < view; y++) {
+			rows[y] = (struct timeline_row){.event = SIZE_MAX, .line = -1};
+		}
+
+		timeline->rows = rows;
+		timeline->height = height;
+		timeline->width = tb_width();
+		timeline->typing_damaged = true;
+	}
+
+	size_t event = timeline->top_event;
+	int line = timeline->top_line;
+
+	/* Follow the newest event once the anchor is within a pane of it. */
+	if (timeline->scrolled) {
+		int lines = event_lines(timeline, event);
+
+		/* The event may have fewer lines after a resize or redaction. */
+		if (line >= lines) {
+			line = lines - 1;
+		}
+
+		int below = lines - line;
+
+		for (size_t i = event + 1; below < view && i < timeline->len; i++) {
+			below += event_lines(timeline, i);
+		}
+
+		timeline->scrolled = below >= view;
+		timeline->top_line = line;
+	}
+
+	/* Count lines back from the newest event until the pane is filled, the
+	 * first visible event may only be partially visible. */
+	if (!timeline->scrolled) {
+		int total = 0;
+
+		event = timeline->len;
+
+		while (event > 0 && total < view) {
+			total += event_lines(timeline, --event);
+		}
+
+		line = total > view ? total - view : 0;
+	}
+
+	for (int y = 0; y < view; y++) {
+		struct timeline_row row = {.event = SIZE_MAX};
+
+		if (event < timeline->len) {
+			row = (struct timeline_row){
+				.event = event,
+				.line = line,
+				.version = timeline->events[event].version,
+			};
+
+			if (++line == event_lines(timeline, event)) {
+				event++;
+				line = 0;
+			}
+		}
+
+		struct timeline_row *drawn = &timeline->rows[y];
+
+		if (row.event != drawn->event || row.line != drawn->line ||
+			row.version != drawn->version) {
+			draw_row(timeline, y, row);
+			*drawn = row;
+		}
+	}
+
+	if (timeline->typing_damaged) {
+		draw_typing(timeline, view);
+		timeline->typing_damaged = false;
+	}
+
+	return 0;
+}
+
+void
+timeline_invalidate(struct timeline *timeline) {
+	timeline->height = 0;
+}
+
+void
+timeline_scroll(struct timeline *timeline, int delta) {
+	size_t view = view_rows(timeline);
+	size_t total = total_lines(timeline);
+	size_t bottom = total > view ? total - view : 0;
+	size_t top = bottom;
+	size_t by = delta < 0 ? (size_t) -(long) delta : (size_t) delta;
+
+	if (timeline->scrolled) {
+		top = lines_before(timeline, timeline->top_event) +
+			  (size_t) timeline->top_line;
+		top = top < bottom ? top : bottom;
+	}
+
+	if (delta < 0) {
+		top = by < top ? top - by : 0;
+	} else {
+		top = by < (bottom - top) ? top + by : bottom;
+	}
+
+	timeline_scroll_to(timeline, top);
+}
+
+void
+timeline_scroll_to(struct timeline *timeline, size_t line) {
+	size_t view = view_rows(timeline);
+	size_t total = total_lines(timeline);
+
+	if (line >= total || (total - line) <= view) {
+		timeline->scrolled = false;
+		return;
+	}
+
+	size_t offset = 0;
+
+	timeline->top_event = find_line(timeline, line, &offset);
+	timeline->top_line = (int) offset;
+	timeline->scrolled = true;
+}
@@ -0,0 +1,111 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* An event as it's displayed, "sender: body" wrapped like the input field. */
+struct timeline_event {
+	char *event_id;
+	char *token;	/* nullable, fetches the events before this one. */
+	uint32_t *text; /* Codepoints. */
+	size_t len;
+	size_t prefix;	  /* The codepoints of "sender: ". */
+	unsigned version; /* Incremented when the text changes. */
+	int lines;		  /* Wrapped lines at width. */
+	int width;		  /* The width that lines was counted at, 0 if never. */
+};
+
+/* An event to add, the strings are copied. */
+struct timeline_message {
+	const char *event_id;
+	const char *sender;
+	const char *body;
+};
+
+/* What a row of the pane showed when it was last drawn. */
+struct timeline_row {
+	size_t event; /* SIZE_MAX if the row is empty. */
+	int line;	  /* Of the wrapped event. */
+	unsigned version;
+};
+
+/* The events of a room in a pane above the input field, the latest ones unless
+ * it's scrolled back. Each redraw works out what every row shows and only draws
+ * the rows that show something else than in the last one, so an event that
+ * arrives or changes only costs the rows it occupies unless the pane has to
+ * scroll. A bounded window of the history is kept, older events are added as
+ * the pane reaches them. */
+struct timeline {
+	struct timeline_event *events; /* Oldest first. */
+	size_t len;
+	size_t cap;
+	/* Fenwick tree of the lines of events, 1-based with cap + 1 nodes. */
+	size_t *tree;
+	struct timeline_row *rows; /* Top to bottom, the typing row excluded. */
+	int height; /* Rows of the pane in the last redraw, 0 to redraw all. */
+	int width;	/* Columns of the pane in the last redraw. */
+	uint32_t *typing; /* nullable, shown on the last row of the pane. */
+	size_t typing_len;
+	bool typing_damaged;
+	/* The first row shows line top_line of top_event if scrolled, otherwise
+	 * the pane follows the newest event. */
+	size_t top_event;
+	int top_line;
+	bool scrolled;
+	/* The newest events were evicted to make room for older ones, the newest
+	 * event of the room isn't in the timeline. */
+	bool detached;
+};
+
+int
+timeline_init(struct timeline *timeline);
+void
+timeline_finish(struct timeline *timeline);
+
+/* Append an event, token fetches the events before it. Dropped if the timeline
+ * is detached. */
+/* nullable: token */
+int
+timeline_add(struct timeline *timeline, const char *event_id,
+			 const char *sender, const char *body, const char *token);
+/* Insert events that are older than every other, given newest first as they
+ * are fetched. token fetches the events before the oldest one. */
+/* nullable: token */
+int
+timeline_add_older(struct timeline *timeline,
+				   const struct timeline_message *messages, size_t len,
+				   const char *token);
+/* Remove every event. */
+void
+timeline_clear(struct timeline *timeline);
+/* Returns the token that fetches the events before the oldest one, NULL if
+ * there's none. */
+const char *
+timeline_history_token(const struct timeline *timeline);
+/* Whether the first row shows the start of the oldest event. */
+bool
+timeline_top_visible(const struct timeline *timeline);
+/* Replace the body of the event, if it's in the timeline. */
+int
+timeline_redact(struct timeline *timeline, const char *event_id);
+/* Set who is typing, the text is copied. */
+/* nullable: typing */
+int
+timeline_set_typing(struct timeline *timeline, const char *typing);
+/* Redraw the rows of the pane, which are the first height rows of the screen,
+ * that changed since the last redraw. */
+int
+timeline_redraw(struct timeline *timeline, int height);
+/* Redraw every row next time, as after the screen was cleared. */
+void
+timeline_invalidate(struct timeline *timeline);
+/* Scroll by delta lines, back into the history if it's negative. */
+void
+timeline_scroll(struct timeline *timeline, int delta);
+/* Scroll so that the first row shows the given line of the whole history,
+ * counting from 0. Follows the newest event if that's within a pane of it. */
+void
+timeline_scroll_to(struct timeline *timeline, size_t line);
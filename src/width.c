@@ -0,0 +1,124 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include "width.h"
+#include <stdbool.h>
+#include <string.h>
+
+#include "width_table.h"
+
+/* Classify this many codepoints at once, the compiler picks the instructions
+ * for the target (SSE2, NEON, ...). */
+typedef uint32_t width_vec __attribute__((vector_size(16)));
+
+enum {
+	WIDTH_VEC_LEN = sizeof(width_vec) / sizeof(uint32_t),
+};
+
+static bool
+is_printable_ascii(uint32_t uc) {
+	/* Controls below ' ' wrap around. */
+	return (uc - ' ') <= ('~' - ' ');
+}
+
+int
+width_uc(uint32_t uc) {
+	if (is_printable_ascii(uc)) {
+		return 1;
+	}
+
+	if (uc >= 0x110000) {
+		return -1;
+	}
+
+	unsigned packed =
+		width_stage2[width_stage1[uc >> WIDTH_SHIFT]]
+					[(uc & ((1U << WIDTH_SHIFT) - 1)) / 4];
+
+	return (int) ((packed >> ((uc % 4) * 2)) & 3) - 1;
+}
+
+uint32_t
+width_sanitize(uint32_t uc, int *width) {
+	int tmp_width = width_uc(uc);
+
+	switch (uc) {
+	case '\n':
+		*width = 0;
+		return uc;
+	case '\t':
+		*width = 1;
+		return ' ';
+	default:
+		if (tmp_width <= 0 || tmp_width > WIDTH_MAX) {
+			*width = 1;
+			return '?';
+		}
+
+		*width = tmp_width;
+		return uc;
+	}
+}
+
+bool
+width_forcebreak(int width) {
+	return width == 0;
+}
+
+static bool
+should_scroll(int x, int width, int cols) {
+	return (x >= (cols - width) || width_forcebreak(width));
+}
+
+int
+width_adjust_xy(int width, int cols, int *x, int *y) {
+	int original_y = *y;
+
+	if (should_scroll(*x, width, cols)) {
+		*x = 0;
+		(*y)++;
+	}
+
+	/* Newline, already scrolled. */
+	if (width_forcebreak(width)) {
+		return *y - original_y;
+	}
+
+	*x += width;
+
+	/* We must accomodate for another character to move the cursor to the next
+	 * line, which prevents us from adding an unreachable character. */
+	if (should_scroll(*x, WIDTH_MAX, cols)) {
+		*x = 0;
+		(*y)++;
+	}
+
+	return *y - original_y;
+}
+
+size_t
+width_ascii_run(const uint32_t *ucs, size_t len) {
+	size_t i = 0;
+
+	for (; (len - i) >= WIDTH_VEC_LEN; i += WIDTH_VEC_LEN) {
+		width_vec vec;
+		uint64_t outside[2];
+
+		memcpy(&vec, &ucs[i], sizeof(vec));
+
+		/* Each lane is all ones if it's outside of the range. */
+		width_vec mask = (vec - ' ') > ('~' - ' ');
+
+		memcpy(outside, &mask, sizeof(outside));
+
+		if (outside[0] | outside[1]) {
+			break;
+		}
+	}
+
+	while (i < len && is_printable_ascii(ucs[i])) {
+		i++;
+	}
+
+	return i;
+}
@@ -0,0 +1,33 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	WIDTH_MAX = 2, /* The widest character that is displayed as is. */
+};
+
+/* Returns the number of columns that uc takes like wcwidth() does in a UTF-8
+ * locale, 0 for combining characters and -1 for non-printable ones. Unlike
+ * wcwidth(), it's a table lookup that doesn't depend on the locale. */
+int
+width_uc(uint32_t uc);
+/* Returns the number of leading codepoints that are printable ASCII, which all
+ * take a single column. */
+size_t
+width_ascii_run(const uint32_t *ucs, size_t len);
+/* Returns the character to display for uc and its width. Tabs become a space
+ * and characters that can't be displayed a '?', a newline is 0 columns wide. */
+uint32_t
+width_sanitize(uint32_t uc, int *width);
+/* Whether a character of this width breaks the line, that is, a newline. */
+bool
+width_forcebreak(int width);
+/* Move x and y past a character of this width on lines of cols columns,
+ * wrapping before it if it doesn't fit. Returns the number of times y was
+ * advanced. */
+int
+width_adjust_xy(int width, int cols, int *x, int *y);
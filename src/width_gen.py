@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2021 git-bruh
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+"""Generate width_table.h, the column widths of every codepoint, from the
+Unicode database that Python was built with. The rules follow glibc's
+wcwidth() in UTF-8 locales so that the client keeps rendering the same.
+
+Usage: python3 src/width_gen.py > src/width_table.h"""
+
+import unicodedata
+
+MAX = 0x110000
+SHIFT = 8  # Codepoints per block = 1 << SHIFT.
+
+# Prepended_Concatenation_Mark, which unicodedata doesn't expose. They're
+# printed, unlike the other format characters.
+PREPENDED = {0x600, 0x601, 0x602, 0x603, 0x604, 0x605, 0x6DD, 0x70F, 0x890,
+             0x891, 0x8E2, 0x110BD, 0x110CD}
+
+
+def width(cp):
+    char = chr(cp)
+    category = unicodedata.category(char)
+
+    if cp == 0:
+        return 0
+    if category in ("Cc", "Cs", "Cn", "Zl", "Zp"):
+        return -1
+    if cp == 0xAD or cp in PREPENDED:
+        return 1
+    # Combining marks, format characters and Hangul vowels and final
+    # consonants, which join the preceding syllable.
+    if (category in ("Mn", "Me", "Cf") or 0x1160 <= cp <= 0x11FF or
+            0xD7B0 <= cp <= 0xD7FF or cp == 0x200B):
+        return 0
+    # glibc also treats circled numbers on black squares and the hexagrams as
+    # wide.
+    if (unicodedata.east_asian_width(char) in ("W", "F") or
+            0x3248 <= cp <= 0x324F or 0x4DC0 <= cp <= 0x4DFF):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    block_index = {}
+    stage1 = []
+
+    for start in range(0, MAX, 1 << SHIFT):
+        # 2 bits per codepoint, width + 1.
+        packed = bytearray((1 << SHIFT) // 4)
+
+        for i in range(1 << SHIFT):
+            packed[i // 4] |= (width(start + i) + 1) << ((i % 4) * 2)
+
+        packed = bytes(packed)
+
+        if packed not in block_index:
+            block_index[packed] = len(blocks)
+            blocks.append(packed)
+
+        stage1.append(block_index[packed])
+
+    assert len(blocks) <= 256
+
+    print("#pragma once")
+    print("/* SPDX-FileCopyrightText: 2021 git-bruh")
+    print(" * SPDX-License-Identifier: GPL-3.0-or-later */")
+    print()
+    print("/* Generated by width_gen.py from Unicode %s, do not edit. */" %
+          unicodedata.unidata_version)
+    print()
+    print("enum {")
+    print("\tWIDTH_SHIFT = %d," % SHIFT)
+    print("};")
+    print()
+    print("/* The block of every 1 << WIDTH_SHIFT codepoints. */")
+    print("static const uint8_t width_stage1[%d] = {" % len(stage1))
+    for i in range(0, len(stage1), 16):
+        print("\t" + ", ".join("%d" % b for b in stage1[i:i + 16]) + ",")
+    print("};")
+    print()
+    print("/* Width + 1 of each codepoint in the block, 2 bits each from the "
+          "least\n * significant ones. */")
+    print("static const uint8_t width_stage2[%d][%d] = {" %
+          (len(blocks), (1 << SHIFT) // 4))
+    for block in blocks:
+        print("\t{")
+        for i in range(0, len(block), 12):
+            print("\t\t" + ", ".join("0x%02X" % b for b in block[i:i + 12]) +
+                  ",")
+        print("\t},")
+    print("};")
+
+
+if __name__ == "__main__":
+    main()